@@ -0,0 +1,51 @@
+#ifndef ALLOCATION_COUNTER_HPP_INCLUDED
+#define ALLOCATION_COUNTER_HPP_INCLUDED
+
+#include <atomic>
+#include <new>
+#include <stdint.h>
+#include <stdlib.h>
+
+///replaces the global operator new with one that counts, so include this from exactly one translation unit of an executable
+
+static std::atomic<uint64_t> allocation_count{0};
+
+///gcc can't see that malloc and free are what back the replaced operators
+#ifdef __GNUC__
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(size_t size)
+{
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+
+    if(void* ptr = malloc(size == 0 ? 1 : size))
+        return ptr;
+
+    throw std::bad_alloc();
+}
+
+///std::stable_sort's temporary buffer, among others, comes from here. Freed by the operator delete below like everything else
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+
+    return malloc(size == 0 ? 1 : size);
+}
+
+void operator delete(void* ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+#ifdef __GNUC__
+#pragma GCC diagnostic pop
+#endif
+
+#endif // ALLOCATION_COUNTER_HPP_INCLUDED
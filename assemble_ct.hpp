@@ -0,0 +1,163 @@
+#ifndef ASSEMBLE_CT_HPP_INCLUDED
+#define ASSEMBLE_CT_HPP_INCLUDED
+
+#include <array>
+#include <string_view>
+#include "base_asm.hpp"
+
+///a string literal which can be passed as a template argument
+template<size_t N>
+struct fixed_string
+{
+    char data[N] = {};
+
+    constexpr
+    fixed_string(const char (&in)[N])
+    {
+        for(size_t i=0; i < N; i++)
+            data[i] = in[i];
+    }
+
+    constexpr
+    std::string_view view() const
+    {
+        return std::string_view(data, N - 1);
+    }
+};
+
+///a copy of an error message which can be passed as a template argument, so that it shows up in compiler output
+struct ct_error_message
+{
+    char data[128] = {};
+
+    constexpr
+    ct_error_message(){}
+
+    constexpr
+    ct_error_message(std::string_view in)
+    {
+        for(size_t i=0; i < in.size() && i < sizeof(data) - 1; i++)
+            data[i] = in[i];
+    }
+};
+
+struct ct_assembly_status
+{
+    size_t size = 0;
+    bool ok = true;
+    int line = 0;
+    ct_error_message msg;
+};
+
+namespace assemble_ct_detail
+{
+    ///encodes text into mem and resolves every fixup. None of the debug maps are built
+    template<typename Mem>
+    constexpr
+    ct_assembly_status assemble_into(std::string_view text, Mem& mem, uint16_t location)
+    {
+        size_only_vector<uint16_t> translation_map;
+        size_only_vector<uint16_t> pc_to_source_line;
+        size_only_vector<uint16_t> source_line_to_pc;
+
+        assembler_settings sett;
+        symbol_table sym;
+        sym.base_offset = location;
+
+        basic_opcode_adder_data<Mem, size_only_vector<uint16_t>> adder(text, mem, translation_map, pc_to_source_line, source_line_to_pc);
+
+        ct_assembly_status status;
+
+        std::string_view remaining = text;
+
+        while(remaining.size() > 0)
+        {
+            auto error_opt = adder.next(sym, remaining, sett);
+
+            if(error_opt.has_value())
+            {
+                status.ok = false;
+                status.line = error_opt.value().line;
+                status.msg = ct_error_message(error_opt.value().msg);
+                return status;
+            }
+        }
+
+        if(adder.condition_depth != 0)
+        {
+            status.ok = false;
+            status.msg = ct_error_message("No .endif");
+            return status;
+        }
+
+        adder.flush_fixups(sym);
+
+        std::vector<delayed_expression> unresolved;
+
+        for(const delayed_expression& delayed : sym.expressions)
+        {
+            auto patch_result = resolve_delayed_expression(mem, sym, delayed, false, unresolved);
+
+            if(patch_result.has_value())
+            {
+                status.ok = false;
+                status.line = adder.line_of(delayed.expression.data() - text.data());
+                status.msg = ct_error_message(patch_result.value());
+                return status;
+            }
+        }
+
+        status.size = mem.size();
+        return status;
+    }
+
+    ///the size of a program is independent of the values of its labels, as forward references are never packed
+    constexpr
+    ct_assembly_status count(std::string_view text, uint16_t location)
+    {
+        size_only_vector<uint16_t> mem;
+
+        return assemble_into(text, mem, location);
+    }
+
+    template<size_t N>
+    constexpr
+    std::array<uint16_t, N> emit(std::string_view text, uint16_t location)
+    {
+        stack_vector<uint16_t, (int)N> mem;
+
+        assemble_into(text, mem, location);
+
+        return mem.svec;
+    }
+
+    ///the failing line and message are in the template arguments of this instantiation
+    template<int line, ct_error_message msg>
+    constexpr
+    void report_error()
+    {
+        static_assert(line < 0, "assemble_ct failed, the line and msg are in the template arguments of report_error");
+    }
+}
+
+///assembles source entirely at compile time, into an array of exactly the program's size
+///labels are relative to location, but the program is not padded out to it
+template<fixed_string source, uint16_t location = 0>
+consteval
+auto assemble_ct()
+{
+    constexpr ct_assembly_status counted = assemble_ct_detail::count(source.view(), location);
+
+    if constexpr(!counted.ok)
+    {
+        assemble_ct_detail::report_error<counted.line, counted.msg>();
+
+        return std::array<uint16_t, 0>{};
+    }
+    else
+    {
+        return assemble_ct_detail::emit<counted.size>(source.view(), location);
+    }
+}
+
+#endif // ASSEMBLE_CT_HPP_INCLUDED
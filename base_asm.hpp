@@ -1,14 +1,18 @@
 #ifndef BASE_ASM_HPP_INCLUDED
 #define BASE_ASM_HPP_INCLUDED
 
+#include <atomic>
+#include <memory>
 #include <optional>
 #include <string_view>
 #include <array>
+#include <algorithm>
 #include <tuple>
 #include "stack_vector.hpp"
 #include "shared.hpp"
 #include "util.hpp"
 #include "base_asm_fwd.hpp"
+#include "trace.hpp"
 #include <iostream>
 #include <cmath>
 #include <assert.h>
@@ -17,6 +21,29 @@
 ///TODO: https://github.com/EqualizR/DEQOS/blob/master/AssemblerExtensions.txt
 ///https://github.com/ddevault/organic
 
+///limits for assembling sources which can't be trusted. 0 is unlimited for all of them
+///checked after every statement, .repeat iteration and macro expansion, so a runaway source fails as soon as it crosses one
+struct assembly_budgets
+{
+    ///the size of the image, including any gaps left by .org
+    uint32_t max_words = 0;
+    ///.repeat iterations and macro expansions together
+    uint64_t max_expansion_steps = 0;
+    int max_repeat_depth = 0;
+    ///expressions waiting on a label which isn't defined yet
+    uint32_t max_fixups = 0;
+};
+
+struct prelude_snapshot;
+
+///what assembler_settings::load_file found
+struct loaded_file
+{
+    std::string_view text;
+    ///where it was found. Errors name it, and files it includes are looked for relative to it
+    std::string_view path;
+};
+
 struct assembler_settings
 {
     bool no_packed_constants = false;
@@ -24,6 +51,23 @@ struct assembler_settings
     std::vector<std::string> label_values_to_extract;
     std::vector<std::pair<uint16_t, std::string_view>> provided_symbol_definitions;
     bool allow_unresolved_symbols = false;
+    ///fills in return_info::stats
+    bool collect_stats = false;
+    ///fills in return_info::symbols
+    bool collect_symbols = false;
+    ///reads the files named by .include and .incbin. includer is the path of the file naming it, empty for the source itself
+    ///the returned views must stay valid until assembly has finished. Null disables both directives, which is always the case when
+    ///assembling at compile time. See file_loader
+    std::optional<loaded_file>(*load_file)(void* user, std::string_view path, std::string_view includer) = nullptr;
+    void* load_file_user = nullptr;
+    assembly_budgets budgets;
+    ///polled at every statement and .repeat iteration. Once set, assembly returns an error_info with cancelled set
+    const std::atomic<bool>* cancel = nullptr;
+    ///called every so often, and once at the end, with how far into the source assembly has got and the size of the image so far
+    void(*progress)(void* user, uint64_t bytes_consumed, uint64_t words_emitted) = nullptr;
+    void* progress_user = nullptr;
+    ///made by make_prelude. The program is assembled straight after it, with its symbols and macros in scope, and location is ignored
+    const prelude_snapshot* prelude = nullptr;
 };
 
 constexpr
@@ -132,21 +176,81 @@ bool compatible_scope(std::span<const std::uint32_t> scope_1, std::span<const st
     return true;
 }
 
+///one token of a macro body. Tokens which contain a parameter are split into parts, so that expansion only has to splice
+struct macro_token
+{
+    struct part
+    {
+        std::string_view literal;
+        ///-1 for literal text
+        int param = -1;
+    };
+
+    std::string_view text;
+    ///empty when the token contains no parameters
+    std::vector<part> parts;
+};
+
+///every site waiting on one name which isn't defined yet. Sites are bare label operands and .dat words, real expressions are still delayed
+struct fixup_chain
+{
+    std::string_view name;
+    std::vector<delayed_expression> sites;
+};
+
+///bodies are lexed once, when the macro is defined
+struct macro_definition
+{
+    std::string_view name;
+    std::vector<std::string_view> params;
+    std::vector<macro_token> body;
+};
+
 struct symbol_table
 {
     //std::vector<label> usages;
     std::vector<label> definitions;
     std::vector<define> defines;
     std::vector<delayed_expression> expressions;
+    ///patched as soon as their name is defined. Whatever is left at the end of the pass joins expressions
+    std::vector<fixup_chain> fixups;
+    size_t pending_fixups = 0;
     std::vector<std::string_view> exports;
     uint16_t base_offset = 0;
     uint32_t next_scope_id = 0;
+    ///null unless stats are being collected
+    assembly_stats* stats = nullptr;
+    ///a prelude's table, searched after this one and never modified through it
+    const symbol_table* parent = nullptr;
+    std::vector<macro_definition> macros;
+    ///tokens spliced together by macro expansions, which labels and defines may point into
+    ///the inner vectors never reallocate, so views into them stay valid
+    std::vector<std::vector<char>> expansion_text;
+
+    constexpr
+    const macro_definition* get_macro(std::string_view name) const
+    {
+        for(const macro_definition& m : macros)
+        {
+            if(m.name == name)
+                return &m;
+        }
+
+        if(parent != nullptr)
+            return parent->get_macro(name);
+
+        return nullptr;
+    }
 
     constexpr
     std::optional<uint16_t> get_symbol_definition(std::string_view name, std::span<const std::uint32_t> scope) const
     {
+        DCPU16_ASM_STAT(stats, symbol_lookups, 1);
+
         for(int i=0; i < (int)definitions.size(); i++)
         {
+            DCPU16_ASM_STAT(stats, scope_comparisons, 1);
+
             if(!compatible_scope(scope, definitions[i].scope))
                 continue;
 
@@ -160,10 +264,32 @@ struct symbol_table
                 return defines[i].value;
         }
 
+        if(parent != nullptr)
+            return parent->get_symbol_definition(name, scope);
+
         return std::nullopt;
     }
 };
 
+///every label, not only the exported ones. Depths are counted from base_depth, the scope every label is already inside
+constexpr
+symbol_index make_symbol_index(const symbol_table& sym, uint32_t base_depth = 0)
+{
+    symbol_index ret;
+
+    for(const symbol_table* table = &sym; table != nullptr; table = table->parent)
+    {
+        for(const label& l : table->definitions)
+        {
+            ret.add(l.name, l.offset + table->base_offset, l.scope.size() - base_depth);
+        }
+    }
+
+    ret.build();
+
+    return ret;
+}
+
 constexpr std::optional<std::string_view> consume_expression_token(std::string_view& in)
 {
     while(in.size() > 0 && (in.front() == ' ' || in.front() == '\t')){in.remove_prefix(1);}
@@ -814,6 +940,14 @@ constexpr std::optional<decode_result> decode_value(std::string_view in, arg_pos
         {
             res.extra_word = 0;
             res.expression = extracted;
+
+            ///a lone label always ends up as [next word], so only the word itself needs patching later
+            if(is_label_reference(extracted))
+            {
+                res.label = extracted;
+                return set_val(0x1e);
+            }
+
             return set_val(0x10); // placeholder
         }
     }
@@ -835,6 +969,9 @@ constexpr std::optional<decode_result> decode_value(std::string_view in, arg_pos
 
     if(is_constant(in))
     {
+        if(!constant_fits_word(in))
+            return std::nullopt;
+
         auto val = get_constant_of<uint16_t>(in);
 
         return set_val(decode_pack_constant(val, apos, res.extra_word, sett));
@@ -866,6 +1003,10 @@ constexpr std::optional<decode_result> decode_value(std::string_view in, arg_pos
     {
         res.extra_word = 0;
         res.expression = in;
+
+        if(is_label_reference(in))
+            res.label = in;
+
         return set_val(0x1f); // next word (placeholder)
     }
 
@@ -879,381 +1020,1582 @@ struct opcode
     uint16_t code;
 };
 
-struct opcode_adder_data;
-
-constexpr
-std::optional<error_info> add_opcode_with_prefix(symbol_table& sym, opcode_adder_data& opcode_add, std::string_view& in, size_t& token_text_offset_start, size_t token_start, const stack_vector<uint16_t, MEM_SIZE>& source_to_line, assembler_settings& sett);
-
-struct opcode_adder_data
+///what statements are read from. Either source text, or the tokens of a macro expansion being replayed
+struct token_stream
 {
-    size_t start_size = 0;
-    size_t last_mem_size = 0;
-    size_t last_line = 0;
-
-    stack_vector<uint16_t, MEM_SIZE>& mem;
-    stack_vector<uint16_t, MEM_SIZE>& translation_map;
-    stack_vector<uint16_t, MEM_SIZE>& pc_to_source_line;
-    stack_vector<uint16_t, MEM_SIZE>& source_line_to_pc;
-    stack_vector<uint16_t, MEM_SIZE> source_to_line;
-    std::vector<uint32_t> scope;
-    uint32_t next_scope_id = 0;
+    std::string_view text;
+    std::span<const std::string_view> tokens;
+    bool replaying = false;
 
     constexpr
-    void push_scope()
-    {
-        scope.push_back(next_scope_id++);
-    }
+    token_stream(std::string_view _text) : text(_text){}
 
     constexpr
-    void pop_scope()
-    {
-        if(scope.size() > 0)
-            scope.pop_back();
-    }
+    token_stream(std::span<const std::string_view> _tokens) : tokens(_tokens), replaying(true){}
 
+    ///replayed tokens were already split the way they're consumed, so is_space_delimited only matters for text
     constexpr
-    opcode_adder_data(std::string_view text, stack_vector<uint16_t, MEM_SIZE>& _mem, stack_vector<uint16_t, MEM_SIZE>& _translation_map, stack_vector<uint16_t, MEM_SIZE>& _pc_to_source_line, stack_vector<uint16_t, MEM_SIZE>& _source_line_to_pc) : mem(_mem), translation_map(_translation_map), pc_to_source_line(_pc_to_source_line), source_line_to_pc(_source_line_to_pc)
+    std::string_view consume(bool is_space_delimited)
     {
-        start_size = text.size();
+        if(!replaying)
+            return consume_next(text, is_space_delimited);
 
-        int line = 0;
-        for(int idx = 0; idx < (int)text.size(); idx++)
-        {
-            source_to_line.push_back((uint16_t)line);
+        if(tokens.size() == 0)
+            return "";
 
-            if(text[idx] == '\n')
-            {
-                line++;
-            }
-        }
+        std::string_view ret = tokens.front();
+        tokens = tokens.subspan(1);
 
-        source_line_to_pc.idx = line;
+        return ret;
     }
 
     constexpr
-    std::optional<error_info> next(symbol_table& sym, std::string_view& text, assembler_settings& sett)
+    std::string_view peek(bool is_space_delimited) const
     {
-        size_t offset = start_size - text.size();
+        token_stream copy = *this;
 
-        size_t token_offset = 0;
+        return copy.consume(is_space_delimited);
+    }
 
-        auto error_opt = add_opcode_with_prefix(sym, *this, text, token_offset, offset, source_to_line, sett);
+    constexpr
+    size_t size() const
+    {
+        return replaying ? tokens.size() : text.size();
+    }
+};
 
-        uint16_t source_character = offset + token_offset;
+namespace conditional_directive
+{
+    enum type
+    {
+        NONE,
+        IF,
+        IFDEF,
+        IFNDEF,
+        ELSE,
+        ENDIF,
+    };
+}
 
-        for(size_t i = last_mem_size; i < mem.size(); i++)
-        {
-            translation_map.push_back(source_character);
-            pc_to_source_line.push_back(source_to_line[source_character]);
-        }
+constexpr
+conditional_directive::type get_conditional_directive(std::string_view in)
+{
+    if(in.starts_with('.'))
+        in.remove_prefix(1);
 
-        if(pc_to_source_line.size() > 0)
-        {
-            for(size_t idx = last_line+1; idx <= pc_to_source_line.back(); idx++)
-            {
-                source_line_to_pc[idx] = last_mem_size;
-            }
-        }
+    if(iequal(in, "if"))
+        return conditional_directive::IF;
 
-        last_mem_size = mem.size();
+    if(iequal(in, "ifdef"))
+        return conditional_directive::IFDEF;
 
-        if(pc_to_source_line.size() > 0)
-            last_line = pc_to_source_line.back();
+    if(iequal(in, "ifndef"))
+        return conditional_directive::IFNDEF;
 
-        if(error_opt.has_value())
-        {
-            return {error_opt.value()};
-        }
+    if(iequal(in, "else"))
+        return conditional_directive::ELSE;
 
-        return std::nullopt;
-    }
-};
+    if(iequal(in, "endif"))
+        return conditional_directive::ENDIF;
+
+    return conditional_directive::NONE;
+}
 
+///.if, .ifdef and .ifndef all open a conditional
 constexpr
-std::optional<error_info> add_opcode_with_prefix(symbol_table& sym, opcode_adder_data& opcode_add, std::string_view& in, size_t& token_text_offset_start, size_t token_start, const stack_vector<uint16_t, MEM_SIZE>& source_to_line, assembler_settings& sett)
+bool opens_conditional(conditional_directive::type type)
 {
-    error_info err;
+    return type == conditional_directive::IF || type == conditional_directive::IFDEF || type == conditional_directive::IFNDEF;
+}
 
-    opcode opcodes[] =
+///directives read the rest of their line as space delimited tokens, instructions and macro invocations as comma separated fields
+constexpr
+bool is_space_delimited_directive(std::string_view in)
+{
+    for(std::string_view name : {".def", "def", ".repeat", "repeat", ".export", "export", ".end", "end", ".dat", "dat"})
     {
-        {"set", 0, 1},
-        {"mov", 0, 1},
-        {"add", 0, 2},
-        {"sub", 0, 3},
-        {"mul", 0, 4},
-        {"mli", 0, 5},
-        {"div", 0, 6},
-        {"dvi", 0, 7},
-        {"mod", 0, 8},
-        {"mdi", 0, 9},
-        {"and", 0, 0x0a},
-        {"bor", 0, 0x0b},
-        {"xor", 0, 0x0c},
-        {"shr", 0, 0x0d},
-        {"asr", 0, 0x0e},
-        {"shl", 0, 0x0f},
-        {"ifb", 0, 0x10},
-        {"ifc", 0, 0x11},
-        {"ife", 0, 0x12},
-        {"ifn", 0, 0x13},
-        {"ifg", 0, 0x14},
-        {"ifa", 0, 0x15},
-        {"ifl", 0, 0x16},
-        {"ifu", 0, 0x17},
-        {"adx", 0, 0x1a},
-        {"sbx", 0, 0x1b},
-        {"snd", 0, 0x1c}, ///extension for multiprocessor. sends a value on a channel
-        {"rcv", 0, 0x1d}, ///extension for multiprocessor. receives a value on a channels
-        {"sti", 0, 0x1e},
-        {"std", 0, 0x1f},
-
-        {"jsr", 1, 0x01},
-        {"int", 1, 0x08},
-        {"iag", 1, 0x09},
-        {"ias", 1, 0x0a},
-        {"rfi", 1, 0x0b},
-        {"iaq", 1, 0x0c},
-        {"hwn", 1, 0x10},
-        {"hwq", 1, 0x11},
-        {"hwi", 1, 0x12},
-        {"ifw", 1, 0x1a}, ///extension for multiprocessor. only executes next instruction if the channel is waiting to write a value
-        {"ifr", 1, 0x1b}, ///extension for multiprocessor. only executes next instruction if the channel is waiting to read a value
-
-        {"brk", 2, 0x0},
-        // could have an instruction that swaps modes into extended alt proposal mode
-    };
+        if(iequal(in, name))
+            return true;
+    }
 
-    size_t old_size = in.size();
+    return get_conditional_directive(in) != conditional_directive::NONE;
+}
 
-    auto consumed_name = consume_next(in, true);
+///the first word of a line, without tokenizing the rest of it. Empty for blank lines and comments
+constexpr
+std::string_view first_word(std::string_view line)
+{
+    size_t start = line.find_first_not_of(" \t\r");
 
-    size_t num_removed = old_size - (in.size() + consumed_name.size());
+    if(start == std::string_view::npos)
+        return line.substr(0, 0);
 
-    token_text_offset_start = num_removed;
+    size_t end = line.find_first_of(" \t\r;", start);
 
-    err.name_in_source = consumed_name;
-    err.character = token_text_offset_start + token_start;
-    err.line = opcode_add.source_to_line[err.character];
+    return line.substr(start, end == std::string_view::npos ? std::string_view::npos : end - start);
+}
 
-    if(consumed_name.size() == 0)
-        return std::nullopt;
+///passes over an inactive conditional region without assembling any of it. Only the first word of each line is looked at, to track nesting
+///stops just after the .endif which closes the region, or its .else if stop_at_else. Returns which it was, or nullopt if the input ran out first
+///stops at a second .else in any one conditional, and returns NONE. Without stop_at_else, the region is already past its .else
+constexpr
+std::optional<conditional_directive::type> skip_conditional(token_stream& in, bool stop_at_else)
+{
+    ///whether each conditional being passed over has had its .else, innermost last
+    std::vector<bool> else_seen{!stop_at_else};
+    bool duplicate_else = false;
 
-    if(is_label_definition(consumed_name))
+    auto closes = [&](std::string_view word)
     {
-        if(consumed_name.starts_with(':'))
-            consumed_name.remove_prefix(1);
-        if(consumed_name.ends_with(':'))
-            consumed_name.remove_suffix(1);
+        conditional_directive::type type = get_conditional_directive(word);
 
-        auto trimmed = trim_start(consumed_name, [](char c) {return c == ' ' || c == '\n' || c == ','; });
+        if(opens_conditional(type))
+        {
+            else_seen.push_back(false);
+        }
+        else if(type == conditional_directive::ENDIF)
+        {
+            else_seen.pop_back();
+            return else_seen.size() == 0;
+        }
+        else if(type == conditional_directive::ELSE)
+        {
+            duplicate_else = else_seen.back();
+            else_seen.back() = true;
 
-        label l;
-        l.name = trimmed;
-        l.offset = opcode_add.mem.size();
-        l.scope = opcode_add.scope;
+            return duplicate_else || (else_seen.size() == 1 && stop_at_else);
+        }
 
-        sym.definitions.push_back(l);
-        return std::nullopt;
-    }
+        return false;
+    };
 
-    if(iequal(".repeat", consumed_name) || iequal("repeat", consumed_name))
+    auto closed_by = [&](std::string_view word)
     {
-        std::string_view times = consume_next(in, true);
+        return duplicate_else ? conditional_directive::NONE : get_conditional_directive(word);
+    };
 
-        if(!is_constant(times))
+    if(in.replaying)
+    {
+        while(in.tokens.size() > 0)
         {
-            err.msg = ".repeat values must be a constant";
-            return err;
+            std::string_view token = in.tokens.front();
+            in.tokens = in.tokens.subspan(1);
+
+            if(closes(token))
+                return closed_by(token);
         }
 
-        uint16_t val = get_constant_of<uint16_t>(times);
+        return std::nullopt;
+    }
 
-        std::string_view start_view = in;
+    ///whatever is left of the line which opened the region
+    size_t end = in.text.find('\n');
+    in.text.remove_prefix(end == std::string_view::npos ? in.text.size() : end + 1);
 
-        for(uint16_t i=0; i < val; i++)
-        {
-            opcode_add.push_scope();
+    while(in.text.size() > 0)
+    {
+        end = in.text.find('\n');
+        std::string_view word = first_word(in.text.substr(0, end));
 
-            in = start_view;
+        in.text.remove_prefix(end == std::string_view::npos ? in.text.size() : end + 1);
 
-            while(peek_next(in, true) != ".end" && peek_next(in, true) != "end")
-            {
-                auto err_opt = opcode_add.next(sym, in, sett);
+        if(closes(word))
+            return closed_by(word);
+    }
 
-                if(err_opt.has_value())
-                    return err_opt;
-            }
+    return std::nullopt;
+}
 
-            std::string_view str = consume_next(in, true);
+///splits a macro body into the tokens that add_opcode_with_prefix will consume when it's replayed. Consumes up to and including .endmacro
+///returns an error message on failure
+constexpr
+std::optional<std::string_view> lex_macro_body(std::string_view& in, std::vector<std::string_view>& tokens)
+{
+    while(in.size() > 0)
+    {
+        size_t end = in.find('\n');
+        std::string_view line = in.substr(0, end);
 
-            if(str != ".end" && str != "end")
-            {
-                err.msg = "Fatal error, no .end?";
-                return err;
-            }
+        in.remove_prefix(end == std::string_view::npos ? in.size() : end + 1);
 
-            opcode_add.pop_scope();
-        }
+        auto first = consume_next(line, true);
 
-        if(val == 0)
+        while(is_label_definition(first))
         {
-            std::string_view str = consume_next(in, true);
-
-            if(str != ".end" && str != "end")
-            {
-                err.msg = "Fatal error, no .end?";
-                return err;
-            }
+            tokens.push_back(first);
+            first = consume_next(line, true);
         }
 
-        return std::nullopt;
-    }
+        if(first.size() == 0)
+            continue;
 
-    if(iequal(".def", consumed_name) || iequal("def", consumed_name))
-    {
-        auto label_name = consume_next(in, true);
+        if(iequal(first, ".endmacro") || iequal(first, "endmacro"))
+            return std::nullopt;
 
-        if(peek_next(in, true) == ",")
-            consume_next(in, true);
+        if(iequal(first, ".macro") || iequal(first, "macro"))
+            return "Macros can't be defined inside a macro";
 
-        auto label_value = consume_next(in, true);
+        tokens.push_back(first);
 
-        if(!is_constant(label_value))
+        bool is_space_delimited = is_space_delimited_directive(first);
+
+        for(auto token = consume_next(line, is_space_delimited); token.size() > 0; token = consume_next(line, is_space_delimited))
         {
-            err.msg = ".def value must be a constant";
-            return err;
+            tokens.push_back(token);
         }
+    }
 
-        uint16_t val = get_constant_of<uint16_t>(label_value);
-
-        define d;
-        d.name = label_name;
-        d.value = val;
+    return "No .endmacro";
+}
 
-        sym.defines.push_back(d);
+///finds the parameters used in a token, by matching whole identifiers outside of strings
+constexpr
+macro_token make_macro_token(std::string_view text, std::span<const std::string_view> params)
+{
+    macro_token ret;
+    ret.text = text;
 
-        return std::nullopt;
-    }
+    size_t literal_start = 0;
+    size_t i = 0;
 
-    if(iequal(".export", consumed_name) || iequal("export", consumed_name))
+    while(i < text.size())
     {
-        auto to_export = consume_next(in, true);
+        if(text[i] == '\'' || text[i] == '\"')
+        {
+            size_t close = text.find(text[i], i + 1);
 
-        sym.exports.push_back(to_export);
+            i = close == std::string_view::npos ? text.size() : close + 1;
+            continue;
+        }
 
-        return std::nullopt;
-    }
+        if(!isalnum_c(text[i]))
+        {
+            i++;
+            continue;
+        }
 
-    if(iequal(".dat", consumed_name) || iequal("dat", consumed_name))
+        size_t identifier_start = i;
+
+        while(i < text.size() && isalnum_c(text[i]))
+            i++;
+
+        std::string_view identifier = text.substr(identifier_start, i - identifier_start);
+
+        for(int param=0; param < (int)params.size(); param++)
+        {
+            if(identifier != params[param])
+                continue;
+
+            if(identifier_start > literal_start)
+                ret.parts.push_back({text.substr(literal_start, identifier_start - literal_start), -1});
+
+            ret.parts.push_back({"", param});
+            literal_start = i;
+            break;
+        }
+    }
+
+    if(ret.parts.size() > 0 && literal_start < text.size())
+        ret.parts.push_back({text.substr(literal_start), -1});
+
+    return ret;
+}
+
+template<typename Mem, typename Map>
+struct basic_opcode_adder_data;
+
+template<typename Mem, typename Map>
+constexpr
+std::optional<error_info> add_opcode_with_prefix(symbol_table& sym, basic_opcode_adder_data<Mem, Map>& opcode_add, token_stream& in, size_t& token_text_offset_start, size_t token_start, assembler_settings& sett);
+
+///Mem receives the assembled words, and Map the debug maps. Either may be a size_only_vector for passes which don't need them
+template<typename Mem, typename Map>
+struct basic_opcode_adder_data
+{
+    ///the full source text, everything being assembled is a view into this
+    std::string_view source;
+    size_t last_mem_size = 0;
+    size_t last_line = 0;
+
+    Mem& mem;
+    Map& translation_map;
+    Map& pc_to_source_line;
+    Map& source_line_to_pc;
+    ///source character index of the start of every line
+    std::vector<uint32_t> line_starts;
+    std::vector<uint32_t> scope;
+    uint32_t next_scope_id = 0;
+    ///the outermost macro invocation being expanded. Everything it emits is attributed to it
+    std::string_view expansion_site;
+    int expansion_depth = 0;
+    ///paths of included files, file 0 is the source being assembled. source and line_starts always belong to current_file
+    std::vector<std::string_view> files{""};
+    std::vector<file_range> file_ranges;
+    uint16_t current_file = 0;
+    int include_depth = 0;
+    ///addresses here are indices into mem
+    std::vector<segment> segments{segment()};
+    ///counted against assembly_budgets
+    uint64_t expansion_steps = 0;
+    int repeat_depth = 0;
+    ///.if and .else branches which are being assembled, and are waiting on their .endif
+    int condition_depth = 0;
+    ///one per condition_depth, whether that branch comes after its .else
+    std::vector<bool> else_seen;
+    ///for assembler_settings::progress, the end of the last statement in the source being assembled
+    uint64_t bytes_consumed = 0;
+    uint32_t polls = 0;
+
+    ///the message for whichever budget has run out. Running past the address space always fails here, rather than
+    ///only once control gets back to the top level, which an expansion may take a very long time to do
+    constexpr
+    std::optional<std::string_view> over_budget(const symbol_table& sym, const assembler_settings& sett) const
     {
-        bool looping = true;
+        const assembly_budgets& budgets = sett.budgets;
 
-        while(looping)
+        if(mem.overflowed())
+            return "Program does not fit in memory";
+
+        if(budgets.max_words != 0 && mem.size() > budgets.max_words)
+            return "Program is larger than max_words";
+
+        if(budgets.max_expansion_steps != 0 && expansion_steps > budgets.max_expansion_steps)
+            return "More .repeat iterations and macro expansions than max_expansion_steps";
+
+        if(budgets.max_fixups != 0 && sym.expressions.size() + sym.pending_fixups > budgets.max_fixups)
+            return "More forward references than max_fixups";
+
+        return std::nullopt;
+    }
+
+    ///checks for cancellation and the budgets, and reports progress. err is where a failure gets attributed
+    constexpr
+    std::optional<error_info> poll(const symbol_table& sym, const assembler_settings& sett, error_info err)
+    {
+        if(sett.cancel != nullptr && sett.cancel->load(std::memory_order_relaxed))
+        {
+            err.msg = "Assembly cancelled";
+            err.cancelled = true;
+            return err;
+        }
+
+        ///an indirect call per statement would be noticeable, and nobody needs progress that often
+        if(sett.progress != nullptr && (++polls % 1024) == 0)
+            sett.progress(sett.progress_user, bytes_consumed, mem.size());
+
+        if(auto budget_opt = over_budget(sym, sett); budget_opt.has_value())
         {
-            auto value = consume_next(in, true);
+            err.msg = budget_opt.value();
+            return err;
+        }
 
-            if(is_constant(value))
+        return std::nullopt;
+    }
+
+    constexpr
+    void push_scope()
+    {
+        scope.push_back(next_scope_id++);
+    }
+
+    constexpr
+    void pop_scope()
+    {
+        if(scope.size() > 0)
+            scope.pop_back();
+    }
+
+    constexpr
+    size_t line_of(size_t character) const
+    {
+        return std::upper_bound(line_starts.begin(), line_starts.end(), (uint32_t)character) - line_starts.begin() - 1;
+    }
+
+    static constexpr
+    std::vector<uint32_t> find_line_starts(std::string_view text)
+    {
+        std::vector<uint32_t> ret;
+        ret.push_back(0);
+
+        for(int idx = 0; idx < (int)text.size(); idx++)
+        {
+            if(text[idx] == '\n')
+                ret.push_back(idx + 1);
+        }
+
+        return ret;
+    }
+
+    constexpr
+    basic_opcode_adder_data(std::string_view text, Mem& _mem, Map& _translation_map, Map& _pc_to_source_line, Map& _source_line_to_pc) : mem(_mem), translation_map(_translation_map), pc_to_source_line(_pc_to_source_line), source_line_to_pc(_source_line_to_pc)
+    {
+        source = text;
+        line_starts = find_line_starts(text);
+
+        source_line_to_pc.resize(line_starts.size());
+    }
+
+    ///moves emission forwards to index, leaving a zeroed gap which belongs to no segment
+    ///the gap maps to the line before it, so that it doesn't disturb source_line_to_pc
+    constexpr
+    void org(size_t index)
+    {
+        close_segment();
+
+        segment& current = segments.back();
+
+        if(current.size == 0)
+            current.address = index;
+        else
+            segments.push_back({(uint16_t)index, 0});
+
+        ///memory and its maps are still indexed by address, so the gap is filled in, a word per address. Each is filled once, in bulk
+        if(index > mem.size())
+        {
+            mem.append_fill(index - mem.size(), 0);
+            translation_map.append_fill(index - translation_map.size(), 0);
+            pc_to_source_line.append_fill(index - pc_to_source_line.size(), last_line);
+        }
+        else
+        {
+            mem.resize(index);
+            translation_map.resize(index);
+            pc_to_source_line.resize(index);
+        }
+
+        last_mem_size = mem.size();
+    }
+
+    ///mem is clamped to its capacity, so an .org past the end is left with nothing in it
+    constexpr
+    void close_segment()
+    {
+        segment& current = segments.back();
+
+        current.size = mem.size() > current.address ? mem.size() - current.address : 0;
+    }
+
+    ///source_line_to_pc only maps lines of file 0, so it's left alone while the last word came from anywhere else
+    constexpr
+    bool emitting_main_file() const
+    {
+        return current_file == 0 && (file_ranges.size() == 0 || file_ranges.back().file == 0);
+    }
+
+    ///assembles part, a view into whole, which is the text of files[file]. whole_line_starts is borrowed for the duration
+    constexpr
+    std::optional<error_info> assemble_part(symbol_table& sym, uint16_t file, std::string_view whole, std::vector<uint32_t>& whole_line_starts, std::string_view part, assembler_settings& sett)
+    {
+        std::string_view saved_source = source;
+        uint16_t saved_file = current_file;
+
+        source = whole;
+        current_file = file;
+        std::swap(line_starts, whole_line_starts);
+
+        std::optional<error_info> error_opt;
+
+        while(part.size() > 0 && !error_opt.has_value())
+        {
+            error_opt = next(sym, part, sett);
+        }
+
+        std::swap(line_starts, whole_line_starts);
+        current_file = saved_file;
+        source = saved_source;
+
+        return error_opt;
+    }
+
+    ///assembles another file in place, as if its text were at including_line
+    constexpr
+    std::optional<error_info> include(symbol_table& sym, std::string_view path, std::string_view text, size_t including_line, assembler_settings& sett)
+    {
+        trace_scope trace(".include", "file", path);
+
+        size_t first_pc = mem.size();
+
+        files.push_back(path);
+
+        std::vector<uint32_t> included_line_starts = find_line_starts(text);
+
+        include_depth++;
+
+        auto error_opt = assemble_part(sym, files.size() - 1, text, included_line_starts, text, sett);
+
+        include_depth--;
+
+        if(error_opt.has_value())
+            return error_opt;
+
+        if(current_file == 0 && mem.size() > first_pc)
+        {
+            for(size_t idx = last_line+1; idx <= including_line && idx < source_line_to_pc.size(); idx++)
             {
-                opcode_add.mem.push_back(get_constant_of<uint16_t>(value));
+                source_line_to_pc[idx] = first_pc;
             }
-            else if(is_label_reference(value))
+
+            last_line = including_line;
+        }
+
+        return std::nullopt;
+    }
+
+    ///expressions built by a macro expansion keep their own copy of their text, and are attributed to the invocation
+    constexpr
+    void anchor_expression(delayed_expression& delayed) const
+    {
+        if(expansion_depth == 0)
+            return;
+
+        delayed.owned_expression = std::string(delayed.expression);
+        delayed.expression = expansion_site;
+    }
+
+    ///a bare label waits in its name's fixup chain, to be patched when it's defined. Anything else is parsed again once every label is known
+    constexpr
+    void defer(symbol_table& sym, delayed_expression&& delayed, std::optional<std::string_view> label)
+    {
+        if(!label.has_value())
+        {
+            sym.expressions.push_back(std::move(delayed));
+            return;
+        }
+
+        sym.pending_fixups++;
+
+        for(fixup_chain& chain : sym.fixups)
+        {
+            if(chain.name == label.value())
             {
-                auto sym_opt = sym.get_symbol_definition(value, opcode_add.scope);
+                chain.sites.push_back(std::move(delayed));
+                return;
+            }
+        }
 
-                if(sym_opt.has_value())
+        fixup_chain& chain = sym.fixups.emplace_back();
+        chain.name = label.value();
+        chain.sites.push_back(std::move(delayed));
+    }
+
+    ///called as name is defined in defined_scope. Sites which can't see that scope keep waiting
+    constexpr
+    void backpatch(symbol_table& sym, std::string_view name, std::span<const uint32_t> defined_scope, uint16_t value)
+    {
+        for(fixup_chain& chain : sym.fixups)
+        {
+            if(chain.name != name)
+                continue;
+
+            size_t kept = 0;
+
+            for(size_t i=0; i < chain.sites.size(); i++)
+            {
+                if(!compatible_scope(chain.sites[i].scope, defined_scope))
                 {
-                    opcode_add.mem.push_back(sym_opt.value());
+                    if(kept != i)
+                        chain.sites[kept] = std::move(chain.sites[i]);
+
+                    kept++;
+                    continue;
                 }
-                else
-                {
-                    /*label use;
-                    use.name = value;
-                    use.offset = opcode_add.mem.size();
 
-                    sym.usages.push_back(use);*/
+                mem[chain.sites[i].extra_word] = value;
 
-                    ///do i need a delayed expression here?
-                    opcode_add.mem.push_back(0);
-                }
+                DCPU16_ASM_STAT(sym.stats, backpatched_fixups, 1);
             }
-            else if(is_string(value))
+
+            sym.pending_fixups -= chain.sites.size() - kept;
+            chain.sites.resize(kept);
+            return;
+        }
+    }
+
+    ///at the end of the pass whatever is still waiting joins the delayed expressions, which report it as undefined or hand it on to link
+    constexpr
+    void flush_fixups(symbol_table& sym)
+    {
+        for(fixup_chain& chain : sym.fixups)
+        {
+            for(delayed_expression& site : chain.sites)
             {
-                value.remove_prefix(1);
-                value.remove_suffix(1);
+                sym.expressions.push_back(std::move(site));
+            }
+        }
 
-                ///need to parse string constants
-                for(int idx = 0; idx < (int)value.size(); idx++)
-                {
-                    char c = value[idx];
+        sym.fixups.clear();
+        sym.pending_fixups = 0;
+    }
 
-                    if(c == '\\')
-                    {
-                        if(idx == (int)value.size() - 1)
-                        {
-                            err.msg = "Invalid unterminated escape sequence \\ at end of token";
-                            return err;
-                        }
+    constexpr
+    std::optional<error_info> next(symbol_table& sym, std::string_view& text, assembler_settings& sett)
+    {
+        token_stream stream(text);
+
+        auto error_opt = next(sym, stream, sett);
+
+        text = stream.text;
+
+        return error_opt;
+    }
+
+    constexpr
+    std::optional<error_info> next(symbol_table& sym, token_stream& in, assembler_settings& sett)
+    {
+        size_t offset = in.replaying ? expansion_site.data() - source.data() : in.text.data() - source.data();
 
-                        char next = value[idx + 1];
+        size_t token_offset = 0;
+
+        auto error_opt = add_opcode_with_prefix(sym, *this, in, token_offset, offset, sett);
 
-                        bool valid_escape_sequence = true;
+        size_t source_character = offset + token_offset;
+        uint16_t source_line = line_of(source_character);
 
-                        if(next == 't')
-                            c = '\t';
+        uint16_t last_file = file_ranges.size() > 0 ? file_ranges.back().file : 0;
 
-                        else if(next == 'n')
-                            c = '\n';
+        if(mem.size() > last_mem_size && current_file != last_file)
+            file_ranges.push_back({(uint16_t)last_mem_size, current_file});
 
-                        else if(next == '\\')
-                            c = '\\';
+        ///one run per statement, however many words it emitted
+        if(mem.size() > last_mem_size)
+        {
+            translation_map.append_fill(mem.size() - last_mem_size, source_character);
+            pc_to_source_line.append_fill(mem.size() - last_mem_size, source_line);
+        }
 
-                        else if(next == '\'')
-                            c = '\'';
+        if(pc_to_source_line.size() > 0 && emitting_main_file())
+        {
+            for(size_t idx = last_line+1; idx <= pc_to_source_line.back() && idx < source_line_to_pc.size(); idx++)
+            {
+                source_line_to_pc[idx] = last_mem_size;
+            }
+        }
 
-                        else if(next == '\"')
-                            c = '\"';
+        last_mem_size = mem.size();
 
-                        else if(next == 'r')
-                            c = '\r';
+        if(pc_to_source_line.size() > 0 && emitting_main_file())
+            last_line = pc_to_source_line.back();
 
-                        else if(next == 'b')
-                            c = '\b';
+        if(error_opt.has_value())
+        {
+            return {error_opt.value()};
+        }
 
-                        else if(next == 'f')
-                            c = '\f';
+        if(!in.replaying && current_file == 0)
+            bytes_consumed = in.text.data() - source.data();
 
-                        else if(next == 'v')
-                            c = '\v';
+        error_info err;
+        err.character = source_character;
+        err.line = source_line;
+        err.file = files[current_file];
+        err.name_in_source = in.replaying ? expansion_site : source.substr(source_character, 0);
 
-                        else if(next == '0')
-                            c = '\0';
+        return poll(sym, sett, err);
+    }
+};
 
-                        else if(next == 'a')
-                            c = '\a';
+template<int N = MEM_SIZE>
+using opcode_adder_data = basic_opcode_adder_data<stack_vector<uint16_t, N>, stack_vector<uint16_t, N>>;
 
-                        else if(next == 'e')
-                            c = '\e';
+///the character that a backslash followed by next stands for
+constexpr
+std::optional<char> unescape(char next)
+{
+    switch(next)
+    {
+        case 't': return '\t';
+        case 'n': return '\n';
+        case '\\': return '\\';
+        case '\'': return '\'';
+        case '\"': return '\"';
+        case 'r': return '\r';
+        case 'b': return '\b';
+        case 'f': return '\f';
+        case 'v': return '\v';
+        case '0': return '\0';
+        case 'a': return '\a';
+        case 'e': return '\x1b';
+        case '?': return '?';
+        default: return std::nullopt;
+    }
+}
 
-                        else if(next == '?')
-                            c = '?';
-                        else
-                            valid_escape_sequence = false;
+namespace string_packing
+{
+    enum type
+    {
+        ///one character per word, as .dat does
+        WIDE,
+        ///two characters per word, the first in the high byte
+        PACKED_BE,
+        PACKED_LE,
+    };
+}
 
-                        if(!valid_escape_sequence)
-                        {
-                            err.msg = "Invalid escape sequence";
-                            err.name_in_source = std::string_view(value.begin() + idx, value.begin() + idx + 2);
-                            return err;
-                        }
+namespace string_terminator
+{
+    enum type
+    {
+        NONE,
+        ///a word holding the length in characters, before the string
+        LENGTH_PREFIX,
+        ///a zero character after the string
+        NUL,
+    };
+}
 
-                        idx++;
-                    }
+///emits the contents of a quoted string, without its quotes. Runs without a backslash are copied in bulk, and escapes are only decoded where one appears
+///a packed string with an odd number of characters is padded out to a whole word with a zero byte
+template<typename Mem>
+constexpr
+std::optional<error_info> emit_string(Mem& mem, std::string_view value, string_packing::type packing, string_terminator::type terminator, error_info err)
+{
+    if(terminator == string_terminator::LENGTH_PREFIX)
+    {
+        size_t length = 0;
+
+        for(size_t i=0; i < value.size(); i++, length++)
+        {
+            if(value[i] == '\\')
+                i++;
+        }
+
+        mem.push_back(length);
+    }
+
+    uint8_t pending = 0;
+    bool has_pending = false;
+
+    auto push_byte = [&](uint8_t c)
+    {
+        if(packing == string_packing::WIDE)
+        {
+            mem.push_back(c);
+            return;
+        }
+
+        if(!has_pending)
+        {
+            pending = c;
+            has_pending = true;
+            return;
+        }
+
+        if(packing == string_packing::PACKED_BE)
+            mem.push_back((uint16_t)((pending << 8) | c));
+        else
+            mem.push_back((uint16_t)((c << 8) | pending));
+
+        has_pending = false;
+    };
+
+    while(value.size() > 0)
+    {
+        size_t slash = value.find('\\');
+        std::string_view run = value.substr(0, slash);
+
+        if(packing == string_packing::WIDE)
+        {
+            mem.append_chars(run);
+        }
+        else
+        {
+            for(char c : run)
+                push_byte(c);
+        }
+
+        if(slash == std::string_view::npos)
+            break;
+
+        if(slash == value.size() - 1)
+        {
+            err.msg = "Invalid unterminated escape sequence \\ at end of token";
+            return err;
+        }
+
+        auto c = unescape(value[slash + 1]);
+
+        if(!c.has_value())
+        {
+            err.msg = "Invalid escape sequence";
+            err.name_in_source = value.substr(slash, 2);
+            return err;
+        }
+
+        push_byte(c.value());
+
+        value.remove_prefix(slash + 2);
+    }
+
+    if(terminator == string_terminator::NUL)
+        push_byte(0);
+
+    if(has_pending)
+        push_byte(0);
+
+    return std::nullopt;
+}
+
+template<typename Mem, typename Map>
+constexpr
+std::optional<error_info> add_opcode_with_prefix(symbol_table& sym, basic_opcode_adder_data<Mem, Map>& opcode_add, token_stream& in, size_t& token_text_offset_start, size_t token_start, assembler_settings& sett)
+{
+    error_info err;
+
+    auto consume = [&](token_stream& from, bool prune)
+    {
+        DCPU16_ASM_STAT(sym.stats, tokens, 1);
+
+        return from.consume(prune);
+    };
+
+    opcode opcodes[] =
+    {
+        {"set", 0, 1},
+        {"mov", 0, 1},
+        {"add", 0, 2},
+        {"sub", 0, 3},
+        {"mul", 0, 4},
+        {"mli", 0, 5},
+        {"div", 0, 6},
+        {"dvi", 0, 7},
+        {"mod", 0, 8},
+        {"mdi", 0, 9},
+        {"and", 0, 0x0a},
+        {"bor", 0, 0x0b},
+        {"xor", 0, 0x0c},
+        {"shr", 0, 0x0d},
+        {"asr", 0, 0x0e},
+        {"shl", 0, 0x0f},
+        {"ifb", 0, 0x10},
+        {"ifc", 0, 0x11},
+        {"ife", 0, 0x12},
+        {"ifn", 0, 0x13},
+        {"ifg", 0, 0x14},
+        {"ifa", 0, 0x15},
+        {"ifl", 0, 0x16},
+        {"ifu", 0, 0x17},
+        {"adx", 0, 0x1a},
+        {"sbx", 0, 0x1b},
+        {"snd", 0, 0x1c}, ///extension for multiprocessor. sends a value on a channel
+        {"rcv", 0, 0x1d}, ///extension for multiprocessor. receives a value on a channels
+        {"sti", 0, 0x1e},
+        {"std", 0, 0x1f},
+
+        {"jsr", 1, 0x01},
+        {"int", 1, 0x08},
+        {"iag", 1, 0x09},
+        {"ias", 1, 0x0a},
+        {"rfi", 1, 0x0b},
+        {"iaq", 1, 0x0c},
+        {"hwn", 1, 0x10},
+        {"hwq", 1, 0x11},
+        {"hwi", 1, 0x12},
+        {"ifw", 1, 0x1a}, ///extension for multiprocessor. only executes next instruction if the channel is waiting to write a value
+        {"ifr", 1, 0x1b}, ///extension for multiprocessor. only executes next instruction if the channel is waiting to read a value
+
+        {"brk", 2, 0x0},
+        // could have an instruction that swaps modes into extended alt proposal mode
+    };
+
+    size_t old_size = in.text.size();
+
+    auto consumed_name = consume(in, true);
+
+    ///replayed tokens are all attributed to the invocation
+    size_t num_removed = in.replaying ? 0 : old_size - (in.text.size() + consumed_name.size());
+
+    token_text_offset_start = num_removed;
+
+    err.name_in_source = consumed_name;
+    err.character = token_text_offset_start + token_start;
+    err.line = opcode_add.line_of(err.character);
+    err.file = opcode_add.files[opcode_add.current_file];
+
+    if(consumed_name.size() == 0)
+        return std::nullopt;
+
+    if(is_label_definition(consumed_name))
+    {
+        if(consumed_name.starts_with(':'))
+            consumed_name.remove_prefix(1);
+        if(consumed_name.ends_with(':'))
+            consumed_name.remove_suffix(1);
+
+        auto trimmed = trim_start(consumed_name, [](char c) {return c == ' ' || c == '\n' || c == ','; });
+
+        label l;
+        l.name = trimmed;
+        l.offset = opcode_add.mem.size();
+        l.scope = opcode_add.scope;
+
+        opcode_add.backpatch(sym, l.name, l.scope, l.offset + sym.base_offset);
+
+        sym.definitions.push_back(l);
+        return std::nullopt;
+    }
+
+    ///conditions are evaluated as soon as they're reached, against .defs, labels defined before them, and provided_symbol_definitions
+    ///.if takes a constant expression without spaces in it, optionally compared with another by ==, !=, <, <=, > or >=
+    if(conditional_directive::type directive = get_conditional_directive(consumed_name); directive != conditional_directive::NONE)
+    {
+        if(opens_conditional(directive))
+        {
+            bool taken = false;
+            bool after_else = false;
+
+            if(directive == conditional_directive::IF)
+            {
+                auto evaluate = [&](std::string_view expr) -> std::optional<uint16_t>
+                {
+                    bool should_delay = false;
+
+                    auto result_opt = parse_expression(sym, expr, should_delay, opcode_add.scope);
+
+                    if(!result_opt.has_value() || should_delay || result_opt.value().which_register.has_value())
+                        return std::nullopt;
+
+                    return result_opt.value().word;
+                };
+
+                std::string_view lhs = consume(in, true);
+                auto lhs_opt = evaluate(lhs);
+
+                if(!lhs_opt.has_value())
+                {
+                    err.msg = ".if condition must be a constant expression";
+                    err.name_in_source = lhs;
+                    return err;
+                }
+
+                taken = lhs_opt.value() != 0;
+
+                std::string_view op = in.peek(true);
+
+                if(op == "==" || op == "!=" || op == "<" || op == "<=" || op == ">" || op == ">=")
+                {
+                    consume(in, true);
+
+                    std::string_view rhs = consume(in, true);
+                    auto rhs_opt = evaluate(rhs);
+
+                    if(!rhs_opt.has_value())
+                    {
+                        err.msg = ".if condition must be a constant expression";
+                        err.name_in_source = rhs;
+                        return err;
+                    }
+
+                    uint16_t l = lhs_opt.value();
+                    uint16_t r = rhs_opt.value();
+
+                    if(op == "==")
+                        taken = l == r;
+                    else if(op == "!=")
+                        taken = l != r;
+                    else if(op == "<")
+                        taken = l < r;
+                    else if(op == "<=")
+                        taken = l <= r;
+                    else if(op == ">")
+                        taken = l > r;
+                    else
+                        taken = l >= r;
+                }
+            }
+            else
+            {
+                std::string_view name = consume(in, true);
+
+                if(!is_label_reference(name))
+                {
+                    err.msg = "Expected a symbol name";
+                    err.name_in_source = name;
+                    return err;
+                }
+
+                taken = sym.get_symbol_definition(name, opcode_add.scope).has_value() || sym.get_macro(name) != nullptr;
+
+                if(directive == conditional_directive::IFNDEF)
+                    taken = !taken;
+            }
+
+            if(!taken)
+            {
+                auto closed = skip_conditional(in, true);
+
+                if(!closed.has_value())
+                {
+                    err.msg = "No .endif";
+                    return err;
+                }
+
+                if(closed.value() == conditional_directive::NONE)
+                {
+                    err.msg = "Duplicate .else";
+                    return err;
+                }
+
+                taken = closed.value() == conditional_directive::ELSE;
+                after_else = taken;
+            }
+
+            if(taken)
+            {
+                opcode_add.condition_depth++;
+                opcode_add.else_seen.push_back(after_else);
+            }
+
+            return std::nullopt;
+        }
+
+        if(opcode_add.condition_depth == 0)
+        {
+            err.msg = directive == conditional_directive::ELSE ? ".else without .if" : ".endif without .if";
+            return err;
+        }
+
+        if(directive == conditional_directive::ELSE && opcode_add.else_seen.back())
+        {
+            err.msg = "Duplicate .else";
+            return err;
+        }
+
+        ///the branch before an .else was taken, so the one after it isn't
+        if(directive == conditional_directive::ELSE)
+        {
+            auto closed = skip_conditional(in, false);
+
+            if(!closed.has_value())
+            {
+                err.msg = "No .endif";
+                return err;
+            }
+
+            if(closed.value() == conditional_directive::NONE)
+            {
+                err.msg = "Duplicate .else";
+                return err;
+            }
+        }
+
+        opcode_add.condition_depth--;
+        opcode_add.else_seen.pop_back();
+
+        return std::nullopt;
+    }
+
+    if(iequal(".repeat", consumed_name) || iequal("repeat", consumed_name))
+    {
+        std::string_view times = consume(in, true);
+
+        if(!is_constant(times))
+        {
+            err.msg = ".repeat values must be a constant";
+            return err;
+        }
+
+        uint16_t val = get_constant_of<uint16_t>(times);
+
+        if(sett.budgets.max_repeat_depth != 0 && opcode_add.repeat_depth >= sett.budgets.max_repeat_depth)
+        {
+            err.msg = ".repeat nested deeper than max_repeat_depth";
+            return err;
+        }
+
+        token_stream start_view = in;
+
+        trace_scope trace(".repeat", "expansion");
+
+        opcode_add.repeat_depth++;
+
+        for(uint16_t i=0; i < val; i++)
+        {
+            DCPU16_ASM_STAT(sym.stats, repeat_iterations, 1);
+
+            opcode_add.expansion_steps++;
+
+            ///an empty body never reaches next(), so nested empty loops have to be caught here
+            if(auto poll_opt = opcode_add.poll(sym, sett, err); poll_opt.has_value())
+                return poll_opt;
+
+            opcode_add.push_scope();
+
+            in = start_view;
+
+            ///stops at the end of the input too, which is an error below rather than a loop that never finishes
+            while(in.size() > 0 && in.peek(true) != ".end" && in.peek(true) != "end")
+            {
+                auto err_opt = opcode_add.next(sym, in, sett);
+
+                if(err_opt.has_value())
+                    return err_opt;
+            }
+
+            std::string_view str = consume(in, true);
+
+            if(str != ".end" && str != "end")
+            {
+                err.msg = "Fatal error, no .end?";
+                return err;
+            }
+
+            opcode_add.pop_scope();
+        }
+
+        opcode_add.repeat_depth--;
+
+        if(val == 0)
+        {
+            std::string_view str = consume(in, true);
+
+            if(str != ".end" && str != "end")
+            {
+                err.msg = "Fatal error, no .end?";
+                return err;
+            }
+        }
+
+        return std::nullopt;
+    }
+
+    if(iequal(".macro", consumed_name) || iequal("macro", consumed_name))
+    {
+        if(in.replaying)
+        {
+            err.msg = "Macros can't be defined inside a macro";
+            return err;
+        }
+
+        size_t end = in.text.find('\n');
+        std::string_view header = in.text.substr(0, end);
+
+        in.text.remove_prefix(header.size());
+
+        macro_definition def;
+        def.name = consume_next(header, true);
+
+        if(def.name.size() == 0 || !is_label_reference(def.name) || is_constant(def.name))
+        {
+            err.msg = "Bad macro name";
+            return err;
+        }
+
+        for(auto [name, cls, code] : opcodes)
+        {
+            if(iequal(name, def.name))
+            {
+                err.msg = "Macro name can't be an instruction";
+                return err;
+            }
+        }
+
+        for(auto param = consume_next(header, true); param.size() > 0; param = consume_next(header, true))
+        {
+            if(param == ",")
+                continue;
+
+            if(!is_label_reference(param))
+            {
+                err.msg = "Bad macro parameter";
+                return err;
+            }
+
+            def.params.push_back(param);
+        }
+
+        std::vector<std::string_view> tokens;
+
+        auto lex_error = lex_macro_body(in.text, tokens);
+
+        if(lex_error.has_value())
+        {
+            err.msg = lex_error.value();
+            return err;
+        }
+
+        ///a .repeat sees the same definition once per iteration
+        if(const macro_definition* existing = sym.get_macro(def.name))
+        {
+            if(existing->name.data() == def.name.data())
+                return std::nullopt;
+
+            err.msg = "Macro redefinition";
+            return err;
+        }
+
+        for(std::string_view token : tokens)
+        {
+            def.body.push_back(make_macro_token(token, def.params));
+        }
+
+        sym.macros.push_back(std::move(def));
+
+        return std::nullopt;
+    }
+
+    if(iequal(".include", consumed_name) || iequal("include", consumed_name) || iequal(".incbin", consumed_name) || iequal("incbin", consumed_name))
+    {
+        bool is_binary = iequal(".incbin", consumed_name) || iequal("incbin", consumed_name);
+
+        std::string_view path = consume(in, true);
+
+        if(!is_string(path))
+        {
+            err.msg = "Expected a quoted path";
+            return err;
+        }
+
+        path.remove_prefix(1);
+        path.remove_suffix(1);
+
+        ///offset and length are in words
+        size_t bounds[2] = {0, (size_t)-1};
+
+        for(size_t& bound : bounds)
+        {
+            if(!is_binary || in.peek(true) != ",")
+                break;
+
+            consume(in, true);
+
+            std::string_view value = consume(in, true);
+
+            if(!is_constant(value))
+            {
+                err.msg = ".incbin offset and length must be constants";
+                return err;
+            }
+
+            bound = get_constant_of<uint16_t>(value);
+        }
+
+        if(sett.load_file == nullptr)
+        {
+            err.msg = "No file loader, so files can't be included";
+            return err;
+        }
+
+        auto file_opt = sett.load_file(sett.load_file_user, path, opcode_add.files[opcode_add.current_file]);
+
+        if(!file_opt.has_value())
+        {
+            err.msg = "Could not read included file";
+            return err;
+        }
+
+        std::string_view text = file_opt.value().text;
+
+        ///copied in the byte order that assembled images are written out in, so an assembled image can be included back
+        if(is_binary)
+        {
+            size_t words = (text.size() + 1) / 2;
+            size_t offset = std::min(bounds[0], words);
+            size_t length = std::min(bounds[1], words - offset);
+            size_t whole_words = std::min(length, text.size() / 2 - std::min(offset, text.size() / 2));
+
+            opcode_add.mem.append_raw(text.data() + offset * 2, whole_words);
+
+            ///a trailing odd byte is padded out to a word
+            if(whole_words < length)
+            {
+                uint16_t last = 0;
+                memcpy(&last, text.data() + text.size() - 1, 1);
+
+                opcode_add.mem.push_back(last);
+            }
+
+            return std::nullopt;
+        }
+
+        ///the position of everything in an expansion is the invocation, which an included file can't be part of
+        if(in.replaying)
+        {
+            err.msg = "Files can't be included from a macro";
+            return err;
+        }
+
+        if(opcode_add.include_depth >= 32)
+        {
+            err.msg = "Includes nested too deeply";
+            return err;
+        }
+
+        return opcode_add.include(sym, file_opt.value().path, text, err.line, sett);
+    }
+
+    ///sections were already split apart before assembly, see split_sections
+    if(iequal(".section", consumed_name) || iequal("section", consumed_name))
+    {
+        consume(in, true);
+
+        return std::nullopt;
+    }
+
+    ///.asciz is one character per word like .dat, with a zero after each string. The others pack two characters into a word,
+    ///big endian unless le comes first. .pstring puts the length before each string, and .packedz a zero character after
+    if(iequal(".asciz", consumed_name) || iequal("asciz", consumed_name) || iequal(".pstring", consumed_name) || iequal("pstring", consumed_name) ||
+       iequal(".packed", consumed_name) || iequal("packed", consumed_name) || iequal(".packedz", consumed_name) || iequal("packedz", consumed_name))
+    {
+        string_packing::type packing = string_packing::PACKED_BE;
+        string_terminator::type terminator = string_terminator::NONE;
+
+        if(iequal(".asciz", consumed_name) || iequal("asciz", consumed_name))
+        {
+            packing = string_packing::WIDE;
+            terminator = string_terminator::NUL;
+        }
+        else
+        {
+            if(iequal(".pstring", consumed_name) || iequal("pstring", consumed_name))
+                terminator = string_terminator::LENGTH_PREFIX;
+
+            if(iequal(".packedz", consumed_name) || iequal("packedz", consumed_name))
+                terminator = string_terminator::NUL;
+
+            std::string_view order = in.peek(true);
+
+            if(iequal(order, "le") || iequal(order, "be"))
+            {
+                consume(in, true);
+
+                if(iequal(order, "le"))
+                    packing = string_packing::PACKED_LE;
+            }
+        }
+
+        bool looping = true;
+
+        while(looping)
+        {
+            std::string_view value = consume(in, true);
+
+            if(!is_string(value))
+            {
+                err.msg = "Expected a quoted string";
+                return err;
+            }
+
+            value.remove_prefix(1);
+            value.remove_suffix(1);
+
+            if(auto string_err = emit_string(opcode_add.mem, value, packing, terminator, err); string_err.has_value())
+                return string_err;
+
+            looping = in.peek(true) == ",";
+
+            if(looping)
+                consume(in, true);
+        }
+
+        return std::nullopt;
+    }
+
+    ///.fill count, value and .align boundary[, value] emit their padding in one bulk write, which next() maps as a single run
+    if(iequal(".fill", consumed_name) || iequal("fill", consumed_name) || iequal(".align", consumed_name) || iequal("align", consumed_name))
+    {
+        bool is_align = iequal(".align", consumed_name) || iequal("align", consumed_name);
+
+        std::string_view amount = consume(in, true);
+
+        if(!is_constant(amount))
+        {
+            err.msg = is_align ? ".align boundary must be a constant" : ".fill count must be a constant";
+            return err;
+        }
+
+        uint16_t value = 0;
+
+        if(in.peek(true) == ",")
+        {
+            consume(in, true);
+
+            std::string_view val = consume(in, true);
+
+            if(!is_constant(val))
+            {
+                err.msg = is_align ? ".align value must be a constant" : ".fill value must be a constant";
+                return err;
+            }
+
+            value = get_constant_of<uint16_t>(val);
+        }
+        else if(!is_align)
+        {
+            err.msg = "Expected .fill count, value";
+            return err;
+        }
+
+        ///a count of 0x10000 fills all of memory, so it isn't truncated to a word
+        size_t count = get_constant_of<uint32_t>(amount);
+
+        if(is_align)
+        {
+            if(count == 0)
+            {
+                err.msg = ".align boundary must be at least 1";
+                return err;
+            }
+
+            size_t address = opcode_add.mem.size() + sym.base_offset;
+
+            count = (count - address % count) % count;
+        }
+
+        opcode_add.mem.append_fill(count, value);
+
+        return std::nullopt;
+    }
+
+    ///nothing is emitted, the words are skipped over just like an .org to the end of them, so sparse images leave them out
+    if(iequal(".reserve", consumed_name) || iequal("reserve", consumed_name))
+    {
+        std::string_view amount = consume(in, true);
+
+        if(!is_constant(amount))
+        {
+            err.msg = ".reserve count must be a constant";
+            return err;
+        }
+
+        size_t count = get_constant_of<uint32_t>(amount);
+
+        if(opcode_add.segments.size() >= MAX_SEGMENTS)
+        {
+            err.msg = "Too many segments";
+            return err;
+        }
+
+        if(opcode_add.mem.size() + sym.base_offset + count > MEM_SIZE)
+        {
+            err.msg = ".reserve runs past the end of memory";
+            return err;
+        }
+
+        opcode_add.org(opcode_add.mem.size() + count);
+
+        return std::nullopt;
+    }
+
+    if(iequal(".org", consumed_name) || iequal("org", consumed_name))
+    {
+        std::string_view address = consume(in, true);
+
+        if(!is_constant(address))
+        {
+            err.msg = ".org address must be a constant";
+            return err;
+        }
+
+        ///would otherwise wrap around to the start of memory
+        if(!constant_fits_word(address) || address.starts_with('-'))
+        {
+            err.msg = ".org address must be between 0 and 0xffff";
+            return err;
+        }
+
+        uint16_t val = get_constant_of<uint16_t>(address);
+
+        ///mem starts at base_offset
+        if(val < sym.base_offset || (size_t)(val - sym.base_offset) < opcode_add.mem.size())
+        {
+            err.msg = ".org can't move backwards";
+            return err;
+        }
+
+        if(opcode_add.segments.size() >= MAX_SEGMENTS)
+        {
+            err.msg = "Too many segments";
+            return err;
+        }
+
+        opcode_add.org(val - sym.base_offset);
+
+        return std::nullopt;
+    }
+
+    if(iequal(".def", consumed_name) || iequal("def", consumed_name))
+    {
+        auto label_name = consume(in, true);
+
+        if(in.peek(true) == ",")
+            consume(in, true);
+
+        auto label_value = consume(in, true);
+
+        if(!is_constant(label_value))
+        {
+            err.msg = ".def value must be a constant";
+            return err;
+        }
+
+        uint16_t val = get_constant_of<uint16_t>(label_value);
+
+        define d;
+        d.name = label_name;
+        d.value = val;
+
+        ///defines aren't scoped
+        opcode_add.backpatch(sym, d.name, {}, d.value);
+
+        sym.defines.push_back(d);
+
+        return std::nullopt;
+    }
+
+    if(iequal(".export", consumed_name) || iequal("export", consumed_name))
+    {
+        auto to_export = consume(in, true);
+
+        sym.exports.push_back(to_export);
+
+        return std::nullopt;
+    }
+
+    if(iequal(".dat", consumed_name) || iequal("dat", consumed_name))
+    {
+        bool looping = true;
+
+        while(looping)
+        {
+            auto value = consume(in, true);
+
+            if(is_constant(value))
+            {
+                opcode_add.mem.push_back(get_constant_of<uint16_t>(value));
+            }
+            else if(is_label_reference(value))
+            {
+                auto sym_opt = sym.get_symbol_definition(value, opcode_add.scope);
+
+                if(sym_opt.has_value())
+                {
+                    opcode_add.mem.push_back(sym_opt.value());
+                }
+                else
+                {
+                    delayed_expression delayed;
+                    delayed.base_word = opcode_add.mem.size();
+                    delayed.extra_word = opcode_add.mem.size();
+                    delayed.expression = value;
+                    delayed.type = arg_pos::A;
+                    delayed.raw = true;
+                    delayed.scope = opcode_add.scope;
 
-                    uint16_t wide = (uint8_t)c;
+                    opcode_add.anchor_expression(delayed);
+                    opcode_add.defer(sym, std::move(delayed), value);
 
-                    opcode_add.mem.push_back(wide);
+                    opcode_add.mem.push_back(0);
                 }
             }
+            else if(is_string(value))
+            {
+                value.remove_prefix(1);
+                value.remove_suffix(1);
+
+                if(auto string_err = emit_string(opcode_add.mem, value, string_packing::WIDE, string_terminator::NONE, err); string_err.has_value())
+                    return string_err;
+            }
             else if(value == "?")
             {
                 opcode_add.mem.push_back(0);
@@ -1264,9 +2606,9 @@ std::optional<error_info> add_opcode_with_prefix(symbol_table& sym, opcode_adder
                 return err;
             }
 
-            if(peek_next(in, true) == ",")
+            if(in.peek(true) == ",")
             {
-                consume_next(in, true);
+                consume(in, true);
 
                 looping = true;
             }
@@ -1285,15 +2627,15 @@ std::optional<error_info> add_opcode_with_prefix(symbol_table& sym, opcode_adder
         {
             if(cls == 0)
             {
-                auto val_b = consume_next(in, false);
+                auto val_b = consume(in, false);
 
-                if(consume_next(in, true) != ",")
+                if(consume(in, true) != ",")
                 {
                     err.msg = "Expected ,";
                     return err;
                 }
 
-                auto val_a = consume_next(in, false);
+                auto val_a = consume(in, false);
 
                 auto decoded_b_opt = decode_value(val_b, arg_pos::B, sym, sett, opcode_add.scope);
                 auto decoded_a_opt = decode_value(val_a, arg_pos::A, sym, sett, opcode_add.scope);
@@ -1339,7 +2681,8 @@ std::optional<error_info> add_opcode_with_prefix(symbol_table& sym, opcode_adder
                         delayed.is_memory_reference = decoded_a.is_address;
                         delayed.scope = opcode_add.scope;
 
-                        sym.expressions.push_back(delayed);
+                        opcode_add.anchor_expression(delayed);
+                        opcode_add.defer(sym, std::move(delayed), decoded_a.label);
                     }
 
                     opcode_add.mem.push_back(promote_a);
@@ -1365,7 +2708,8 @@ std::optional<error_info> add_opcode_with_prefix(symbol_table& sym, opcode_adder
                         delayed.is_memory_reference = decoded_b.is_address;
                         delayed.scope = opcode_add.scope;
 
-                        sym.expressions.push_back(delayed);
+                        opcode_add.anchor_expression(delayed);
+                        opcode_add.defer(sym, std::move(delayed), decoded_b.label);
                     }
 
                     opcode_add.mem.push_back(promote_b);
@@ -1376,7 +2720,7 @@ std::optional<error_info> add_opcode_with_prefix(symbol_table& sym, opcode_adder
 
             if(cls == 1)
             {
-                auto val_a = consume_next(in, false);
+                auto val_a = consume(in, false);
 
                 auto decoded_a_opt = decode_value(val_a, arg_pos::A, sym, sett, opcode_add.scope);
 
@@ -1414,7 +2758,8 @@ std::optional<error_info> add_opcode_with_prefix(symbol_table& sym, opcode_adder
                         delayed.is_memory_reference = decoded_a.is_address;
                         delayed.scope = opcode_add.scope;
 
-                        sym.expressions.push_back(delayed);
+                        opcode_add.anchor_expression(delayed);
+                        opcode_add.defer(sym, std::move(delayed), decoded_a.label);
                     }
 
                     opcode_add.mem.push_back(promote_a);
@@ -1434,6 +2779,94 @@ std::optional<error_info> add_opcode_with_prefix(symbol_table& sym, opcode_adder
         }
     }
 
+    if(const macro_definition* macro = sym.get_macro(consumed_name))
+    {
+        if(opcode_add.expansion_depth >= 64)
+        {
+            err.msg = "Macro recursion too deep";
+            return err;
+        }
+
+        std::vector<std::string_view> args;
+
+        for(size_t i=0; i < macro->params.size(); i++)
+        {
+            if(i != 0 && consume(in, true) != ",")
+            {
+                err.msg = "Expected ,";
+                return err;
+            }
+
+            args.push_back(consume(in, false));
+        }
+
+        ///only tokens which splice a parameter into other text need new storage
+        std::vector<std::string_view> expanded;
+        expanded.reserve(macro->body.size());
+
+        for(const macro_token& token : macro->body)
+        {
+            if(token.parts.size() == 0)
+            {
+                expanded.push_back(token.text);
+                continue;
+            }
+
+            if(token.parts.size() == 1)
+            {
+                expanded.push_back(args[token.parts[0].param]);
+                continue;
+            }
+
+            std::vector<char>& spliced = sym.expansion_text.emplace_back();
+
+            for(const macro_token::part& p : token.parts)
+            {
+                std::string_view piece = p.param == -1 ? p.literal : args[p.param];
+
+                spliced.insert(spliced.end(), piece.begin(), piece.end());
+            }
+
+            expanded.push_back(std::string_view(spliced.data(), spliced.size()));
+        }
+
+        DCPU16_ASM_STAT(sym.stats, macro_expansions, 1);
+
+        opcode_add.expansion_steps++;
+
+        if(auto poll_opt = opcode_add.poll(sym, sett, err); poll_opt.has_value())
+            return poll_opt;
+
+        trace_scope trace("macro", "expansion", consumed_name);
+
+        if(opcode_add.expansion_depth == 0)
+            opcode_add.expansion_site = consumed_name;
+
+        opcode_add.expansion_depth++;
+        opcode_add.push_scope();
+
+        token_stream replay{std::span<const std::string_view>(expanded)};
+        std::optional<error_info> inner;
+
+        while(replay.size() > 0 && !inner.has_value())
+        {
+            inner = opcode_add.next(sym, replay, sett);
+        }
+
+        opcode_add.pop_scope();
+        opcode_add.expansion_depth--;
+
+        ///reported at the invocation, the expanded text doesn't exist anywhere in the source
+        if(inner.has_value())
+        {
+            err.msg = inner.value().msg;
+            err.cancelled = inner.value().cancelled;
+            return err;
+        }
+
+        return std::nullopt;
+    }
+
     err.msg = "Not command or label";
     return err;
 }
@@ -1444,7 +2877,7 @@ constexpr
 std::optional<std::string_view> resolve_delayed_expression(T& mem_in, symbol_table& sym, const delayed_expression& delayed, bool allow_further_delaying, std::vector<delayed_expression>& unresolved)
 {
     bool should_delay = false;
-    auto value_opt = parse_expression(sym, delayed.expression, should_delay, delayed.scope);
+    auto value_opt = parse_expression(sym, delayed.text(), should_delay, delayed.scope);
 
     if(should_delay && !allow_further_delaying)
         return "Expression contains undefined label";
@@ -1457,6 +2890,15 @@ std::optional<std::string_view> resolve_delayed_expression(T& mem_in, symbol_tab
 
     expression_result& res = value_opt.value();
 
+    if(delayed.raw)
+    {
+        if(res.which_register.has_value() || !res.word.has_value())
+            return ".dat values must be constants or labels";
+
+        mem_in[delayed.extra_word] = res.word.value();
+        return std::nullopt;
+    }
+
     uint16_t& mem = mem_in[delayed.base_word];
 
     if(res.which_register.has_value())
@@ -1565,14 +3007,80 @@ std::optional<std::string_view> resolve_delayed_expression(T& mem_in, symbol_tab
     return std::nullopt;
 }
 
+///rebuilds the line -> pc map from pc -> line, for when blocks were not assembled in source order
+///lines without any code map to the pc of the next line which has some
+template<typename T>
+constexpr
+void rebuild_source_line_to_pc(T& rinfo)
+{
+    std::vector<int32_t> first_pc(rinfo.source_line_to_pc.size(), -1);
+
+    for(const segment& seg : rinfo.segments)
+    {
+        for(size_t pc=seg.address; pc < seg.address + seg.size; pc++)
+        {
+            if(rinfo.file_of(pc) != 0)
+                continue;
+
+            size_t line = rinfo.pc_to_source_line[pc];
+
+            if(line < first_pc.size() && first_pc[line] == -1)
+                first_pc[line] = pc;
+        }
+    }
+
+    int32_t next_pc = 0;
+
+    for(int line = (int)first_pc.size() - 1; line >= 0; line--)
+    {
+        if(first_pc[line] == -1)
+            first_pc[line] = next_pc;
+        else
+            next_pc = first_pc[line];
+
+        rinfo.source_line_to_pc[line] = first_pc[line];
+    }
+}
+
+///a shared runtime assembled once by make_prelude, which any number of programs can then be assembled straight after
+///it's never modified once made, so any number of threads may assemble against one at the same time. Its symbols and macros
+///are looked up in place rather than copied, and only its image is copied into each program's
+///labels and macros point into its source, so that must outlive it, along with anything it .include'd and the names of its provided_symbol_definitions
+struct prelude_snapshot
+{
+    symbol_table sym;
+    ///assembled with allow_unresolved_symbols, so its unresolved_expressions may refer to labels that only the programs after it define
+    return_info image;
+};
+
+///assembles the given views of text one after another. Every view must point into text, but may be in any order
+///error locations and debug maps always refer to positions within text
+///when building is set, the symbol table is kept in it at the end
+///assembles into rinfo, which must be freshly constructed, so that callers can keep the result off the stack. On failure it holds nothing useful
+template<int N>
 constexpr
-std::pair<std::optional<return_info>, error_info> assemble(std::string_view text, assembler_settings sett = assembler_settings())
+std::optional<error_info> assemble_blocks(basic_return_info<N>& rinfo, std::string_view text, std::span<const std::string_view> blocks, assembler_settings sett = assembler_settings(), prelude_snapshot* building = nullptr)
 {
-    return_info rinfo;
+    trace_scope trace("assemble", "assembler");
+
     symbol_table sym;
-    sym.base_offset = sett.location;
 
-    ///these are deliberately not affected by relocations
+    #ifndef DCPU16_ASM_NO_STATS
+    if(sett.collect_stats)
+    {
+        rinfo.stats = assembly_stats();
+        sym.stats = &rinfo.stats.value();
+    }
+    #endif
+
+    #ifndef DCPU16_ASM_NO_STATS
+    uint64_t allocations_start = 0;
+
+    if(!std::is_constant_evaluated() && sym.stats != nullptr)
+        allocations_start = current_allocation_count();
+    #endif
+
+    ///these are deliberately not affected by sett.location
     for(auto [absolute_value, name] : sett.provided_symbol_definitions)
     {
         define d;
@@ -1582,25 +3090,114 @@ std::pair<std::optional<return_info>, error_info> assemble(std::string_view text
         sym.defines.push_back(d);
     }
 
-    opcode_adder_data adder(text, rinfo.mem, rinfo.translation_map, rinfo.pc_to_source_line, rinfo.source_line_to_pc);
+    opcode_adder_data<N> adder(text, rinfo.mem, rinfo.translation_map, rinfo.pc_to_source_line, rinfo.source_line_to_pc);
+
+    const prelude_snapshot* pre = sett.prelude;
+    size_t start = sett.location;
 
-    while(text.size() > 0)
+    if(pre != nullptr)
     {
-        auto error_opt = adder.next(sym, text, sett);
+        const return_info& image = pre->image;
 
-        if(error_opt.has_value())
+        sym.parent = &pre->sym;
+        adder.next_scope_id = pre->sym.next_scope_id;
+
+        rinfo.mem.append_raw(image.mem.data(), image.mem.size());
+        rinfo.translation_map.append_raw(image.translation_map.data(), image.mem.size());
+        rinfo.pc_to_source_line.append_raw(image.pc_to_source_line.data(), image.mem.size());
+
+        if(image.segments.size() > 0)
+            adder.segments.assign(image.segments.begin(), image.segments.end());
+
+        ///however many files it was assembled from, the prelude's words are all attributed to one
+        adder.files.push_back("prelude");
+        adder.file_ranges.push_back({0, 1});
+
+        start = image.mem.size();
+    }
+
+    ///assembled in place, the program starts as if with a .org
+    adder.org(start);
+
+    bool in_source_order = true;
+    const char* last_end = text.data();
+
+    {
+        stats_timer timer(sym.stats, &assembly_stats::encode_ns);
+        trace_scope trace("main pass", "phase");
+
+        for(std::string_view block : blocks)
+        {
+            if(block.data() < last_end)
+                in_source_order = false;
+
+            last_end = block.data() + block.size();
+
+            while(block.size() > 0)
+            {
+                auto error_opt = adder.next(sym, block, sett);
+
+                if(error_opt.has_value())
+                {
+                    return error_opt.value();
+                }
+
+                if(rinfo.mem.overflowed())
+                {
+                    error_info err;
+                    err.msg = "Program does not fit in memory";
+                    err.line = adder.last_line;
+                    err.character = block.data() - text.data();
+
+                    return err;
+                }
+            }
+        }
+    }
+
+    if(adder.condition_depth != 0)
+    {
+        error_info err;
+        err.msg = "No .endif";
+        err.line = adder.last_line;
+        return err;
+    }
+
+    adder.close_segment();
+    adder.flush_fixups(sym);
+
+    if(sett.progress != nullptr)
+        sett.progress(sett.progress_user, text.size(), rinfo.mem.size());
+
+    for(const segment& seg : adder.segments)
+    {
+        if(seg.size > 0)
+            rinfo.segments.push_back(seg);
+    }
+
+    ///left empty otherwise, so that results without includes can still be constant expressions
+    if(adder.files.size() > 1)
+    {
+        for(std::string_view path : adder.files)
         {
-            return {std::nullopt, error_opt.value()};
+            rinfo.files.push_back(std::string(path));
         }
+
+        rinfo.file_ranges = adder.file_ranges;
     }
 
-    if(rinfo.pc_to_source_line.size() > 0)
+    if(!in_source_order)
     {
-        size_t first_line = rinfo.pc_to_source_line[0];
+        rebuild_source_line_to_pc(rinfo);
+    }
+    else if(rinfo.segments.size() > 0 && rinfo.mem.size() > start)
+    {
+        uint16_t first_pc = pre != nullptr ? start : rinfo.segments[0].address;
+        size_t first_line = rinfo.pc_to_source_line[first_pc];
 
-        for(size_t idx = 0; idx <= first_line; idx++)
+        for(size_t idx = 0; idx <= first_line && idx < rinfo.source_line_to_pc.size(); idx++)
         {
-            rinfo.source_line_to_pc[idx] = 0;
+            rinfo.source_line_to_pc[idx] = first_pc;
         }
     }
 
@@ -1641,59 +3238,266 @@ std::pair<std::optional<return_info>, error_info> assemble(std::string_view text
 
     std::vector<delayed_expression> unresolved;
 
-    for(const delayed_expression& delayed : sym.expressions)
+    DCPU16_ASM_STAT(sym.stats, delayed_expressions, sym.expressions.size());
+
     {
-        error_info err;
-        err.character = 0;
-        err.line = rinfo.pc_to_source_line[delayed.base_word];
-        err.name_in_source = delayed.expression;
+        stats_timer timer(sym.stats, &assembly_stats::fixup_ns);
+        trace_scope trace("delayed expressions", "phase");
 
-        auto patch_result = resolve_delayed_expression(rinfo.mem, sym, delayed, sett.allow_unresolved_symbols, unresolved);
+        ///the prelude's own forward references to this program are patched in the copy of its image
+        std::span<const delayed_expression> from_prelude;
 
-        if(patch_result.has_value())
+        if(pre != nullptr)
+            from_prelude = pre->image.unresolved_expressions;
+
+        for(std::span<const delayed_expression> expressions : {std::span<const delayed_expression>(sym.expressions), from_prelude})
         {
-            err.msg = patch_result.value();
-            return {std::nullopt, err};
+            for(const delayed_expression& delayed : expressions)
+            {
+                error_info err;
+                err.character = 0;
+                err.line = rinfo.pc_to_source_line[delayed.base_word];
+                err.file = adder.files[rinfo.file_of(delayed.base_word)];
+                err.name_in_source = delayed.expression;
+
+                auto patch_result = resolve_delayed_expression(rinfo.mem, sym, delayed, sett.allow_unresolved_symbols, unresolved);
+
+                if(patch_result.has_value())
+                {
+                    err.msg = patch_result.value();
+                    return err;
+                }
+            }
         }
     }
 
     rinfo.unresolved_expressions = unresolved;
 
-    ///relocate
-    ///doing it down here because in the future, will need to be able to relocate eg the translation map
-    if(sett.location != 0)
     {
-        rinfo.mem.shift_contents_right(sett.location);
-        rinfo.translation_map.shift_contents_right(sett.location);
-        rinfo.pc_to_source_line.shift_contents_right(sett.location);
+        stats_timer timer(sym.stats, &assembly_stats::export_ns);
+        trace_scope trace("exports", "phase");
+
+        for(std::string_view l : sett.label_values_to_extract)
+        {
+            auto val_opt = sym.get_symbol_definition(l, {});
+
+            if(val_opt.has_value())
+            {
+                rinfo.exported_label_names.push_back({val_opt.value(), std::string(l)});
+            }
+        }
 
-        for(uint16_t& val : rinfo.source_line_to_pc)
+        for(const symbol_table* table = &sym; table != nullptr; table = table->parent)
         {
-            val += sett.location;
+            for(std::string_view l : table->exports)
+            {
+                auto val_opt = sym.get_symbol_definition(l, {});
+
+                if(val_opt.has_value())
+                {
+                    rinfo.exported_label_names.push_back({val_opt.value(), std::string(l)});
+                }
+            }
         }
+
+        if(sett.collect_symbols)
+            rinfo.symbols = make_symbol_index(sym);
+    }
+
+    #ifndef DCPU16_ASM_NO_STATS
+    if(!std::is_constant_evaluated() && sym.stats != nullptr)
+    {
+        sym.stats->allocations = current_allocation_count() - allocations_start;
+
+        if(peak_memory_query != nullptr)
+            sym.stats->peak_memory_bytes = peak_memory_query();
+    }
+    #endif
+
+    if(building != nullptr)
+    {
+        sym.stats = nullptr;
+        sym.next_scope_id = adder.next_scope_id;
+        building->sym = std::move(sym);
     }
 
-    for(std::string_view l : sett.label_values_to_extract)
+    return std::nullopt;
+}
+
+template<int N = MEM_SIZE>
+constexpr
+std::pair<std::optional<basic_return_info<N>>, error_info> assemble_blocks(std::string_view text, std::span<const std::string_view> blocks, assembler_settings sett = assembler_settings(), prelude_snapshot* building = nullptr)
+{
+    basic_return_info<N> rinfo;
+
+    auto err_opt = assemble_blocks(rinfo, text, blocks, sett, building);
+
+    if(err_opt.has_value())
+        return {std::nullopt, err_opt.value()};
+
+    return {std::move(rinfo), error_info()};
+}
+
+///a run of a unit's text which belongs to one section
+struct section_view
+{
+    std::string_view name;
+    std::string_view text;
+};
+
+///splits text at every top level .section, which stays at the start of its view. Anything before the first one is in the "text" section
+///a .section inside a .repeat, .macro body or conditional doesn't split anything
+constexpr
+std::vector<section_view> split_sections(std::string_view text)
+{
+    std::vector<section_view> ret;
+
+    section_view current;
+    current.name = "text";
+    current.text = text.substr(0, 0);
+
+    int repeat_depth = 0;
+    int condition_depth = 0;
+    bool in_macro = false;
+
+    std::string_view remaining = text;
+
+    while(remaining.size() > 0)
     {
-        auto val_opt = sym.get_symbol_definition(l, {});
+        size_t end = remaining.find('\n');
+        size_t line_length = end == std::string_view::npos ? remaining.size() : end + 1;
+        std::string_view line_text = remaining.substr(0, line_length);
+
+        std::string_view tokens = line_text;
+        auto first = consume_next(tokens, true);
+
+        if(iequal(first, ".macro") || iequal(first, "macro"))
+            in_macro = true;
+
+        if(iequal(first, ".endmacro") || iequal(first, "endmacro"))
+            in_macro = false;
+
+        if(!in_macro && (iequal(first, ".repeat") || iequal(first, "repeat")))
+            repeat_depth++;
+
+        if(!in_macro && (iequal(first, ".end") || iequal(first, "end")))
+            repeat_depth--;
 
-        if(val_opt.has_value())
+        if(!in_macro && opens_conditional(get_conditional_directive(first)))
+            condition_depth++;
+
+        if(!in_macro && get_conditional_directive(first) == conditional_directive::ENDIF)
+            condition_depth--;
+
+        if(!in_macro && repeat_depth == 0 && condition_depth == 0 && (iequal(first, ".section") || iequal(first, "section")))
         {
-            rinfo.exported_label_names.push_back({val_opt.value(), std::string(l)});
+            if(current.text.size() > 0)
+                ret.push_back(current);
+
+            current.name = consume_next(tokens, true);
+            current.text = line_text.substr(0, 0);
         }
+
+        current.text = std::string_view(current.text.data(), line_text.data() + line_text.size() - current.text.data());
+
+        remaining.remove_prefix(line_length);
     }
 
-    for(std::string_view l : sym.exports)
+    if(current.text.size() > 0)
+        ret.push_back(current);
+
+    return ret;
+}
+
+///views of every section, grouped together in the order each section first appears
+constexpr
+std::vector<std::string_view> group_sections(std::span<const section_view> views)
+{
+    std::vector<std::string_view> names;
+
+    for(const section_view& view : views)
     {
-        auto val_opt = sym.get_symbol_definition(l, {});
+        if(std::find(names.begin(), names.end(), view.name) == names.end())
+            names.push_back(view.name);
+    }
 
-        if(val_opt.has_value())
+    std::vector<std::string_view> ret;
+
+    for(std::string_view name : names)
+    {
+        for(const section_view& view : views)
         {
-            rinfo.exported_label_names.push_back({val_opt.value(), std::string(l)});
+            if(view.name == name)
+                ret.push_back(view.text);
         }
     }
 
-    return {rinfo, error_info()};
+    return ret;
+}
+
+///the blocks text is assembled as. The whole of it, unless .section splits it up
+constexpr
+std::vector<std::string_view> section_order(std::string_view text)
+{
+    std::vector<section_view> views = split_sections(text);
+
+    if(views.size() > 1)
+        return group_sections(views);
+
+    return {text};
+}
+
+///sections are laid out one after another, in the order they first appear. link places them explicitly
+template<int N = MEM_SIZE>
+constexpr
+std::pair<std::optional<basic_return_info<N>>, error_info> assemble(std::string_view text, assembler_settings sett = assembler_settings())
+{
+    std::vector<std::string_view> order = section_order(text);
+
+    return assemble_blocks<N>(text, order, sett);
+}
+
+///as above, into rinfo, which must be freshly constructed
+template<int N>
+constexpr
+std::optional<error_info> assemble(basic_return_info<N>& rinfo, std::string_view text, assembler_settings sett = assembler_settings())
+{
+    std::vector<std::string_view> order = section_order(text);
+
+    return assemble_blocks(rinfo, text, order, sett);
+}
+
+///assembles text once into a snapshot, which assemble can then assemble any number of programs after
+///sett.location places the prelude itself. It may refer to labels that the programs assembled after it define
+inline
+std::pair<std::shared_ptr<const prelude_snapshot>, error_info> make_prelude(std::string_view text, assembler_settings sett = assembler_settings())
+{
+    trace_scope trace("make_prelude", "assembler");
+
+    sett.allow_unresolved_symbols = true;
+    sett.collect_stats = false;
+    sett.collect_symbols = false;
+    sett.prelude = nullptr;
+
+    std::vector<std::string_view> order = section_order(text);
+
+    auto ret = std::make_shared<prelude_snapshot>();
+
+    auto err_opt = assemble_blocks(ret->image, text, order, sett, ret.get());
+
+    if(err_opt.has_value())
+        return {nullptr, err_opt.value()};
+
+    return {ret, error_info()};
+}
+
+///assembles text straight after a prelude, against its symbols and macros. The image starts with a copy of the prelude's
+inline
+std::pair<std::optional<return_info>, error_info> assemble(std::string_view text, const prelude_snapshot& pre, assembler_settings sett = assembler_settings())
+{
+    sett.prelude = &pre;
+
+    return assemble<MEM_SIZE>(text, sett);
 }
 
 template<typename T>
@@ -1735,15 +3539,24 @@ template<template<typename> typename T, typename U>
 constexpr
 std::pair<std::optional<return_info>, error_info> assemble_multiple(const T<U>& texts, assembler_settings sett = assembler_settings())
 {
+    trace_scope trace("assemble_multiple", "assembler");
+
     sett.allow_unresolved_symbols = true;
 
     return_info combined;
 
+    #ifndef DCPU16_ASM_NO_STATS
+    if(sett.collect_stats)
+        combined.stats = assembly_stats();
+    #endif
+
     std::vector<delayed_expression> all_delayed;
     std::vector<std::pair<uint16_t, std::string>> all_exported;
 
     for(const U& val : texts)
     {
+        trace_scope unit_trace("unit", "file");
+
         sett.location = combined.mem.size();
         auto [result, err] = assemble(val, sett);
 
@@ -1760,11 +3573,9 @@ std::pair<std::optional<return_info>, error_info> assemble_multiple(const T<U>&
             combined.mem[i] = result.value().mem[i];
         }
 
-        ///offset by however long the initial program was so we patch the correct byte
-        for(delayed_expression delay : result.value().unresolved_expressions)
+        ///already assembled at sett.location, so these refer to the right words
+        for(const delayed_expression& delay : result.value().unresolved_expressions)
         {
-            delay.base_word += sett.location;
-
             all_delayed.push_back(delay);
         }
 
@@ -1772,13 +3583,39 @@ std::pair<std::optional<return_info>, error_info> assemble_multiple(const T<U>&
         {
             all_exported.push_back(i);
         }
+
+        if(combined.stats.has_value() && result.value().stats.has_value())
+            combined.stats.value() += result.value().stats.value();
+
+        if(result.value().symbols.has_value())
+        {
+            if(!combined.symbols.has_value())
+                combined.symbols = symbol_index();
+
+            const symbol_index& symbols = result.value().symbols.value();
+
+            for(const symbol_entry& entry : symbols.entries)
+            {
+                combined.symbols.value().add(symbols.names_of(entry), entry.address, entry.scope_depth);
+            }
+        }
     }
 
-    auto err_opt = resolve_delayed_expressions(combined.mem, all_exported, all_delayed);
+    std::optional<error_info> err_opt;
+
+    {
+        stats_timer timer(combined.stats.has_value() ? &combined.stats.value() : nullptr, &assembly_stats::fixup_ns);
+        trace_scope trace("link", "phase");
+
+        err_opt = resolve_delayed_expressions(combined.mem, all_exported, all_delayed);
+    }
 
     if(err_opt.has_value())
         return {std::nullopt, err_opt.value()};
 
+    if(combined.symbols.has_value())
+        combined.symbols.value().build();
+
     return {combined, {}};
 }
 
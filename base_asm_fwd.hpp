@@ -1,14 +1,19 @@
 #ifndef BASE_ASM_FWD_HPP_INCLUDED
 #define BASE_ASM_FWD_HPP_INCLUDED
 
+#include <algorithm>
 #include <utility>
 #include <optional>
 #include <string_view>
 #include "stack_vector.hpp"
+#include "stats.hpp"
+#include "symbol_index.hpp"
 #include <stdint.h>
 #include <vector>
+#include <string>
 
 #define MEM_SIZE 0x10000
+#define MAX_SEGMENTS 256
 
 struct error_info
 {
@@ -16,6 +21,32 @@ struct error_info
     std::string_view msg;
     int character = 0;
     int line = 0;
+    ///the .include path the error is in, empty for the source being assembled
+    std::string_view file;
+    ///assembler_settings::cancel was set. Nothing is left behind, the settings can be reused straight away
+    bool cancelled = false;
+};
+
+///a run of assembled words. Everything between segments is a gap left by .org, which nothing was assembled into
+struct segment
+{
+    uint16_t address = 0;
+    uint32_t size = 0;
+};
+
+///where link placed a section, and how large it ended up
+struct section_info
+{
+    std::string name;
+    uint16_t address = 0;
+    uint32_t size = 0;
+};
+
+///words from first_pc onwards came from file, until the next range starts
+struct file_range
+{
+    uint16_t first_pc = 0;
+    uint16_t file = 0;
 };
 
 struct delayed_expression
@@ -25,27 +56,79 @@ struct delayed_expression
     // the additional word
     uint16_t extra_word = 0;
     arg_pos::type type;
+    ///always points into the source, so that errors can refer to it
     std::string_view expression = "";
+    ///expressions built by a macro expansion aren't in the source. Their text is kept here, and expression points at the invocation
+    std::string owned_expression;
     bool is_memory_reference = true;
+    ///a .dat word, which is replaced by the value outright rather than being an operand of base_word
+    bool raw = false;
     std::vector<uint32_t> scope;
+
+    constexpr
+    std::string_view text() const
+    {
+        if(owned_expression.size() > 0)
+            return owned_expression;
+
+        return expression;
+    }
 };
 
-struct return_info
+///N is the capacity in words. Programs known to be small can use a smaller N, to pay only for what they use
+///source_line_to_pc shares the capacity, so lines past N are not mapped
+template<int N = MEM_SIZE>
+struct basic_return_info
 {
-    stack_vector<uint16_t, MEM_SIZE> mem;
+    stack_vector<uint16_t, N> mem;
+    ///the words actually assembled, in address order. mem and the maps below are indexed by address, so a segment's words and line maps are the same range of each
+    stack_vector<segment, MAX_SEGMENTS> segments;
     ///memory cell -> source character index
-    stack_vector<uint16_t, MEM_SIZE> translation_map;
+    stack_vector<uint16_t, N> translation_map;
     ///memory cell -> source line
-    stack_vector<uint16_t, MEM_SIZE> pc_to_source_line;
+    stack_vector<uint16_t, N> pc_to_source_line;
     ///input line to memory cell
-    stack_vector<uint16_t, MEM_SIZE> source_line_to_pc;
+    stack_vector<uint16_t, N> source_line_to_pc;
 
     std::vector<std::pair<uint16_t, std::string>> exported_label_names;
     std::vector<delayed_expression> unresolved_expressions;
 
-    constexpr return_info(){}
+    ///every .include'd path, file 0 is the source being assembled. Empty when nothing was included
+    std::vector<std::string> files;
+    ///empty when nothing was included. translation_map and pc_to_source_line refer to positions within file_of(pc)
+    std::vector<file_range> file_ranges;
+    ///only filled in by link
+    std::vector<section_info> sections;
+    ///only filled in by link_gc, the number of words stripped from each unit
+    std::vector<uint32_t> removed_words;
+
+    ///only present when assembler_settings::collect_stats is set
+    std::optional<assembly_stats> stats;
+    ///only present when assembler_settings::collect_symbols is set
+    std::optional<symbol_index> symbols;
+
+    constexpr basic_return_info(){}
+
+    constexpr
+    std::span<const uint16_t> segment_words(const segment& seg) const
+    {
+        return std::span<const uint16_t>(mem.data() + seg.address, seg.size);
+    }
+
+    constexpr
+    uint16_t file_of(size_t pc) const
+    {
+        auto it = std::upper_bound(file_ranges.begin(), file_ranges.end(), pc, [](size_t val, const file_range& range){return val < range.first_pc;});
+
+        if(it == file_ranges.begin())
+            return 0;
+
+        return std::prev(it)->file;
+    }
 };
 
+using return_info = basic_return_info<MEM_SIZE>;
+
 std::pair<std::optional<return_info>, error_info> assemble_fwd(std::string_view text);
 
 #endif // BASE_ASM_FWD_HPP_INCLUDED
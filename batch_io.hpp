@@ -0,0 +1,380 @@
+#ifndef BATCH_IO_HPP_INCLUDED
+#define BATCH_IO_HPP_INCLUDED
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include <stdio.h>
+#include "base_asm.hpp"
+#include "file_cache.hpp"
+
+///nullopt if the file can't be opened or read
+inline
+std::optional<std::string> read_whole_file(const std::string& path)
+{
+    FILE* f = fopen(path.c_str(), "rb");
+
+    if(f == nullptr)
+        return std::nullopt;
+
+    fseek(f, 0, SEEK_END);
+    long fsize = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    if(fsize < 0)
+    {
+        fclose(f);
+        return std::nullopt;
+    }
+
+    std::string ret;
+    ret.resize(fsize);
+
+    size_t got = fsize > 0 ? fread(&ret[0], 1, fsize, f) : 0;
+
+    fclose(f);
+
+    if(got != (size_t)fsize)
+        return std::nullopt;
+
+    return ret;
+}
+
+inline
+bool write_whole_file(const std::string& path, std::string_view data)
+{
+    FILE* f = fopen(path.c_str(), "wb");
+
+    if(f == nullptr)
+        return false;
+
+    bool ok = data.size() == 0 || fwrite(data.data(), data.size(), 1, f) == 1;
+
+    return fclose(f) == 0 && ok;
+}
+
+///a queue which blocks pushers while full, and poppers while empty until it's closed
+///each side is told how long it waited, which is how the batch pipeline tells I/O bound from compute bound
+template<typename T>
+struct bounded_queue
+{
+    std::mutex mut;
+    std::condition_variable has_item;
+    std::condition_variable has_space;
+    std::deque<T> items;
+    size_t capacity = 1;
+    bool closed = false;
+
+    bounded_queue(size_t _capacity) : capacity(std::max(_capacity, (size_t)1)){}
+
+    void push(T item, uint64_t& wait_ns)
+    {
+        auto start = std::chrono::steady_clock::now();
+
+        std::unique_lock lock(mut);
+
+        has_space.wait(lock, [&](){return items.size() < capacity;});
+
+        wait_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+        items.push_back(std::move(item));
+
+        lock.unlock();
+
+        has_item.notify_one();
+    }
+
+    ///nullopt once closed and drained
+    std::optional<T> pop(uint64_t& wait_ns)
+    {
+        auto start = std::chrono::steady_clock::now();
+
+        std::unique_lock lock(mut);
+
+        has_item.wait(lock, [&](){return closed || items.size() > 0;});
+
+        wait_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+        if(items.size() == 0)
+            return std::nullopt;
+
+        T item = std::move(items.front());
+        items.pop_front();
+
+        lock.unlock();
+
+        has_space.notify_one();
+
+        return item;
+    }
+
+    void close()
+    {
+        {
+            std::lock_guard guard(mut);
+            closed = true;
+        }
+
+        has_item.notify_all();
+    }
+};
+
+struct batch_job
+{
+    std::string source_path;
+    std::string out_path;
+};
+
+struct batch_settings
+{
+    ///0 picks one per hardware thread
+    int workers = 0;
+    ///threads reading sources ahead of the workers, and as many again writing images behind them
+    int io_threads = 2;
+    ///sources read but not yet assembled, and images assembled but not yet written. Bounds the memory held in flight
+    size_t queue_capacity = 64;
+    ///what's written for each assembled source, a flat image when null
+    std::string(*encode_image)(const return_info& rinfo) = nullptr;
+};
+
+struct batch_result
+{
+    size_t assembled = 0;
+    ///one line per source which couldn't be read, assembled or written, in no particular order
+    std::vector<std::string> failures;
+
+    uint64_t wall_ns = 0;
+    ///summed over threads
+    uint64_t read_ns = 0;
+    uint64_t write_ns = 0;
+    uint64_t assemble_ns = 0;
+    ///workers with nothing to assemble, as reading hasn't kept up
+    uint64_t input_wait_ns = 0;
+    ///workers with an image they can't hand off, as writing hasn't kept up
+    uint64_t output_wait_ns = 0;
+};
+
+///assembles every job's source into an image at its out_path, flat unless bsett.encode_image says otherwise. Readers run ahead of the assemblers and writers behind them,
+///through bounded queues, so that file I/O overlaps assembly rather than being waited on between every file
+inline
+batch_result assemble_batch(const std::vector<batch_job>& jobs, const assembler_settings& sett, batch_settings bsett)
+{
+    trace_scope trace("assemble_batch", "io");
+
+    struct source_item
+    {
+        const batch_job* job = nullptr;
+        std::string text;
+    };
+
+    struct image_item
+    {
+        const batch_job* job = nullptr;
+        std::string data;
+    };
+
+    bounded_queue<source_item> sources(bsett.queue_capacity);
+    bounded_queue<image_item> images(bsett.queue_capacity);
+
+    std::mutex result_mut;
+    batch_result result;
+
+    auto fail = [&](const batch_job& job, std::string_view why)
+    {
+        std::lock_guard guard(result_mut);
+        result.failures.push_back(job.source_path + ": " + std::string(why));
+    };
+
+    auto add_times = [&](uint64_t batch_result::* field, uint64_t ns)
+    {
+        std::lock_guard guard(result_mut);
+        result.*field += ns;
+    };
+
+    auto start = std::chrono::steady_clock::now();
+
+    int io_threads = std::max(bsett.io_threads, 1);
+    int worker_count = bsett.workers > 0 ? bsett.workers : std::max((int)std::thread::hardware_concurrency(), 1);
+
+    std::atomic<size_t> next_job{0};
+    std::atomic<int> readers_left{io_threads};
+    std::atomic<int> workers_left{worker_count};
+
+    std::vector<std::thread> threads;
+
+    for(int i=0; i < io_threads; i++)
+    {
+        threads.emplace_back([&]()
+        {
+            uint64_t read_ns = 0;
+            uint64_t unused_wait_ns = 0;
+
+            for(size_t idx = next_job++; idx < jobs.size(); idx = next_job++)
+            {
+                auto read_start = std::chrono::steady_clock::now();
+
+                auto text_opt = read_whole_file(jobs[idx].source_path);
+
+                read_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - read_start).count();
+
+                if(!text_opt.has_value())
+                {
+                    fail(jobs[idx], "Could not read");
+                    continue;
+                }
+
+                sources.push({&jobs[idx], std::move(text_opt.value())}, unused_wait_ns);
+            }
+
+            add_times(&batch_result::read_ns, read_ns);
+
+            if(--readers_left == 0)
+                sources.close();
+        });
+    }
+
+    for(int i=0; i < worker_count; i++)
+    {
+        threads.emplace_back([&]()
+        {
+            uint64_t assemble_ns = 0;
+            uint64_t input_wait_ns = 0;
+            uint64_t output_wait_ns = 0;
+
+            while(auto item_opt = sources.pop(input_wait_ns))
+            {
+                source_item& item = item_opt.value();
+
+                auto assemble_start = std::chrono::steady_clock::now();
+
+                ///each source's includes are relative to it
+                assembler_settings job_sett = sett;
+                file_loader loader;
+                loader.base_directory = std::string(directory_of(item.job->source_path));
+
+                if(sett.load_file != nullptr)
+                    loader.apply(job_sett);
+
+                ///too large for a worker's stack
+                auto rinfo = std::make_unique<return_info>();
+                auto err_opt = assemble(*rinfo, item.text, job_sett);
+
+                std::string data;
+                std::string why;
+
+                if(!err_opt.has_value() && bsett.encode_image != nullptr)
+                    data = bsett.encode_image(*rinfo);
+                else if(!err_opt.has_value())
+                    data = std::string((const char*)rinfo->mem.svec.data(), rinfo->mem.size() * sizeof(uint16_t));
+                else
+                    why = "line " + std::to_string(err_opt.value().line) + ": " + std::string(err_opt.value().msg);
+
+                assemble_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - assemble_start).count();
+
+                if(err_opt.has_value())
+                {
+                    fail(*item.job, why);
+                    continue;
+                }
+
+                images.push({item.job, std::move(data)}, output_wait_ns);
+            }
+
+            add_times(&batch_result::assemble_ns, assemble_ns);
+            add_times(&batch_result::input_wait_ns, input_wait_ns);
+            add_times(&batch_result::output_wait_ns, output_wait_ns);
+
+            if(--workers_left == 0)
+                images.close();
+        });
+    }
+
+    for(int i=0; i < io_threads; i++)
+    {
+        threads.emplace_back([&]()
+        {
+            uint64_t write_ns = 0;
+            uint64_t unused_wait_ns = 0;
+            size_t written = 0;
+
+            while(auto item_opt = images.pop(unused_wait_ns))
+            {
+                auto write_start = std::chrono::steady_clock::now();
+
+                bool ok = write_whole_file(item_opt.value().job->out_path, item_opt.value().data);
+
+                write_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - write_start).count();
+
+                if(ok)
+                    written++;
+                else
+                    fail(*item_opt.value().job, "Could not write " + item_opt.value().job->out_path);
+            }
+
+            std::lock_guard guard(result_mut);
+            result.write_ns += write_ns;
+            result.assembled += written;
+        });
+    }
+
+    for(std::thread& thread : threads)
+        thread.join();
+
+    result.wall_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+    return result;
+}
+
+///one source per line, each written next to itself with .asm appended, as for a single source. Blank lines are skipped
+inline
+std::vector<batch_job> parse_batch_list(std::string_view text)
+{
+    std::vector<batch_job> ret;
+
+    while(text.size() > 0)
+    {
+        size_t end = text.find('\n');
+        std::string_view line = text.substr(0, end);
+
+        text.remove_prefix(end == std::string_view::npos ? text.size() : end + 1);
+
+        while(line.size() > 0 && (line.back() == '\r' || line.back() == ' ' || line.back() == '\t'))
+            line.remove_suffix(1);
+
+        while(line.size() > 0 && (line.front() == ' ' || line.front() == '\t'))
+            line.remove_prefix(1);
+
+        if(line.size() == 0)
+            continue;
+
+        ret.push_back({std::string(line), std::string(line) + ".asm"});
+    }
+
+    return ret;
+}
+
+inline
+void print_batch_report(FILE* out, const batch_result& res)
+{
+    for(const std::string& failure : res.failures)
+        fprintf(out, "%s\n", failure.c_str());
+
+    fprintf(out, "Assembled:           %10zu\n", res.assembled);
+    fprintf(out, "Failed:              %10zu\n", res.failures.size());
+    fprintf(out, "Wall:                %10.3f ms\n", res.wall_ns / 1e6);
+    fprintf(out, "Reading:             %10.3f ms\n", res.read_ns / 1e6);
+    fprintf(out, "Assembling:          %10.3f ms\n", res.assemble_ns / 1e6);
+    fprintf(out, "Writing:             %10.3f ms\n", res.write_ns / 1e6);
+    fprintf(out, "Waiting for input:   %10.3f ms\n", res.input_wait_ns / 1e6);
+    fprintf(out, "Waiting for output:  %10.3f ms\n", res.output_wait_ns / 1e6);
+}
+
+#endif // BATCH_IO_HPP_INCLUDED
@@ -0,0 +1,444 @@
+#include "util.hpp"
+#include "base_asm.hpp"
+#include "allocation_counter.hpp"
+#include <string>
+#include <vector>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+
+///deterministic, so that every run and every release benchmarks the same corpus
+struct corpus_rng
+{
+    uint64_t state = 0x9E3779B97F4A7C15ull;
+
+    uint64_t next()
+    {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+
+    int range(int max)
+    {
+        return (int)(next() % (uint64_t)max);
+    }
+
+    template<typename T, size_t N>
+    T pick(const T (&in)[N])
+    {
+        return in[range(N)];
+    }
+};
+
+static const char* registers[] = {"A", "B", "C", "X", "Y", "Z", "I", "J"};
+static const char* basic_ops[] = {"SET", "ADD", "SUB", "MUL", "AND", "BOR", "XOR", "SHL", "SHR"};
+
+///sized so that every corpus still fits into the 64k words of dcpu memory
+static constexpr size_t max_corpus_size = 200000;
+
+std::string generate_straight_line(corpus_rng& rng)
+{
+    std::string out;
+
+    while(out.size() < max_corpus_size)
+    {
+        out += rng.pick(basic_ops);
+        out += " ";
+        out += rng.pick(registers);
+        out += ", ";
+
+        if(rng.range(2) == 0)
+            out += rng.pick(registers);
+        else
+            out += std::to_string(rng.range(31));
+
+        out += "\n";
+    }
+
+    return out;
+}
+
+std::string generate_label_heavy(corpus_rng& rng)
+{
+    std::string out;
+    int label = 0;
+
+    while(out.size() < max_corpus_size)
+    {
+        out += ":label_" + std::to_string(label) + "\n";
+
+        ///a mix of backwards and forwards references
+        int target = label + rng.range(20) - 10;
+
+        if(target < 0)
+            target = 0;
+
+        out += "IFE A, " + std::to_string(rng.range(100)) + "\n";
+        out += "SET PC, label_" + std::to_string(target) + "\n";
+        out += "ADD A, 1\n";
+
+        label++;
+    }
+
+    out += ":label_" + std::to_string(label) + "\n";
+
+    for(int i=1; i < 11; i++)
+    {
+        out += ":label_" + std::to_string(label + i) + "\n";
+    }
+
+    return out;
+}
+
+std::string generate_nested_repeat(corpus_rng& rng)
+{
+    std::string out;
+
+    ///4^6 = 4096 passes over the innermost body
+    for(int i=0; i < 6; i++)
+    {
+        out += std::string(i * 4, ' ') + ".repeat 4\n";
+    }
+
+    out += std::string(24, ' ') + ":inner\n";
+    out += std::string(24, ' ') + "ADD " + std::string(rng.pick(registers)) + ", 1\n";
+    out += std::string(24, ' ') + "IFE A, 0\n";
+    out += std::string(24, ' ') + "SET PC, inner\n";
+
+    for(int i=5; i >= 0; i--)
+    {
+        out += std::string(i * 4, ' ') + ".end\n";
+    }
+
+    return out;
+}
+
+std::string generate_expression_heavy(corpus_rng& rng)
+{
+    std::string out;
+    int label = 0;
+
+    while(out.size() < max_corpus_size)
+    {
+        if(rng.range(8) == 0)
+            out += ":expr_" + std::to_string(label++) + "\n";
+
+        std::string lhs = std::to_string(rng.range(50)) + " * " + std::to_string(rng.range(50)) + " + (" + std::to_string(rng.range(1000)) + " - 0x" + std::to_string(rng.range(9)) + ")";
+
+        switch(rng.range(3))
+        {
+            case 0:
+                out += "SET " + std::string(rng.pick(registers)) + ", " + lhs + "\n";
+                break;
+            case 1:
+                out += "SET [" + std::string(rng.pick(registers)) + " + " + lhs + "], 1\n";
+                break;
+            default:
+                if(label > 0)
+                    out += "ADD A, expr_" + std::to_string(rng.range(label)) + " + " + lhs + "\n";
+                else
+                    out += "ADD A, " + lhs + "\n";
+                break;
+        }
+    }
+
+    return out;
+}
+
+std::string generate_data_tables(corpus_rng& rng)
+{
+    std::string out;
+
+    while(out.size() < max_corpus_size)
+    {
+        if(rng.range(4) == 0)
+        {
+            out += ".dat \"";
+
+            for(int i=0; i < 60; i++)
+            {
+                out += (char)('a' + rng.range(26));
+            }
+
+            out += "\\n\"\n";
+        }
+        else
+        {
+            out += ".dat ";
+
+            for(int i=0; i < 16; i++)
+            {
+                if(i != 0)
+                    out += ", ";
+
+                out += "0x" + std::to_string(1000 + rng.range(8999));
+            }
+
+            out += "\n";
+        }
+    }
+
+    return out;
+}
+
+std::vector<std::string> generate_units(corpus_rng& rng, int count)
+{
+    std::vector<std::string> units;
+
+    for(int i=0; i < count; i++)
+    {
+        std::string out;
+
+        out += ".export unit_" + std::to_string(i) + "\n";
+        out += ":unit_" + std::to_string(i) + "\n";
+
+        for(int k=0; k < 40; k++)
+        {
+            out += std::string(rng.pick(basic_ops)) + " " + rng.pick(registers) + ", " + std::to_string(rng.range(31)) + "\n";
+        }
+
+        ///calls into other units
+        for(int k=0; k < 4; k++)
+        {
+            out += "JSR unit_" + std::to_string(rng.range(count)) + "\n";
+        }
+
+        out += "SET PC, POP\n";
+
+        units.push_back(out);
+    }
+
+    return units;
+}
+
+size_t count_lines(std::string_view in)
+{
+    size_t lines = 1;
+
+    for(char c : in)
+    {
+        if(c == '\n')
+            lines++;
+    }
+
+    return lines;
+}
+
+struct bench_result
+{
+    std::string name;
+    uint64_t iterations = 0;
+    double seconds = 0;
+    size_t lines = 0;
+    size_t bytes = 0;
+    uint64_t allocations = 0;
+    ///whether the corpus assembled, a benchmark of a failing assembly is meaningless
+    bool ok = true;
+};
+
+///repeats func until at least min_seconds have passed
+template<typename T>
+bench_result run_bench(const std::string& name, size_t lines, size_t bytes, double min_seconds, T&& func)
+{
+    bench_result res;
+    res.name = name;
+    res.lines = lines;
+    res.bytes = bytes;
+
+    ///warm up
+    res.ok = func();
+
+    uint64_t allocations_start = allocation_count.load();
+    auto start = std::chrono::steady_clock::now();
+
+    do
+    {
+        res.ok = func() && res.ok;
+        res.iterations++;
+        res.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    } while(res.seconds < min_seconds);
+
+    res.allocations = allocation_count.load() - allocations_start;
+
+    return res;
+}
+
+void write_json(FILE* out, const std::vector<bench_result>& results)
+{
+    fprintf(out, "{\n  \"version\": 1,\n  \"benchmarks\": [\n");
+
+    for(size_t i=0; i < results.size(); i++)
+    {
+        const bench_result& r = results[i];
+
+        double calls = (double)r.iterations;
+
+        fprintf(out, "    {\"name\": \"%s\", \"ok\": %s, \"iterations\": %llu, \"seconds\": %.6f, \"ns_per_call\": %.1f, "
+                     "\"lines_per_second\": %.1f, \"bytes_per_second\": %.1f, \"allocations_per_call\": %.2f}%s\n",
+                r.name.c_str(), r.ok ? "true" : "false", (unsigned long long)r.iterations, r.seconds, r.seconds * 1e9 / calls,
+                (double)r.lines * calls / r.seconds, (double)r.bytes * calls / r.seconds, (double)r.allocations / calls,
+                i + 1 == results.size() ? "" : ",");
+    }
+
+    fprintf(out, "  ]\n}\n");
+}
+
+int main(int argc, char* argv[])
+{
+    double min_seconds = 0.5;
+    const char* out_name = nullptr;
+
+    for(int i=1; i < argc; i++)
+    {
+        std::string_view view(argv[i]);
+
+        if(view.starts_with("-ftime="))
+        {
+            view.remove_prefix(7);
+            min_seconds = atof(std::string(view).c_str());
+        }
+        else
+        {
+            out_name = argv[i];
+        }
+    }
+
+    corpus_rng rng;
+
+    std::vector<std::pair<std::string, std::string>> corpora =
+    {
+        {"straight_line", generate_straight_line(rng)},
+        {"label_heavy", generate_label_heavy(rng)},
+        {"nested_repeat", generate_nested_repeat(rng)},
+        {"expression_heavy", generate_expression_heavy(rng)},
+        {"data_tables", generate_data_tables(rng)},
+    };
+
+    std::vector<bench_result> results;
+
+    for(const auto& [name, text] : corpora)
+    {
+        results.push_back(run_bench("assemble_" + name, count_lines(text), text.size(), min_seconds, [&]()
+        {
+            return assemble(text).first.has_value();
+        }));
+    }
+
+    {
+        std::vector<std::string> units = generate_units(rng, 64);
+
+        size_t lines = 0;
+        size_t bytes = 0;
+
+        for(const std::string& unit : units)
+        {
+            lines += count_lines(unit);
+            bytes += unit.size();
+        }
+
+        results.push_back(run_bench("assemble_multiple_64_units", lines, bytes, min_seconds, [&]()
+        {
+            return assemble_multiple(units).first.has_value();
+        }));
+    }
+
+    ///microbenchmarks, counted per line of input where there is one
+    {
+        const std::string& text = corpora[0].second;
+
+        results.push_back(run_bench("consume_next", count_lines(text), text.size(), min_seconds, [&]()
+        {
+            std::string_view view = text;
+            size_t tokens = 0;
+
+            while(view.size() > 0)
+            {
+                tokens += consume_next(view, true).size() > 0;
+            }
+
+            return tokens > 0;
+        }));
+    }
+
+    {
+        symbol_table sym;
+        assembler_settings sett;
+        std::vector<uint32_t> scope;
+
+        const char* operands[] = {"A", "[B]", "[C + 4]", "0x1234", "12", "PEEK", "[SP + 3]", "PC"};
+
+        results.push_back(run_bench("decode_value", 8, 0, min_seconds, [&]()
+        {
+            bool ok = true;
+
+            for(const char* operand : operands)
+            {
+                ok = decode_value(operand, arg_pos::A, sym, sett, scope).has_value() && ok;
+            }
+
+            return ok;
+        }));
+    }
+
+    {
+        symbol_table sym;
+        std::vector<uint32_t> scope;
+
+        results.push_back(run_bench("parse_expression", 1, 0, min_seconds, [&]()
+        {
+            bool should_delay = false;
+            return parse_expression(sym, "(12 * 3 + 0x40) / 2 - 1 | 0b1010", should_delay, scope).has_value();
+        }));
+    }
+
+    {
+        symbol_table sym;
+        std::vector<std::string> names;
+
+        for(int i=0; i < 1000; i++)
+        {
+            names.push_back("symbol_" + std::to_string(i));
+        }
+
+        for(int i=0; i < 1000; i++)
+        {
+            label l;
+            l.name = names[i];
+            l.offset = i;
+            sym.definitions.push_back(l);
+        }
+
+        std::vector<uint32_t> scope;
+
+        results.push_back(run_bench("get_symbol_definition_1000", 1, 0, min_seconds, [&]()
+        {
+            return sym.get_symbol_definition("symbol_999", scope).has_value();
+        }));
+    }
+
+    FILE* out = stdout;
+
+    if(out_name != nullptr)
+        out = fopen(out_name, "w");
+
+    if(out == nullptr)
+    {
+        printf("Could not open %s\n", out_name);
+        return 1;
+    }
+
+    write_json(out, results);
+
+    if(out != stdout)
+        fclose(out);
+
+    for(const bench_result& r : results)
+    {
+        if(!r.ok)
+            return 1;
+    }
+
+    return 0;
+}
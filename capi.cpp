@@ -0,0 +1,228 @@
+#define DCPU16ASM_BUILDING
+#include "dcpu16asm.h"
+#include "base_asm.hpp"
+#include "file_cache.hpp"
+#include "link.hpp"
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+struct dcpu16asm_context
+{
+    std::mutex mut;
+    assembler_settings sett;
+    ///not guarded by mut, as it has to be set while an assembly holds it
+    std::atomic<bool> cancel{false};
+    ///provided_symbol_definitions points into these
+    std::vector<std::unique_ptr<std::string>> definition_names;
+
+    ///far too large for the caller's stack, and has to stay put while spans into it are handed out
+    std::unique_ptr<return_info> result;
+    std::vector<dcpu16asm_export> exports;
+
+    ///error_info points into the source, which the caller may free as soon as assembly returns
+    std::string error_msg;
+    std::string error_name;
+    std::string error_file;
+    dcpu16asm_error error = {};
+
+    ///assembled is only kept if there's no error
+    void store(std::unique_ptr<return_info> assembled, const std::optional<error_info>& err_opt)
+    {
+        result.reset();
+        exports.clear();
+        error = {};
+
+        if(err_opt.has_value())
+        {
+            const error_info& err = err_opt.value();
+
+            error_msg = std::string(err.msg);
+            error_name = std::string(err.name_in_source);
+            error_file = std::string(err.file);
+
+            error.line = err.line;
+            error.character = err.character;
+            error.cancelled = err.cancelled;
+            error.msg = {error_msg.data(), error_msg.size()};
+            error.name_in_source = {error_name.data(), error_name.size()};
+            error.file = {error_file.data(), error_file.size()};
+            return;
+        }
+
+        result = std::move(assembled);
+
+        for(const auto& [address, name] : result->exported_label_names)
+        {
+            exports.push_back({address, {name.data(), name.size()}});
+        }
+    }
+};
+
+template<typename T>
+dcpu16asm_words words_of(const T& vec)
+{
+    return {vec.data(), vec.size()};
+}
+
+extern "C"
+{
+
+uint32_t dcpu16asm_abi_version(void)
+{
+    return DCPU16ASM_ABI_VERSION;
+}
+
+dcpu16asm_context* dcpu16asm_create(void)
+{
+    dcpu16asm_context* ctx = new dcpu16asm_context;
+    ctx->sett.cancel = &ctx->cancel;
+    return ctx;
+}
+
+void dcpu16asm_destroy(dcpu16asm_context* ctx)
+{
+    delete ctx;
+}
+
+void dcpu16asm_set_flags(dcpu16asm_context* ctx, uint32_t flags)
+{
+    std::lock_guard guard(ctx->mut);
+
+    ctx->sett.no_packed_constants = (flags & DCPU16ASM_NO_PACKED_CONSTANTS) != 0;
+    ctx->sett.allow_unresolved_symbols = (flags & DCPU16ASM_ALLOW_UNRESOLVED_SYMBOLS) != 0;
+}
+
+void dcpu16asm_set_location(dcpu16asm_context* ctx, uint16_t location)
+{
+    std::lock_guard guard(ctx->mut);
+
+    ctx->sett.location = location;
+}
+
+void dcpu16asm_define(dcpu16asm_context* ctx, const char* name, size_t name_size, uint16_t value)
+{
+    std::lock_guard guard(ctx->mut);
+
+    ctx->definition_names.push_back(std::make_unique<std::string>(name, name_size));
+    ctx->sett.provided_symbol_definitions.push_back({value, *ctx->definition_names.back()});
+}
+
+void dcpu16asm_set_budgets(dcpu16asm_context* ctx, uint32_t max_words, uint64_t max_expansion_steps, int max_repeat_depth, uint32_t max_fixups)
+{
+    std::lock_guard guard(ctx->mut);
+
+    ctx->sett.budgets = {max_words, max_expansion_steps, max_repeat_depth, max_fixups};
+}
+
+void dcpu16asm_set_progress(dcpu16asm_context* ctx, dcpu16asm_progress_callback callback, void* user)
+{
+    std::lock_guard guard(ctx->mut);
+
+    ctx->sett.progress = callback;
+    ctx->sett.progress_user = user;
+}
+
+void dcpu16asm_cancel(dcpu16asm_context* ctx)
+{
+    ctx->cancel.store(true);
+}
+
+int dcpu16asm_assemble(dcpu16asm_context* ctx, const char* source, size_t source_size)
+{
+    std::lock_guard guard(ctx->mut);
+
+    ctx->cancel.store(false);
+
+    ///store copies out everything which could point into an included file
+    assembler_settings sett = ctx->sett;
+    file_loader loader;
+    loader.apply(sett);
+
+    ///assembled straight into its final place, rather than on this thread's stack and then copied
+    auto assembled = std::make_unique<return_info>();
+    auto err_opt = assemble(*assembled, std::string_view(source, source_size), sett);
+
+    ctx->store(std::move(assembled), err_opt);
+
+    return ctx->result != nullptr;
+}
+
+int dcpu16asm_link(dcpu16asm_context* ctx, const dcpu16asm_unit* units, size_t unit_count)
+{
+    std::lock_guard guard(ctx->mut);
+
+    ctx->cancel.store(false);
+
+    std::vector<link_unit> link_units;
+
+    for(size_t i=0; i < unit_count; i++)
+    {
+        link_units.push_back({std::string_view(units[i].name.data, units[i].name.size), std::string_view(units[i].text.data, units[i].text.size)});
+    }
+
+    assembler_settings sett = ctx->sett;
+    file_loader loader;
+    loader.apply(sett);
+
+    auto assembled = std::make_unique<return_info>();
+    auto err_opt = link(*assembled, link_units, {}, sett);
+
+    ctx->store(std::move(assembled), err_opt);
+
+    return ctx->result != nullptr;
+}
+
+dcpu16asm_words dcpu16asm_image(dcpu16asm_context* ctx)
+{
+    std::lock_guard guard(ctx->mut);
+
+    return ctx->result ? words_of(ctx->result->mem) : dcpu16asm_words{};
+}
+
+dcpu16asm_words dcpu16asm_translation_map(dcpu16asm_context* ctx)
+{
+    std::lock_guard guard(ctx->mut);
+
+    return ctx->result ? words_of(ctx->result->translation_map) : dcpu16asm_words{};
+}
+
+dcpu16asm_words dcpu16asm_pc_to_source_line(dcpu16asm_context* ctx)
+{
+    std::lock_guard guard(ctx->mut);
+
+    return ctx->result ? words_of(ctx->result->pc_to_source_line) : dcpu16asm_words{};
+}
+
+dcpu16asm_words dcpu16asm_source_line_to_pc(dcpu16asm_context* ctx)
+{
+    std::lock_guard guard(ctx->mut);
+
+    return ctx->result ? words_of(ctx->result->source_line_to_pc) : dcpu16asm_words{};
+}
+
+size_t dcpu16asm_export_count(dcpu16asm_context* ctx)
+{
+    std::lock_guard guard(ctx->mut);
+
+    return ctx->exports.size();
+}
+
+dcpu16asm_export dcpu16asm_export_at(dcpu16asm_context* ctx, size_t idx)
+{
+    std::lock_guard guard(ctx->mut);
+
+    if(idx >= ctx->exports.size())
+        return {};
+
+    return ctx->exports[idx];
+}
+
+dcpu16asm_error dcpu16asm_last_error(dcpu16asm_context* ctx)
+{
+    std::lock_guard guard(ctx->mut);
+
+    return ctx->error;
+}
+
+}
@@ -0,0 +1,141 @@
+#ifndef CHANNEL_HPP_INCLUDED
+#define CHANNEL_HPP_INCLUDED
+
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+
+///bounded lock free multi producer multi consumer queue, carrying the values for snd/rcv
+///https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+struct channel
+{
+    struct cell
+    {
+        std::atomic<size_t> sequence;
+        uint16_t value = 0;
+    };
+
+    std::unique_ptr<cell[]> buffer;
+    size_t mask = 0;
+
+    alignas(64) std::atomic<size_t> enqueue_pos{0};
+    alignas(64) std::atomic<size_t> dequeue_pos{0};
+
+    ///cores currently stalled on this channel, used by ifw/ifr
+    std::atomic<int> waiting_readers{0};
+    std::atomic<int> waiting_writers{0};
+
+    std::atomic<uint64_t> sends{0};
+    std::atomic<uint64_t> receives{0};
+    std::atomic<uint64_t> send_stalls{0};
+    std::atomic<uint64_t> receive_stalls{0};
+
+    ///capacity is rounded up to a power of 2, and is at least 2 as the sequence numbers of a single cell queue are ambiguous
+    void init(size_t capacity)
+    {
+        size_t rounded = 2;
+
+        while(rounded < capacity)
+            rounded *= 2;
+
+        buffer = std::make_unique<cell[]>(rounded);
+        mask = rounded - 1;
+
+        for(size_t i=0; i < rounded; i++)
+        {
+            buffer[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    bool try_push(uint16_t value)
+    {
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+
+        while(true)
+        {
+            cell& c = buffer[pos & mask];
+            size_t seq = c.sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+            if(diff == 0)
+            {
+                if(enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    c.value = value;
+                    c.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if(diff < 0)
+            {
+                return false;
+            }
+            else
+            {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool try_pop(uint16_t& out)
+    {
+        size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+
+        while(true)
+        {
+            cell& c = buffer[pos & mask];
+            size_t seq = c.sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+            if(diff == 0)
+            {
+                if(dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    out = c.value;
+                    c.sequence.store(pos + mask + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if(diff < 0)
+            {
+                return false;
+            }
+            else
+            {
+                pos = dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool has_value() const
+    {
+        size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+
+        return buffer[pos & mask].sequence.load(std::memory_order_acquire) == pos + 1;
+    }
+};
+
+///the set of channels shared between cores. Channel ids wrap around the number of channels
+struct channel_network
+{
+    std::unique_ptr<channel[]> channels;
+    size_t count = 0;
+
+    ///bumped on every successful transfer, so a scheduler can tell stalled cores from deadlocked ones
+    std::atomic<uint64_t> progress{0};
+
+    channel_network(size_t num_channels, size_t capacity) : channels(std::make_unique<channel[]>(num_channels)), count(num_channels)
+    {
+        for(size_t i=0; i < count; i++)
+        {
+            channels[i].init(capacity);
+        }
+    }
+
+    channel& get(uint16_t id)
+    {
+        return channels[id % count];
+    }
+};
+
+#endif // CHANNEL_HPP_INCLUDED
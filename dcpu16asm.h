@@ -0,0 +1,118 @@
+#ifndef DCPU16ASM_H_INCLUDED
+#define DCPU16ASM_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+C interface to the assembler, built as libdcpu16asm from capi.cpp
+
+Everything hangs off an opaque context. Contexts are independent of each other, and every call on one context is serialised,
+so any number of threads may each use their own, or share one
+Results are owned by the context and handed out as borrowed spans, without copying. They stay valid until the next
+dcpu16asm_assemble or dcpu16asm_link on the same context, or until it is destroyed
+*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*define DCPU16ASM_STATIC when capi.cpp is compiled into the program itself, rather than used as a shared library*/
+#if defined(DCPU16ASM_STATIC)
+    #define DCPU16ASM_API
+#elif defined(_WIN32)
+    #if defined(DCPU16ASM_BUILDING)
+        #define DCPU16ASM_API __declspec(dllexport)
+    #else
+        #define DCPU16ASM_API __declspec(dllimport)
+    #endif
+#else
+    #define DCPU16ASM_API __attribute__((visibility("default")))
+#endif
+
+/*bumped whenever a signature or struct layout below changes*/
+#define DCPU16ASM_ABI_VERSION 2
+
+/*for dcpu16asm_set_flags*/
+#define DCPU16ASM_NO_PACKED_CONSTANTS 1u
+#define DCPU16ASM_ALLOW_UNRESOLVED_SYMBOLS 2u
+
+typedef struct dcpu16asm_context dcpu16asm_context;
+
+typedef struct
+{
+    const uint16_t* data;
+    size_t size;
+} dcpu16asm_words;
+
+/*not null terminated*/
+typedef struct
+{
+    const char* data;
+    size_t size;
+} dcpu16asm_string;
+
+typedef struct
+{
+    uint16_t address;
+    dcpu16asm_string name;
+} dcpu16asm_export;
+
+typedef struct
+{
+    int line;
+    int character;
+    /*1 if dcpu16asm_cancel stopped the assembly*/
+    int cancelled;
+    dcpu16asm_string msg;
+    dcpu16asm_string name_in_source;
+    /*the .include'd file or link unit the error is in, empty for the source itself*/
+    dcpu16asm_string file;
+} dcpu16asm_error;
+
+/*one source for dcpu16asm_link. The name is what errors and file maps refer to it by*/
+typedef struct
+{
+    dcpu16asm_string name;
+    dcpu16asm_string text;
+} dcpu16asm_unit;
+
+/*the DCPU16ASM_ABI_VERSION the library was built with*/
+DCPU16ASM_API uint32_t dcpu16asm_abi_version(void);
+
+DCPU16ASM_API dcpu16asm_context* dcpu16asm_create(void);
+DCPU16ASM_API void dcpu16asm_destroy(dcpu16asm_context* ctx);
+
+/*settings apply to every later assembly on the context*/
+DCPU16ASM_API void dcpu16asm_set_flags(dcpu16asm_context* ctx, uint32_t flags);
+DCPU16ASM_API void dcpu16asm_set_location(dcpu16asm_context* ctx, uint16_t location);
+/*the name is copied*/
+DCPU16ASM_API void dcpu16asm_define(dcpu16asm_context* ctx, const char* name, size_t name_size, uint16_t value);
+/*limits for untrusted sources, 0 is unlimited. Expansion steps are .repeat iterations and macro expansions, fixups are forward references*/
+DCPU16ASM_API void dcpu16asm_set_budgets(dcpu16asm_context* ctx, uint32_t max_words, uint64_t max_expansion_steps, int max_repeat_depth, uint32_t max_fixups);
+/*called from inside dcpu16asm_assemble or dcpu16asm_link every so often, and once at the end. Null removes it*/
+typedef void (*dcpu16asm_progress_callback)(void* user, uint64_t bytes_consumed, uint64_t words_emitted);
+DCPU16ASM_API void dcpu16asm_set_progress(dcpu16asm_context* ctx, dcpu16asm_progress_callback callback, void* user);
+/*the only call which may be made while another thread is assembling on ctx. That assembly fails promptly, with cancelled set in its error
+the request is forgotten when the next assembly on ctx starts*/
+DCPU16ASM_API void dcpu16asm_cancel(dcpu16asm_context* ctx);
+
+/*return 1 on success, and 0 with dcpu16asm_last_error filled in on failure. The source only needs to live for the duration of the call*/
+DCPU16ASM_API int dcpu16asm_assemble(dcpu16asm_context* ctx, const char* source, size_t source_size);
+DCPU16ASM_API int dcpu16asm_link(dcpu16asm_context* ctx, const dcpu16asm_unit* units, size_t unit_count);
+
+/*all empty unless the last assembly succeeded*/
+DCPU16ASM_API dcpu16asm_words dcpu16asm_image(dcpu16asm_context* ctx);
+DCPU16ASM_API dcpu16asm_words dcpu16asm_translation_map(dcpu16asm_context* ctx);
+DCPU16ASM_API dcpu16asm_words dcpu16asm_pc_to_source_line(dcpu16asm_context* ctx);
+DCPU16ASM_API dcpu16asm_words dcpu16asm_source_line_to_pc(dcpu16asm_context* ctx);
+DCPU16ASM_API size_t dcpu16asm_export_count(dcpu16asm_context* ctx);
+DCPU16ASM_API dcpu16asm_export dcpu16asm_export_at(dcpu16asm_context* ctx, size_t idx);
+
+DCPU16ASM_API dcpu16asm_error dcpu16asm_last_error(dcpu16asm_context* ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DCPU16ASM_H_INCLUDED */
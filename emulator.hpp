@@ -0,0 +1,728 @@
+#ifndef EMULATOR_HPP_INCLUDED
+#define EMULATOR_HPP_INCLUDED
+
+#include <array>
+#include <vector>
+#include <stdint.h>
+#include "base_asm_fwd.hpp"
+#include "channel.hpp"
+
+///per address execution counts, indexed by the pc an instruction started at
+struct execution_profile
+{
+    std::vector<uint64_t> hits;
+    std::vector<uint64_t> cycles;
+
+    execution_profile() : hits(MEM_SIZE), cycles(MEM_SIZE){}
+
+    void clear()
+    {
+        std::fill(hits.begin(), hits.end(), 0);
+        std::fill(cycles.begin(), cycles.end(), 0);
+    }
+};
+
+///an instruction decoded once and cached until the memory backing it is written to
+struct predecoded_instruction
+{
+    uint8_t o = 0;
+    uint8_t a = 0;
+    uint8_t b = 0;
+    ///0 means not decoded yet
+    uint8_t words = 0;
+    uint8_t cycles = 0;
+    bool is_conditional = false;
+};
+
+struct dcpu_operand
+{
+    ///nullptr for literals, writes to literals are silently ignored
+    uint16_t* location = nullptr;
+    uint16_t address = 0;
+    bool is_memory = false;
+    uint16_t value = 0;
+};
+
+namespace dcpu_state
+{
+    enum type
+    {
+        RUNNING,
+        HALTED,
+        ///illegal instruction or interrupt queue overflow
+        FAULTED,
+        ///the last instruction stalled on a channel and will be retried on the next step
+        BLOCKED,
+    };
+}
+
+constexpr
+bool operand_uses_next_word(uint8_t val)
+{
+    return (val >= 0x10 && val <= 0x17) || val == 0x1a || val == 0x1e || val == 0x1f;
+}
+
+constexpr
+int basic_opcode_cycles(uint8_t o)
+{
+    switch(o)
+    {
+        case 0x01: return 1; ///set
+        case 0x02: return 2; ///add
+        case 0x03: return 2; ///sub
+        case 0x04: return 2; ///mul
+        case 0x05: return 2; ///mli
+        case 0x06: return 3; ///div
+        case 0x07: return 3; ///dvi
+        case 0x08: return 3; ///mod
+        case 0x09: return 3; ///mdi
+        case 0x0a: return 1; ///and
+        case 0x0b: return 1; ///bor
+        case 0x0c: return 1; ///xor
+        case 0x0d: return 1; ///shr
+        case 0x0e: return 1; ///asr
+        case 0x0f: return 1; ///shl
+        case 0x10: case 0x11: case 0x12: case 0x13:
+        case 0x14: case 0x15: case 0x16: case 0x17:
+            return 2; ///if*
+        case 0x1a: return 3; ///adx
+        case 0x1b: return 3; ///sbx
+        case 0x1c: return 2; ///snd
+        case 0x1d: return 2; ///rcv
+        case 0x1e: return 2; ///sti
+        case 0x1f: return 2; ///std
+    }
+
+    return 0;
+}
+
+constexpr
+int special_opcode_cycles(uint8_t o)
+{
+    switch(o)
+    {
+        case 0x00: return 1; ///brk
+        case 0x01: return 3; ///jsr
+        case 0x08: return 4; ///int
+        case 0x09: return 1; ///iag
+        case 0x0a: return 1; ///ias
+        case 0x0b: return 3; ///rfi
+        case 0x0c: return 2; ///iaq
+        case 0x10: return 2; ///hwn
+        case 0x11: return 4; ///hwq
+        case 0x12: return 4; ///hwi
+        case 0x1a: return 2; ///ifw
+        case 0x1b: return 2; ///ifr
+    }
+
+    return 0;
+}
+
+struct dcpu
+{
+    ///a b c x y z i j
+    std::array<uint16_t, 8> regs = {};
+    uint16_t pc = 0;
+    uint16_t sp = 0;
+    uint16_t ex = 0;
+    uint16_t ia = 0;
+
+    uint64_t cycles = 0;
+    uint64_t instructions = 0;
+    uint64_t stalled_cycles = 0;
+    dcpu_state::type state = dcpu_state::RUNNING;
+
+    ///this struct is large, allocate it on the heap
+    std::array<uint16_t, MEM_SIZE> mem = {};
+    std::array<predecoded_instruction, MEM_SIZE> icache = {};
+
+    bool interrupt_queueing = false;
+    std::vector<uint16_t> interrupt_queue;
+
+    execution_profile* profile = nullptr;
+
+    ///nullptr when running standalone, in which case channel instructions fault
+    channel_network* network = nullptr;
+    ///the channel this core is registered as waiting on, if blocked
+    channel* waiting_channel = nullptr;
+    bool waiting_to_read = false;
+
+    void reset()
+    {
+        regs = {};
+        pc = 0;
+        sp = 0;
+        ex = 0;
+        ia = 0;
+        cycles = 0;
+        instructions = 0;
+        stalled_cycles = 0;
+        state = dcpu_state::RUNNING;
+        interrupt_queueing = false;
+        interrupt_queue.clear();
+
+        std::fill(icache.begin(), icache.end(), predecoded_instruction());
+    }
+
+    void load(const uint16_t* words, size_t count, uint16_t address = 0)
+    {
+        for(size_t i=0; i < count; i++)
+        {
+            write_mem((uint16_t)(address + i), words[i]);
+        }
+    }
+
+    void load(const return_info& rinfo)
+    {
+        load(rinfo.mem.data(), rinfo.mem.size());
+    }
+
+    ///instructions are at most 3 words long, so a write can only affect the decode of the 2 preceding cells
+    void invalidate(uint16_t address)
+    {
+        icache[address].words = 0;
+        icache[(uint16_t)(address - 1)].words = 0;
+        icache[(uint16_t)(address - 2)].words = 0;
+    }
+
+    void write_mem(uint16_t address, uint16_t value)
+    {
+        mem[address] = value;
+        invalidate(address);
+    }
+
+    predecoded_instruction predecode(uint16_t address) const
+    {
+        uint16_t word = mem[address];
+
+        predecoded_instruction ins;
+        ins.o = word & 0b11111;
+        ins.b = (word >> 5) & 0b11111;
+        ins.a = (word >> 10) & 0b111111;
+        ins.words = 1 + operand_uses_next_word(ins.a);
+
+        if(ins.o == 0)
+        {
+            ins.cycles = special_opcode_cycles(ins.b);
+            ins.is_conditional = ins.b == 0x1a || ins.b == 0x1b;
+        }
+        else
+        {
+            ins.words += operand_uses_next_word(ins.b);
+            ins.cycles = basic_opcode_cycles(ins.o);
+            ins.is_conditional = ins.o >= 0x10 && ins.o <= 0x17;
+        }
+
+        ins.cycles += ins.words - 1;
+
+        return ins;
+    }
+
+    const predecoded_instruction& decode(uint16_t address)
+    {
+        predecoded_instruction& ins = icache[address];
+
+        if(ins.words == 0)
+            ins = predecode(address);
+
+        return ins;
+    }
+
+    uint16_t next_word()
+    {
+        return mem[pc++];
+    }
+
+    template<bool is_a>
+    dcpu_operand fetch_operand(uint8_t code)
+    {
+        dcpu_operand op;
+
+        auto set_memory = [&](uint16_t address)
+        {
+            op.location = &mem[address];
+            op.address = address;
+            op.is_memory = true;
+        };
+
+        switch(code)
+        {
+            case 0x00: case 0x01: case 0x02: case 0x03:
+            case 0x04: case 0x05: case 0x06: case 0x07:
+                op.location = &regs[code];
+                break;
+            case 0x08: case 0x09: case 0x0a: case 0x0b:
+            case 0x0c: case 0x0d: case 0x0e: case 0x0f:
+                set_memory(regs[code - 0x08]);
+                break;
+            case 0x10: case 0x11: case 0x12: case 0x13:
+            case 0x14: case 0x15: case 0x16: case 0x17:
+                set_memory(regs[code - 0x10] + next_word());
+                break;
+            ///pop in a, push in b
+            case 0x18:
+                if constexpr(is_a)
+                    set_memory(sp++);
+                else
+                    set_memory(--sp);
+                break;
+            case 0x19:
+                set_memory(sp);
+                break;
+            case 0x1a:
+                set_memory(sp + next_word());
+                break;
+            case 0x1b:
+                op.location = &sp;
+                break;
+            case 0x1c:
+                op.location = &pc;
+                break;
+            case 0x1d:
+                op.location = &ex;
+                break;
+            case 0x1e:
+                set_memory(next_word());
+                break;
+            case 0x1f:
+                op.value = next_word();
+                break;
+            default:
+                op.value = (uint16_t)(code - 0x21);
+                break;
+        }
+
+        if(op.location)
+            op.value = *op.location;
+
+        return op;
+    }
+
+    void store(const dcpu_operand& op, uint16_t value)
+    {
+        if(op.location == nullptr)
+            return;
+
+        *op.location = value;
+
+        if(op.is_memory)
+            invalidate(op.address);
+    }
+
+    void push(uint16_t value)
+    {
+        write_mem(--sp, value);
+    }
+
+    uint16_t pop()
+    {
+        return mem[sp++];
+    }
+
+    void interrupt(uint16_t message)
+    {
+        if(ia == 0)
+            return;
+
+        interrupt_queue.push_back(message);
+
+        if(interrupt_queue.size() > 256)
+            state = dcpu_state::FAULTED;
+    }
+
+    void dispatch_interrupt()
+    {
+        uint16_t message = interrupt_queue.front();
+        interrupt_queue.erase(interrupt_queue.begin());
+
+        interrupt_queueing = true;
+        push(pc);
+        push(regs[0]);
+        pc = ia;
+        regs[0] = message;
+    }
+
+    ///registers this core as stalled on a channel, so that ifw/ifr on other cores can see it
+    void wait_on(channel& chan, bool reading)
+    {
+        if(waiting_channel == &chan && waiting_to_read == reading)
+            return;
+
+        stop_waiting();
+
+        waiting_channel = &chan;
+        waiting_to_read = reading;
+
+        if(reading)
+            chan.waiting_readers.fetch_add(1, std::memory_order_relaxed);
+        else
+            chan.waiting_writers.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void stop_waiting()
+    {
+        if(waiting_channel == nullptr)
+            return;
+
+        if(waiting_to_read)
+            waiting_channel->waiting_readers.fetch_sub(1, std::memory_order_relaxed);
+        else
+            waiting_channel->waiting_writers.fetch_sub(1, std::memory_order_relaxed);
+
+        waiting_channel = nullptr;
+    }
+
+    void channel_send(uint16_t id, uint16_t value)
+    {
+        channel& chan = network->get(id);
+
+        if(!chan.try_push(value))
+        {
+            chan.send_stalls.fetch_add(1, std::memory_order_relaxed);
+            wait_on(chan, false);
+            state = dcpu_state::BLOCKED;
+            return;
+        }
+
+        stop_waiting();
+        chan.sends.fetch_add(1, std::memory_order_relaxed);
+        network->progress.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    bool channel_receive(uint16_t id, uint16_t& value)
+    {
+        channel& chan = network->get(id);
+
+        if(!chan.try_pop(value))
+        {
+            chan.receive_stalls.fetch_add(1, std::memory_order_relaxed);
+            wait_on(chan, true);
+            state = dcpu_state::BLOCKED;
+            return false;
+        }
+
+        stop_waiting();
+        chan.receives.fetch_add(1, std::memory_order_relaxed);
+        network->progress.fetch_add(1, std::memory_order_relaxed);
+
+        return true;
+    }
+
+    ///skips the next instruction, and any conditionals chained onto it
+    void skip()
+    {
+        while(true)
+        {
+            const predecoded_instruction& ins = decode(pc);
+
+            pc += ins.words;
+            cycles++;
+
+            if(!ins.is_conditional)
+                return;
+        }
+    }
+
+    void execute_special(const predecoded_instruction& ins)
+    {
+        dcpu_operand a = fetch_operand<true>(ins.a);
+
+        switch(ins.b)
+        {
+            case 0x00:
+                state = dcpu_state::HALTED;
+                return;
+            case 0x01:
+                push(pc);
+                pc = a.value;
+                return;
+            case 0x08:
+                interrupt(a.value);
+                return;
+            case 0x09:
+                store(a, ia);
+                return;
+            case 0x0a:
+                ia = a.value;
+                return;
+            case 0x0b:
+                interrupt_queueing = false;
+                regs[0] = pop();
+                pc = pop();
+                return;
+            case 0x0c:
+                interrupt_queueing = a.value != 0;
+                return;
+            ///no hardware is attached
+            case 0x10:
+                store(a, 0);
+                return;
+            case 0x11:
+            case 0x12:
+                return;
+            ///ifw, only executes the next instruction if a value is waiting to be received on the channel
+            case 0x1a:
+                if(network == nullptr)
+                    break;
+
+                if(!(network->get(a.value).has_value() || network->get(a.value).waiting_writers.load(std::memory_order_relaxed) > 0))
+                    skip();
+                return;
+            ///ifr, only executes the next instruction if a core is waiting to receive on the channel
+            case 0x1b:
+                if(network == nullptr)
+                    break;
+
+                if(network->get(a.value).waiting_readers.load(std::memory_order_relaxed) == 0)
+                    skip();
+                return;
+        }
+
+        state = dcpu_state::FAULTED;
+    }
+
+    void execute_basic(const predecoded_instruction& ins)
+    {
+        dcpu_operand a = fetch_operand<true>(ins.a);
+        dcpu_operand b = fetch_operand<false>(ins.b);
+
+        uint32_t av = a.value;
+        uint32_t bv = b.value;
+        int32_t as = (int16_t)a.value;
+        int32_t bs = (int16_t)b.value;
+
+        switch(ins.o)
+        {
+            case 0x01:
+                store(b, av);
+                return;
+            case 0x02:
+            {
+                uint32_t res = bv + av;
+                store(b, res);
+                ex = res > 0xffff ? 1 : 0;
+                return;
+            }
+            case 0x03:
+            {
+                uint32_t res = bv - av;
+                store(b, res);
+                ex = bv < av ? 0xffff : 0;
+                return;
+            }
+            case 0x04:
+            {
+                uint32_t res = bv * av;
+                store(b, res);
+                ex = res >> 16;
+                return;
+            }
+            case 0x05:
+            {
+                int32_t res = bs * as;
+                store(b, res);
+                ex = (uint32_t)res >> 16;
+                return;
+            }
+            case 0x06:
+                if(av == 0)
+                {
+                    store(b, 0);
+                    ex = 0;
+                    return;
+                }
+
+                store(b, bv / av);
+                ex = ((bv << 16) / av);
+                return;
+            case 0x07:
+                if(as == 0)
+                {
+                    store(b, 0);
+                    ex = 0;
+                    return;
+                }
+
+                ///in 64 bits, as -32768 / -1 overflows even 32. Both results wrap, to 0x8000 and 0
+                store(b, (int64_t)bs / as);
+                ex = (((int64_t)bs * 65536) / as);
+                return;
+            case 0x08:
+                store(b, av == 0 ? 0 : bv % av);
+                return;
+            case 0x09:
+                store(b, as == 0 ? 0 : bs % as);
+                return;
+            case 0x0a:
+                store(b, bv & av);
+                return;
+            case 0x0b:
+                store(b, bv | av);
+                return;
+            case 0x0c:
+                store(b, bv ^ av);
+                return;
+            case 0x0d:
+                store(b, av >= 32 ? 0 : bv >> av);
+                ex = av >= 32 ? 0 : ((bv << 16) >> av);
+                return;
+            case 0x0e:
+                store(b, av >= 32 ? (bs >> 31) : (bs >> av));
+                ex = av >= 32 ? 0 : (((uint32_t)bs << 16) >> av);
+                return;
+            case 0x0f:
+                store(b, av >= 32 ? 0 : bv << av);
+                ex = av >= 32 ? 0 : ((bv << av) >> 16);
+                return;
+            case 0x10:
+                if((bv & av) == 0)
+                    skip();
+                return;
+            case 0x11:
+                if((bv & av) != 0)
+                    skip();
+                return;
+            case 0x12:
+                if(bv != av)
+                    skip();
+                return;
+            case 0x13:
+                if(bv == av)
+                    skip();
+                return;
+            case 0x14:
+                if(!(bv > av))
+                    skip();
+                return;
+            case 0x15:
+                if(!(bs > as))
+                    skip();
+                return;
+            case 0x16:
+                if(!(bv < av))
+                    skip();
+                return;
+            case 0x17:
+                if(!(bs < as))
+                    skip();
+                return;
+            case 0x1a:
+            {
+                uint32_t res = bv + av + ex;
+                store(b, res);
+                ex = res > 0xffff ? 1 : 0;
+                return;
+            }
+            case 0x1b:
+            {
+                int32_t res = (int32_t)bv - (int32_t)av + (int32_t)ex;
+                store(b, res);
+                ex = res < 0 ? 0xffff : (res > 0xffff ? 1 : 0);
+                return;
+            }
+            ///snd b, a: sends a on channel b
+            case 0x1c:
+                if(network == nullptr)
+                    break;
+
+                channel_send(bv, av);
+                return;
+            ///rcv b, a: receives a value from channel a into b
+            case 0x1d:
+            {
+                if(network == nullptr)
+                    break;
+
+                uint16_t value = 0;
+
+                if(channel_receive(av, value))
+                    store(b, value);
+
+                return;
+            }
+            case 0x1e:
+                store(b, av);
+                regs[6]++;
+                regs[7]++;
+                return;
+            case 0x1f:
+                store(b, av);
+                regs[6]--;
+                regs[7]--;
+                return;
+        }
+
+        state = dcpu_state::FAULTED;
+    }
+
+    template<bool profiling>
+    void step_impl()
+    {
+        if(!interrupt_queueing && interrupt_queue.size() > 0)
+            dispatch_interrupt();
+
+        uint16_t start_pc = pc;
+        uint16_t start_sp = sp;
+        uint64_t start_cycles = cycles;
+
+        ///copied, as self modifying code may invalidate the cache entry while executing
+        predecoded_instruction ins = decode(pc);
+
+        pc++;
+        cycles += ins.cycles;
+        instructions++;
+
+        if(ins.o == 0)
+            execute_special(ins);
+        else
+            execute_basic(ins);
+
+        ///a stalled instruction does not retire, so undo the operand side effects and charge a single cycle
+        if(state == dcpu_state::BLOCKED)
+        {
+            pc = start_pc;
+            sp = start_sp;
+            cycles = start_cycles + 1;
+            stalled_cycles++;
+            instructions--;
+            return;
+        }
+
+        if constexpr(profiling)
+        {
+            profile->hits[start_pc]++;
+            profile->cycles[start_pc] += cycles - start_cycles;
+        }
+    }
+
+    void step()
+    {
+        if(state == dcpu_state::BLOCKED)
+            state = dcpu_state::RUNNING;
+
+        if(state != dcpu_state::RUNNING)
+            return;
+
+        if(profile)
+            step_impl<true>();
+        else
+            step_impl<false>();
+    }
+
+    ///runs until the cpu halts or faults, or max_cycles have elapsed in total
+    void run(uint64_t max_cycles)
+    {
+        if(profile)
+        {
+            while(state == dcpu_state::RUNNING && cycles < max_cycles)
+                step_impl<true>();
+        }
+        else
+        {
+            while(state == dcpu_state::RUNNING && cycles < max_cycles)
+                step_impl<false>();
+        }
+    }
+};
+
+#endif // EMULATOR_HPP_INCLUDED
@@ -0,0 +1,269 @@
+#ifndef FILE_CACHE_HPP_INCLUDED
+#define FILE_CACHE_HPP_INCLUDED
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <stdint.h>
+#include "base_asm.hpp"
+#include "platform.hpp"
+
+///one memory mapped file. Unmapped once nothing holds it, neither the cache nor an assembly which loaded it
+struct cached_file
+{
+    std::string path;
+    int64_t mtime = 0;
+    std::string_view text;
+    uint64_t last_used = 0;
+
+    cached_file() = default;
+    cached_file(const cached_file&) = delete;
+    cached_file& operator=(const cached_file&) = delete;
+
+    ~cached_file()
+    {
+        unmap_file(text);
+    }
+};
+
+///files for .include and .incbin, memory mapped once and shared by every assembly in the process
+///entries are keyed by path and checked against the file's modification time. A file which changes gets a new mapping
+///once the mapped files add up to more than max_bytes, the least recently used are dropped. Mappings are reference counted,
+///so assemblies which are still running, or whose errors point into a file, keep it mapped until they're done with it
+struct file_cache
+{
+    std::mutex mut;
+    std::map<std::string, std::shared_ptr<cached_file>, std::less<>> files;
+    uint64_t mappings = 0;
+    uint64_t mapped_bytes = 0;
+    uint64_t max_bytes = 256 * 1024 * 1024;
+    uint64_t uses = 0;
+
+    std::shared_ptr<const cached_file> get(std::string_view path)
+    {
+        std::string spath(path);
+
+        auto mtime_opt = file_modification_time(spath);
+
+        if(!mtime_opt.has_value())
+            return nullptr;
+
+        std::lock_guard guard(mut);
+
+        auto it = files.find(spath);
+
+        if(it != files.end() && it->second->mtime == mtime_opt.value())
+        {
+            it->second->last_used = ++uses;
+            return it->second;
+        }
+
+        auto mapped_opt = map_file(spath);
+
+        if(!mapped_opt.has_value())
+            return nullptr;
+
+        auto file = std::make_shared<cached_file>();
+        file->path = spath;
+        file->mtime = mtime_opt.value();
+        file->text = mapped_opt.value();
+        file->last_used = ++uses;
+
+        if(it != files.end())
+        {
+            mapped_bytes -= it->second->text.size();
+            it->second = file;
+        }
+        else
+        {
+            files[spath] = file;
+        }
+
+        mappings++;
+        mapped_bytes += file->text.size();
+
+        evict(file.get());
+
+        return file;
+    }
+
+    ///drops the least recently used files until the rest fit in max_bytes, never dropping keep
+    void evict(const cached_file* keep)
+    {
+        while(mapped_bytes > max_bytes)
+        {
+            auto oldest = files.end();
+
+            for(auto it = files.begin(); it != files.end(); it++)
+            {
+                if(it->second.get() != keep && (oldest == files.end() || it->second->last_used < oldest->second->last_used))
+                    oldest = it;
+            }
+
+            if(oldest == files.end())
+                return;
+
+            mapped_bytes -= oldest->second->text.size();
+            files.erase(oldest);
+        }
+    }
+};
+
+inline
+file_cache& get_shared_file_cache()
+{
+    static file_cache cache;
+
+    return cache;
+}
+
+inline
+bool is_absolute_path(std::string_view path)
+{
+    if(path.starts_with('/') || path.starts_with('\\'))
+        return true;
+
+    ///a windows drive
+    return path.size() >= 2 && path[1] == ':';
+}
+
+///everything up to and including the last separator, empty for a file in the current directory
+inline
+std::string_view directory_of(std::string_view path)
+{
+    size_t separator = path.find_last_of("/\\");
+
+    if(separator == std::string_view::npos)
+        return {};
+
+    return path.substr(0, separator + 1);
+}
+
+///collapses . and .. out of a relative path. nullopt if it climbs out of the directory it's relative to, or names a drive
+inline
+std::optional<std::string> normalise_relative_path(std::string_view path)
+{
+    std::vector<std::string_view> parts;
+
+    while(path.size() > 0)
+    {
+        size_t separator = path.find_first_of("/\\");
+        std::string_view part = path.substr(0, separator);
+
+        path.remove_prefix(separator == std::string_view::npos ? path.size() : separator + 1);
+
+        if(part.find(':') != std::string_view::npos)
+            return std::nullopt;
+
+        if(part.size() == 0 || part == ".")
+            continue;
+
+        if(part == "..")
+        {
+            if(parts.size() == 0)
+                return std::nullopt;
+
+            parts.pop_back();
+            continue;
+        }
+
+        parts.push_back(part);
+    }
+
+    std::string ret;
+
+    for(std::string_view part : parts)
+    {
+        if(ret.size() > 0)
+            ret += "/";
+
+        ret += part;
+    }
+
+    return ret;
+}
+
+///one assembly's access to the shared cache, through assembler_settings::load_file. Paths are relative to the file which includes them
+///everything loaded stays mapped until the loader is destroyed, so it has to outlive the assembly, and any error_info which came out of it
+struct file_loader
+{
+    file_cache* cache = &get_shared_file_cache();
+    ///what the source being assembled includes relative to, empty for the current directory
+    std::string base_directory;
+    ///when set, nothing outside this directory can be loaded. Absolute paths are refused, as are paths which climb out of it with ..
+    ///the source itself is taken to be at the top of it, and base_directory is ignored. Symbolic links inside it are still followed
+    std::optional<std::string> root;
+
+    std::mutex mut;
+    std::vector<std::shared_ptr<const cached_file>> pinned;
+
+    file_loader() = default;
+    file_loader(const file_loader&) = delete;
+    file_loader& operator=(const file_loader&) = delete;
+
+    void apply(assembler_settings& sett)
+    {
+        sett.load_file = load;
+        sett.load_file_user = this;
+    }
+
+    ///nullopt if the path is outside root
+    std::optional<std::string> resolve(std::string_view path, std::string_view includer) const
+    {
+        if(root.has_value())
+        {
+            std::string top = root.value();
+
+            if(top.size() > 0 && top.back() != '/' && top.back() != '\\')
+                top += "/";
+
+            if(is_absolute_path(path) || (includer.size() > 0 && !includer.starts_with(top)))
+                return std::nullopt;
+
+            if(includer.size() > 0)
+                includer.remove_prefix(top.size());
+
+            auto inside_opt = normalise_relative_path(std::string(directory_of(includer)) + std::string(path));
+
+            if(!inside_opt.has_value())
+                return std::nullopt;
+
+            return top + inside_opt.value();
+        }
+
+        if(is_absolute_path(path))
+            return std::string(path);
+
+        ///the source itself has no path of its own
+        if(includer.size() == 0)
+            return base_directory + std::string(path);
+
+        return std::string(directory_of(includer)) + std::string(path);
+    }
+
+    static std::optional<loaded_file> load(void* user, std::string_view path, std::string_view includer)
+    {
+        file_loader& loader = *(file_loader*)user;
+
+        auto resolved_opt = loader.resolve(path, includer);
+
+        if(!resolved_opt.has_value())
+            return std::nullopt;
+
+        auto file = loader.cache->get(resolved_opt.value());
+
+        if(file == nullptr)
+            return std::nullopt;
+
+        std::lock_guard guard(loader.mut);
+        loader.pinned.push_back(file);
+
+        return loaded_file{file->text, file->path};
+    }
+};
+
+#endif // FILE_CACHE_HPP_INCLUDED
@@ -0,0 +1,368 @@
+#ifndef LAYOUT_HPP_INCLUDED
+#define LAYOUT_HPP_INCLUDED
+
+#include <algorithm>
+#include <optional>
+#include <string_view>
+#include <vector>
+#include "util.hpp"
+#include "base_asm.hpp"
+
+///one line of a profile file, either
+///label count
+///0xpc count
+struct profile_entry
+{
+    std::string_view label;
+    std::optional<uint16_t> pc;
+    uint64_t count = 0;
+};
+
+///a label delimited run of source, the unit that profile guided layout moves around
+struct basic_block
+{
+    std::string_view text;
+    std::string_view label;
+    int first_line = 0;
+    int last_line = 0;
+    uint64_t count = 0;
+    ///execution can run off the end of this block into the next one
+    bool falls_through = true;
+    ///contains data, or otherwise must not move
+    bool pinned = false;
+};
+
+///lines starting with ; or # are comments. Returns the line number of the first malformed line on failure
+inline
+std::pair<std::vector<profile_entry>, std::optional<int>> parse_profile(std::string_view text)
+{
+    std::vector<profile_entry> ret;
+    int line = 0;
+
+    while(text.size() > 0)
+    {
+        size_t end = text.find('\n');
+        std::string_view current = text.substr(0, end);
+
+        text.remove_prefix(end == std::string_view::npos ? text.size() : end + 1);
+
+        auto name = consume_next(current, true);
+
+        if(name.size() == 0 || name.starts_with('#'))
+        {
+            line++;
+            continue;
+        }
+
+        auto count = consume_next(current, true);
+
+        if(!is_constant(count))
+            return {ret, line};
+
+        profile_entry entry;
+        entry.count = get_constant_of<uint64_t>(count);
+
+        if(is_constant(name))
+            entry.pc = get_constant_of<uint16_t>(name);
+        else
+            entry.label = name;
+
+        ret.push_back(entry);
+        line++;
+    }
+
+    return {ret, std::nullopt};
+}
+
+constexpr
+bool is_conditional_mnemonic(std::string_view in)
+{
+    for(std::string_view name : {"ifb", "ifc", "ife", "ifn", "ifg", "ifa", "ifl", "ifu", "ifw", "ifr"})
+    {
+        if(iequal(in, name))
+            return true;
+    }
+
+    return false;
+}
+
+///splits source into blocks at every top level label definition which starts a line
+///labels nested inside a .repeat or a .macro do not start a block, as they're scoped to it, and neither do labels inside a conditional
+///a block defining a macro or including a file is pinned, so that no use of the macro can move ahead of it
+inline
+std::vector<basic_block> split_basic_blocks(std::string_view text)
+{
+    std::vector<basic_block> blocks;
+
+    basic_block current;
+    current.text = text.substr(0, 0);
+
+    int repeat_depth = 0;
+    int condition_depth = 0;
+    bool in_macro = false;
+    bool last_was_conditional = false;
+    int line = 0;
+
+    std::string_view remaining = text;
+
+    while(remaining.size() > 0)
+    {
+        size_t end = remaining.find('\n');
+        size_t line_length = end == std::string_view::npos ? remaining.size() : end + 1;
+        std::string_view line_text = remaining.substr(0, line_length);
+
+        std::string_view tokens = line_text;
+        auto first = consume_next(tokens, true);
+
+        if(repeat_depth == 0 && condition_depth == 0 && !in_macro && is_label_definition(first))
+        {
+            if(current.text.size() > 0)
+                blocks.push_back(current);
+
+            std::string_view name = first;
+
+            if(name.starts_with(':'))
+                name.remove_prefix(1);
+            if(name.ends_with(':'))
+                name.remove_suffix(1);
+
+            current = basic_block();
+            current.text = line_text.substr(0, 0);
+            current.label = name;
+            current.first_line = line;
+
+            ///a conditional at the end of the last block can still skip this block's first instruction, so it's carried across the label
+            ///anything after the label on the same line belongs to the block
+            first = consume_next(tokens, true);
+        }
+
+        current.text = std::string_view(current.text.data(), line_text.data() + line_text.size() - current.text.data());
+        current.last_line = line;
+
+        if(iequal(first, ".macro") || iequal(first, "macro"))
+        {
+            in_macro = true;
+            current.pinned = true;
+        }
+
+        if(in_macro)
+        {
+            if(iequal(first, ".endmacro") || iequal(first, "endmacro"))
+                in_macro = false;
+
+            remaining.remove_prefix(line_length);
+            line++;
+            continue;
+        }
+
+        if(iequal(first, ".repeat") || iequal(first, "repeat"))
+            repeat_depth++;
+
+        if(iequal(first, ".end") || iequal(first, "end"))
+            repeat_depth--;
+
+        conditional_directive::type directive = get_conditional_directive(first);
+
+        ///which branch is assembled depends on what has been defined before it, so the whole conditional stays in one pinned block
+        if(opens_conditional(directive))
+        {
+            condition_depth++;
+            current.pinned = true;
+        }
+
+        ///either branch could be the one assembled, so a jump inside one can't be relied on to end the block
+        if(directive == conditional_directive::ENDIF)
+        {
+            condition_depth--;
+            current.falls_through = true;
+            last_was_conditional = false;
+        }
+
+        if(iequal(first, ".dat") || iequal(first, "dat") || iequal(first, ".incbin") || iequal(first, "incbin"))
+            current.pinned = true;
+
+        if(iequal(first, ".fill") || iequal(first, "fill") || iequal(first, ".reserve") || iequal(first, "reserve"))
+            current.pinned = true;
+
+        bool is_string_data = iequal(first, "asciz") || iequal(first, "pstring") || iequal(first, "packed") || iequal(first, "packedz");
+
+        if(is_string_data || iequal(first, ".asciz") || iequal(first, ".pstring") || iequal(first, ".packed") || iequal(first, ".packedz"))
+            current.pinned = true;
+
+        ///an included file may define macros or data, and everything after an .org or .align depends on where it is
+        if(iequal(first, ".include") || iequal(first, "include") || iequal(first, ".org") || iequal(first, "org") || iequal(first, ".align") || iequal(first, "align"))
+            current.pinned = true;
+
+        bool is_data = iequal(first, "dat") || iequal(first, "fill") || iequal(first, "reserve") || iequal(first, "align") || is_string_data;
+
+        if(first.size() > 0 && !first.starts_with('.') && !is_data && directive == conditional_directive::NONE && !iequal(first, "def") && !iequal(first, "export"))
+        {
+            bool unconditional_jump = false;
+
+            if(iequal(first, "set") || iequal(first, "mov"))
+            {
+                auto target = consume_next(tokens, false);
+
+                unconditional_jump = iequal(target, "pc");
+            }
+
+            if(iequal(first, "rfi") || iequal(first, "brk"))
+                unconditional_jump = true;
+
+            current.falls_through = condition_depth > 0 || !(unconditional_jump && !last_was_conditional);
+            last_was_conditional = is_conditional_mnemonic(first);
+        }
+
+        remaining.remove_prefix(line_length);
+        line++;
+    }
+
+    if(current.text.size() > 0)
+        blocks.push_back(current);
+
+    return blocks;
+}
+
+///reorders blocks so that hot code is contiguous and towards the start of the image, where jumps to it can use short literals
+///blocks which fall through into the next stay glued together as a chain, so no jumps need to be inserted
+///the entry block, pinned blocks, and a final chain which runs off the end of the program act as barriers which nothing moves across
+inline
+std::vector<std::string_view> profile_guided_block_order(std::vector<basic_block> blocks)
+{
+    struct chain
+    {
+        size_t first = 0;
+        size_t last = 0;
+        uint64_t count = 0;
+        bool pinned = false;
+    };
+
+    std::vector<chain> chains;
+
+    for(size_t i=0; i < blocks.size(); i++)
+    {
+        if(chains.size() == 0 || !blocks[chains.back().last].falls_through)
+        {
+            chain c;
+            c.first = i;
+            c.last = i;
+            chains.push_back(c);
+        }
+
+        chain& c = chains.back();
+        c.last = i;
+        c.count = std::max(c.count, blocks[i].count);
+        c.pinned = c.pinned || blocks[i].pinned;
+    }
+
+    if(chains.size() > 0)
+    {
+        chains.front().pinned = true;
+
+        if(blocks[chains.back().last].falls_through)
+            chains.back().pinned = true;
+    }
+
+    std::vector<std::string_view> order;
+
+    auto emit = [&](const chain& c)
+    {
+        for(size_t i=c.first; i <= c.last; i++)
+        {
+            order.push_back(blocks[i].text);
+        }
+    };
+
+    size_t region_start = 0;
+
+    for(size_t i=0; i <= chains.size(); i++)
+    {
+        if(i != chains.size() && !chains[i].pinned)
+            continue;
+
+        std::stable_sort(chains.begin() + region_start, chains.begin() + i, [](const chain& c1, const chain& c2)
+        {
+            return c1.count > c2.count;
+        });
+
+        for(size_t j=region_start; j < i; j++)
+        {
+            emit(chains[j]);
+        }
+
+        if(i != chains.size())
+            emit(chains[i]);
+
+        region_start = i + 1;
+    }
+
+    return order;
+}
+
+///assembles text with its basic blocks reordered according to an execution profile
+///pc based profile entries refer to the addresses produced by assembling text unmodified with the same settings
+///blocks aren't moved between sections, so text with more than one section is assembled unmodified
+inline
+std::pair<std::optional<return_info>, error_info> assemble_with_profile(std::string_view text, const std::vector<profile_entry>& profile, assembler_settings sett = assembler_settings())
+{
+    if(split_sections(text).size() > 1)
+        return assemble(text, sett);
+
+    std::vector<basic_block> blocks = split_basic_blocks(text);
+
+    bool has_pc_entries = false;
+
+    for(const profile_entry& entry : profile)
+    {
+        if(entry.pc.has_value())
+        {
+            has_pc_entries = true;
+            continue;
+        }
+
+        for(basic_block& block : blocks)
+        {
+            if(block.label == entry.label)
+                block.count = std::max(block.count, entry.count);
+        }
+    }
+
+    if(has_pc_entries)
+    {
+        auto [baseline_opt, err] = assemble(text, sett);
+
+        if(!baseline_opt.has_value())
+            return {std::nullopt, err};
+
+        const return_info& baseline = baseline_opt.value();
+
+        for(const profile_entry& entry : profile)
+        {
+            if(!entry.pc.has_value())
+                continue;
+
+            ///assembled images are relocated to sett.location
+            size_t pc = entry.pc.value();
+
+            if(pc < sett.location || pc >= baseline.mem.size() || baseline.file_of(pc) != 0)
+                continue;
+
+            int line = baseline.pc_to_source_line[pc];
+
+            for(basic_block& block : blocks)
+            {
+                if(line >= block.first_line && line <= block.last_line)
+                {
+                    block.count = std::max(block.count, entry.count);
+                    break;
+                }
+            }
+        }
+    }
+
+    std::vector<std::string_view> order = profile_guided_block_order(blocks);
+
+    return assemble_blocks(text, order, sett);
+}
+
+#endif // LAYOUT_HPP_INCLUDED
@@ -0,0 +1,667 @@
+#ifndef LINK_HPP_INCLUDED
+#define LINK_HPP_INCLUDED
+
+#include <initializer_list>
+#include <optional>
+#include <stdio.h>
+#include <span>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "util.hpp"
+#include "base_asm.hpp"
+#include "layout.hpp"
+
+///one source file, which gets its own label scope. Only .export'd labels are visible to other units
+struct link_unit
+{
+    std::string_view name;
+    std::string_view text;
+};
+
+///one line of a layout spec
+///name [start [end]]
+///sections are placed in the order given, each directly after the previous one unless it has a start address. end is exclusive
+struct section_placement
+{
+    std::string_view name;
+    std::optional<uint16_t> start;
+    std::optional<uint32_t> end;
+};
+
+///lines starting with ; or # are comments. Returns the line number of the first malformed line on failure
+inline
+std::pair<std::vector<section_placement>, std::optional<int>> parse_link_layout(std::string_view text)
+{
+    std::vector<section_placement> ret;
+    int line = 0;
+
+    while(text.size() > 0)
+    {
+        size_t end = text.find('\n');
+        std::string_view current = text.substr(0, end);
+
+        text.remove_prefix(end == std::string_view::npos ? text.size() : end + 1);
+
+        auto name = consume_next(current, true);
+
+        if(name.size() == 0 || name.starts_with('#'))
+        {
+            line++;
+            continue;
+        }
+
+        section_placement placement;
+        placement.name = name;
+
+        auto start = consume_next(current, true);
+        auto fin = consume_next(current, true);
+
+        if(start.size() > 0)
+        {
+            if(!is_constant(start))
+                return {ret, line};
+
+            placement.start = get_constant_of<uint16_t>(start);
+        }
+
+        if(fin.size() > 0)
+        {
+            if(!is_constant(fin))
+                return {ret, line};
+
+            placement.end = get_constant_of<uint32_t>(fin);
+        }
+
+        ret.push_back(placement);
+        line++;
+    }
+
+    return {ret, std::nullopt};
+}
+
+struct unit_scope
+{
+    uint32_t id = 0;
+    std::vector<std::string_view> exports;
+};
+
+///places the sections of every unit according to layout. Each section holds the contributions of every unit, in unit order
+///sections missing from the layout follow the last one, in the order they first appear
+///sections are assembled in address order, so this is a single pass over the text of every unit
+///file n + 1 of the result is units[n], and source_line_to_pc is not filled in
+///links into rinfo, which must be freshly constructed, so that callers can keep the result off the stack. On failure it holds nothing useful
+inline
+std::optional<error_info> link(return_info& rinfo, std::span<const link_unit> units, std::span<const section_placement> layout, assembler_settings sett = assembler_settings())
+{
+    trace_scope trace("link", "assembler");
+
+    symbol_table sym;
+
+    #ifndef DCPU16_ASM_NO_STATS
+    if(sett.collect_stats)
+    {
+        rinfo.stats = assembly_stats();
+        sym.stats = &rinfo.stats.value();
+    }
+    #endif
+
+    for(auto [absolute_value, name] : sett.provided_symbol_definitions)
+    {
+        define d;
+        d.name = name;
+        d.value = absolute_value;
+
+        sym.defines.push_back(d);
+    }
+
+    std::vector<std::vector<section_view>> unit_sections;
+    std::vector<std::vector<uint32_t>> unit_line_starts;
+    std::vector<unit_scope> unit_scopes;
+
+    std::vector<section_placement> order(layout.begin(), layout.end());
+
+    opcode_adder_data<> adder("", rinfo.mem, rinfo.translation_map, rinfo.pc_to_source_line, rinfo.source_line_to_pc);
+
+    ///as for assemble, the image starts as if with a .org. Placements can't go before it
+    adder.org(sett.location);
+
+    for(const link_unit& unit : units)
+    {
+        unit_sections.push_back(split_sections(unit.text));
+        unit_line_starts.push_back(opcode_adder_data<>::find_line_starts(unit.text));
+        unit_scopes.push_back({adder.next_scope_id++, {}});
+
+        adder.files.push_back(unit.name);
+
+        for(const section_view& view : unit_sections.back())
+        {
+            bool known = false;
+
+            for(const section_placement& placement : order)
+            {
+                known = known || placement.name == view.name;
+            }
+
+            if(!known)
+                order.push_back({view.name, std::nullopt, std::nullopt});
+        }
+    }
+
+    {
+        stats_timer timer(sym.stats, &assembly_stats::encode_ns);
+        trace_scope trace("main pass", "phase");
+
+        for(const section_placement& placement : order)
+        {
+            if(placement.start.has_value())
+            {
+                if(placement.start.value() < rinfo.mem.size())
+                {
+                    error_info err;
+                    err.msg = "Section overlaps the one before it";
+                    err.name_in_source = placement.name;
+                    return err;
+                }
+
+                ///return_info::segments can only hold so many, as with .org
+                if(adder.segments.size() >= MAX_SEGMENTS)
+                {
+                    error_info err;
+                    err.msg = "Too many segments";
+                    err.name_in_source = placement.name;
+                    return err;
+                }
+
+                adder.org(placement.start.value());
+            }
+
+            section_info info;
+            info.name = std::string(placement.name);
+            info.address = rinfo.mem.size();
+
+            for(size_t i=0; i < units.size(); i++)
+            {
+                for(const section_view& view : unit_sections[i])
+                {
+                    if(view.name != placement.name)
+                        continue;
+
+                    size_t exports_before = sym.exports.size();
+
+                    adder.scope = {unit_scopes[i].id};
+
+                    auto error_opt = adder.assemble_part(sym, i + 1, units[i].text, unit_line_starts[i], view.text, sett);
+
+                    if(error_opt.has_value())
+                        return error_opt.value();
+
+                    for(size_t e = exports_before; e < sym.exports.size(); e++)
+                    {
+                        unit_scopes[i].exports.push_back(sym.exports[e]);
+                    }
+                }
+            }
+
+            if(rinfo.mem.overflowed())
+            {
+                error_info err;
+                err.msg = "Program does not fit in memory";
+                err.name_in_source = placement.name;
+                return err;
+            }
+
+            info.size = rinfo.mem.size() - info.address;
+
+            if(placement.end.has_value() && info.address + info.size > placement.end.value())
+            {
+                error_info err;
+                err.msg = "Section does not fit in its range";
+                err.name_in_source = placement.name;
+                return err;
+            }
+
+            rinfo.sections.push_back(info);
+        }
+    }
+
+    if(adder.condition_depth != 0)
+    {
+        error_info err;
+        err.msg = "No .endif";
+        return err;
+    }
+
+    adder.close_segment();
+    adder.flush_fixups(sym);
+
+    if(sett.progress != nullptr)
+    {
+        uint64_t total = 0;
+
+        for(const link_unit& unit : units)
+        {
+            total += unit.text.size();
+        }
+
+        sett.progress(sett.progress_user, total, rinfo.mem.size());
+    }
+
+    for(const segment& seg : adder.segments)
+    {
+        if(seg.size > 0)
+            rinfo.segments.push_back(seg);
+    }
+
+    for(std::string_view path : adder.files)
+    {
+        rinfo.files.push_back(std::string(path));
+    }
+
+    rinfo.file_ranges = adder.file_ranges;
+
+    ///only what a unit exports is visible outside of it, so these are resolved against its own scope
+    std::vector<std::pair<uint16_t, std::string>> exported;
+
+    for(const unit_scope& unit : unit_scopes)
+    {
+        std::array<uint32_t, 1> scope{unit.id};
+
+        for(std::string_view name : unit.exports)
+        {
+            auto val_opt = sym.get_symbol_definition(name, scope);
+
+            if(val_opt.has_value())
+                exported.push_back({val_opt.value(), std::string(name)});
+        }
+    }
+
+    std::vector<delayed_expression> unresolved;
+
+    DCPU16_ASM_STAT(sym.stats, delayed_expressions, sym.expressions.size());
+
+    {
+        stats_timer timer(sym.stats, &assembly_stats::fixup_ns);
+        trace_scope trace("delayed expressions", "phase");
+
+        for(const delayed_expression& delayed : sym.expressions)
+        {
+            auto patch_result = resolve_delayed_expression(rinfo.mem, sym, delayed, true, unresolved);
+
+            if(patch_result.has_value())
+            {
+                error_info err;
+                err.line = rinfo.pc_to_source_line[delayed.base_word];
+                err.file = adder.files[rinfo.file_of(delayed.base_word)];
+                err.name_in_source = delayed.expression;
+                err.msg = patch_result.value();
+                return err;
+            }
+        }
+
+        auto err_opt = resolve_delayed_expressions(rinfo.mem, exported, unresolved);
+
+        if(err_opt.has_value())
+            return err_opt.value();
+    }
+
+    rinfo.exported_label_names = std::move(exported);
+
+    ///every unit's labels sit inside that unit's scope
+    if(sett.collect_symbols)
+        rinfo.symbols = make_symbol_index(sym, 1);
+
+    return std::nullopt;
+}
+
+inline
+std::pair<std::optional<return_info>, error_info> link(std::span<const link_unit> units, std::span<const section_placement> layout, assembler_settings sett = assembler_settings())
+{
+    return_info rinfo;
+
+    auto err_opt = link(rinfo, units, layout, sett);
+
+    if(err_opt.has_value())
+        return {std::nullopt, err_opt.value()};
+
+    return {std::move(rinfo), error_info()};
+}
+
+///calls on_definition for every label, .def and .macro that text defines, on_export for every .export, and on_reference for every identifier it uses
+///identifiers are matched anywhere outside of comments and strings, so this overestimates what is referenced, which is safe for stripping
+template<typename D, typename E, typename R>
+inline
+void for_each_symbol(std::string_view text, D&& on_definition, E&& on_export, R&& on_reference)
+{
+    bool defines_next = false;
+    bool exports_next = false;
+
+    while(text.size() > 0)
+    {
+        size_t end = text.find('\n');
+        std::string_view line = text.substr(0, end);
+
+        text.remove_prefix(end == std::string_view::npos ? text.size() : end + 1);
+
+        defines_next = false;
+        exports_next = false;
+
+        for(auto token = consume_next(line, true); token.size() > 0; token = consume_next(line, true))
+        {
+            if(defines_next || exports_next)
+            {
+                if(defines_next)
+                    on_definition(token);
+                else
+                    on_export(token);
+
+                defines_next = false;
+                exports_next = false;
+                continue;
+            }
+
+            if(is_label_definition(token))
+            {
+                if(token.starts_with(':'))
+                    token.remove_prefix(1);
+                if(token.ends_with(':'))
+                    token.remove_suffix(1);
+
+                on_definition(token);
+                continue;
+            }
+
+            if(iequal(token, ".def") || iequal(token, "def") || iequal(token, ".macro") || iequal(token, "macro"))
+            {
+                defines_next = true;
+                continue;
+            }
+
+            if(iequal(token, ".export") || iequal(token, "export"))
+            {
+                exports_next = true;
+                continue;
+            }
+
+            if(is_string(token))
+                continue;
+
+            size_t i = 0;
+
+            while(i < token.size())
+            {
+                if(!isalnum_c(token[i]))
+                {
+                    i++;
+                    continue;
+                }
+
+                size_t start = i;
+
+                while(i < token.size() && isalnum_c(token[i]))
+                    i++;
+
+                on_reference(token.substr(start, i - start));
+            }
+        }
+    }
+}
+
+///whether any line of text is a statement using one of directives, written with or without its dot. Labels before it are skipped
+///only the start of each line is looked at, as split_sections does, so the names in comments, strings and labels don't count
+inline
+bool uses_directive(std::string_view text, std::initializer_list<std::string_view> directives)
+{
+    while(text.size() > 0)
+    {
+        size_t end = text.find('\n');
+        std::string_view line = text.substr(0, end);
+
+        text.remove_prefix(end == std::string_view::npos ? text.size() : end + 1);
+
+        auto first = consume_next(line, true);
+
+        while(is_label_definition(first))
+            first = consume_next(line, true);
+
+        if(first.starts_with('.'))
+            first.remove_prefix(1);
+
+        for(std::string_view directive : directives)
+        {
+            if(iequal(first, directive))
+                return true;
+        }
+    }
+
+    return false;
+}
+
+///a copy of every unit, with the label delimited blocks that nothing can reach blanked out
+///newlines are kept, so that positions and line numbers within the copies are the same as in the originals
+///roots are the start of the first unit, which is the entry point, blocks without a label, blocks containing an .export or .org,
+///and every block of a unit which .include's a file, as what the file references isn't known
+inline
+std::vector<std::string> strip_unreachable_blocks(std::span<const link_unit> units)
+{
+    struct gc_block
+    {
+        size_t unit = 0;
+        std::string_view text;
+        bool falls_through = true;
+        ///the next block of the same section view, or -1
+        int64_t next = -1;
+        bool reachable = false;
+        std::vector<std::string_view> references;
+        std::vector<std::string_view> exports;
+    };
+
+    std::vector<gc_block> blocks;
+    std::vector<std::unordered_map<std::string_view, size_t>> definitions(units.size());
+    std::unordered_map<std::string_view, size_t> exported;
+    std::vector<size_t> work;
+    bool entry = true;
+
+    auto mark = [&](size_t idx)
+    {
+        if(blocks[idx].reachable)
+            return;
+
+        blocks[idx].reachable = true;
+        work.push_back(idx);
+    };
+
+    for(size_t unit=0; unit < units.size(); unit++)
+    {
+        bool includes = uses_directive(units[unit].text, {"include"});
+
+        for(const section_view& view : split_sections(units[unit].text))
+        {
+            std::vector<basic_block> basic = split_basic_blocks(view.text);
+
+            for(size_t i=0; i < basic.size(); i++)
+            {
+                size_t idx = blocks.size();
+
+                gc_block& block = blocks.emplace_back();
+                block.unit = unit;
+                block.text = basic[i].text;
+                block.falls_through = basic[i].falls_through;
+                block.next = i + 1 < basic.size() ? (int64_t)idx + 1 : -1;
+
+                ///the .section line which starts a view is a block of its own when a label follows it, and holds nothing
+                std::string_view rest = block.text;
+                auto directive = consume_next(rest, true);
+
+                if((iequal(directive, ".section") || iequal(directive, "section")) && (consume_next(rest, true), consume_next(rest, true).size() == 0))
+                {
+                    block.reachable = true;
+                    block.falls_through = false;
+                    continue;
+                }
+
+                bool has_org = uses_directive(block.text, {"org", "align"});
+
+                for_each_symbol(block.text,
+                    [&](std::string_view name){definitions[unit].try_emplace(name, idx);},
+                    [&](std::string_view name){block.exports.push_back(name);},
+                    [&](std::string_view name){block.references.push_back(name);});
+
+                bool root = entry || basic[i].label.size() == 0 || block.exports.size() > 0 || has_org || includes;
+
+                entry = false;
+
+                if(root)
+                    mark(idx);
+            }
+        }
+    }
+
+    for(const gc_block& block : blocks)
+    {
+        for(std::string_view name : block.exports)
+        {
+            auto it = definitions[block.unit].find(name);
+
+            if(it != definitions[block.unit].end())
+                exported.try_emplace(name, it->second);
+        }
+    }
+
+    while(work.size() > 0)
+    {
+        size_t idx = work.back();
+        work.pop_back();
+
+        const gc_block& block = blocks[idx];
+
+        if(block.falls_through && block.next != -1)
+            mark(block.next);
+
+        for(std::string_view name : block.references)
+        {
+            auto local = definitions[block.unit].find(name);
+
+            if(local != definitions[block.unit].end())
+            {
+                mark(local->second);
+                continue;
+            }
+
+            auto global = exported.find(name);
+
+            if(global != exported.end())
+                mark(global->second);
+        }
+
+        for(std::string_view name : block.exports)
+        {
+            auto it = definitions[block.unit].find(name);
+
+            if(it != definitions[block.unit].end())
+                mark(it->second);
+        }
+    }
+
+    std::vector<std::string> ret;
+
+    for(const link_unit& unit : units)
+    {
+        ret.push_back(std::string(unit.text));
+    }
+
+    for(const gc_block& block : blocks)
+    {
+        if(block.reachable)
+            continue;
+
+        size_t start = block.text.data() - units[block.unit].text.data();
+
+        for(size_t i=start; i < start + block.text.size(); i++)
+        {
+            if(ret[block.unit][i] != '\n')
+                ret[block.unit][i] = ' ';
+        }
+    }
+
+    return ret;
+}
+
+///the number of words each file contributed
+inline
+std::vector<uint32_t> words_per_file(const return_info& rinfo)
+{
+    std::vector<uint32_t> ret(std::max(rinfo.files.size(), (size_t)1));
+
+    for(const segment& seg : rinfo.segments)
+    {
+        for(size_t pc=seg.address; pc < seg.address + seg.size; pc++)
+        {
+            ret[rinfo.file_of(pc)]++;
+        }
+    }
+
+    return ret;
+}
+
+///links units with every block that can't be reached from an entry point or an .export stripped out
+///return_info::removed_words holds how many words were stripped from each unit
+inline
+std::pair<std::optional<return_info>, error_info> link_gc(std::span<const link_unit> units, std::span<const section_placement> layout, assembler_settings sett = assembler_settings())
+{
+    trace_scope trace("gc", "linker");
+
+    auto [full_opt, full_err] = link(units, layout, sett);
+
+    if(!full_opt.has_value())
+        return {std::nullopt, full_err};
+
+    std::vector<std::string> stripped = strip_unreachable_blocks(units);
+    std::vector<link_unit> stripped_units;
+
+    for(size_t i=0; i < units.size(); i++)
+    {
+        stripped_units.push_back({units[i].name, stripped[i]});
+    }
+
+    auto [rinfo_opt, err] = link(stripped_units, layout, sett);
+
+    if(!rinfo_opt.has_value())
+    {
+        ///the stripped copies are about to be freed, but are identical to the originals wherever there's anything to point at
+        for(size_t i=0; i < units.size(); i++)
+        {
+            const char* start = stripped[i].data();
+
+            if(err.name_in_source.data() >= start && err.name_in_source.data() < start + stripped[i].size())
+                err.name_in_source = units[i].text.substr(err.name_in_source.data() - start, err.name_in_source.size());
+        }
+
+        return {std::nullopt, err};
+    }
+
+    return_info& rinfo = rinfo_opt.value();
+
+    std::vector<uint32_t> before = words_per_file(full_opt.value());
+    std::vector<uint32_t> after = words_per_file(rinfo);
+
+    for(size_t i=0; i < units.size(); i++)
+    {
+        rinfo.removed_words.push_back(before[i + 1] - after[i + 1]);
+    }
+
+    return {std::move(rinfo_opt), error_info()};
+}
+
+inline
+void print_section_map(FILE* out, const return_info& rinfo)
+{
+    fprintf(out, "%-16s %8s %8s\n", "section", "address", "words");
+
+    for(const section_info& info : rinfo.sections)
+    {
+        fprintf(out, "%-16s   0x%04x %8u\n", info.name.c_str(), info.address, info.size);
+    }
+}
+
+#endif // LINK_HPP_INCLUDED
@@ -1,88 +1,1517 @@
 #include "util.hpp"
 #include "base_asm.hpp"
+#include "emulator.hpp"
+#include "profiler.hpp"
+#include "multicore.hpp"
+#include "layout.hpp"
+#include "assemble_ct.hpp"
+#include "file_cache.hpp"
+#include "link.hpp"
+#include "server.hpp"
+#include "parallel_asm.hpp"
+#include "batch_io.hpp"
+#include "allocation_counter.hpp"
+#include "platform.hpp"
+#include "dcpu16asm.h"
 #include <string>
+#include <string.h>
+#include <memory>
+#include <filesystem>
 #include <assert.h>
 
+///empty if the file can't be read
 inline
 std::string read_file(const std::string& file)
 {
-    FILE* f = fopen(file.c_str(), "r");
+    return read_whole_file(file).value_or("");
+}
+
+inline
+void write_all_bin(const std::string& fname, std::string_view str)
+{
+    if(!write_whole_file(fname, str))
+        printf("Could not write %s\n", fname.c_str());
+}
+
+///every segment as its address and length in words, followed by its words. Gaps left by .org aren't written
+///segments are split, so that lengths always fit in a word
+inline
+std::string sparse_image(const return_info& rinfo)
+{
+    std::string ret;
+
+    auto append = [&](const void* data, size_t words)
+    {
+        ret.append((const char*)data, words * sizeof(uint16_t));
+    };
+
+    for(const segment& seg : rinfo.segments)
+    {
+        std::span<const uint16_t> words = rinfo.segment_words(seg);
+
+        for(size_t start = 0; start < words.size(); start += 0x8000)
+        {
+            uint16_t header[2] = {(uint16_t)(seg.address + start), (uint16_t)std::min(words.size() - start, (size_t)0x8000)};
+
+            append(header, 2);
+            append(words.data() + start, header[1]);
+        }
+    }
+
+    return ret;
+}
+
+void print_sv(std::string_view in)
+{
+    for(auto i : in)
+    {
+        putchar(i);
+    }
+
+    printf("\n");
+}
+
+void tests()
+{
+    {
+        std::string_view view = "SET X, 10\nSET Y, 1\nADD X, Y";
+
+        while(view.size() > 0)
+        {
+            auto found = consume_next(view, true);
+
+            printf("TOK ");
+
+            for(auto& i : found)
+                printf("%c", i);
+
+            printf("\n");
+        }
+
+        constexpr std::string_view test(" hi");
+
+        static_assert(trim_start(test, [](char c){return c == ' ';}) == "hi");
+    }
+
+    {
+        ///whatever doesn't fit is dropped, and the size never describes more than is stored
+        auto vec = std::make_unique<stack_vector<uint16_t, 4>>();
+
+        vec->append_fill(3, 1);
+        vec->push_back(2);
+
+        assert(!vec->overflowed());
+
+        vec->push_back(3);
+        vec->append_fill(2, 4);
+        vec->append_chars("ab");
+
+        assert(vec->overflowed());
+        assert(vec->size() == 4);
+        assert(vec->end() - vec->begin() == 4);
+        assert(vec->back() == 2);
+        assert(vec->as_span().size() == 4);
+
+        vec->clear();
+
+        assert(!vec->overflowed());
+        assert(vec->size() == 0);
+    }
+
+    {
+        std::string_view test = "SET X, 65539";
+        auto [binary_opt, err] = assemble(test);
+
+        assert(!binary_opt.has_value());
+
+        ///the largest and smallest constants a word can hold still assemble
+        assert(assemble("SET X, 65535").first.has_value());
+        assert(assemble("SET X, -32768").first.has_value());
+        assert(!assemble("SET X, -32769").first.has_value());
+        assert(!assemble("SET 0x10000, X").first.has_value());
+    }
+
+    {
+        std::string_view test = "SET X, [hello]\n:hello\nSET Y, 53\nSET Z, hello";
+        auto [binary_opt, err] = assemble(test);
+
+        assert(binary_opt.has_value());
+
+        auto [missing_comma_opt, missing_comma_err] = assemble("SET Z hello\n:hello");
+
+        assert(!missing_comma_opt.has_value());
+        assert(missing_comma_err.msg == "Expected ,");
+    }
+
+    {
+        std::string_view test = "SET A, 0\nSET I, 10\n:loop\nADD A, I\nSUB I, 1\nIFN I, 0\nSET PC, loop\nBRK";
+        auto [binary_opt, err] = assemble(test);
+
+        assert(binary_opt.has_value());
+
+        std::unique_ptr<dcpu> cpu = std::make_unique<dcpu>();
+        std::unique_ptr<execution_profile> prof = std::make_unique<execution_profile>();
+
+        cpu->profile = prof.get();
+        cpu->load(binary_opt.value());
+        cpu->run(1000);
+
+        assert(cpu->state == dcpu_state::HALTED);
+        assert(cpu->regs[0] == 55);
+        assert(prof->hits[2] == 10);
+
+        auto lines = profile_source_lines(test, binary_opt.value(), *prof);
+
+        assert(lines[3].hits == 10);
+        assert(lines[3].cycles == 20);
+    }
+
+    {
+        ///overwrites the ADD with a SUB after it has been executed once
+        std::string_view test = "SET B, 2\n:modify\nADD A, B\nIFE A, 0\nBRK\nSET [modify], 0x0403\nSET PC, modify";
+        auto [binary_opt, err] = assemble(test);
+
+        assert(binary_opt.has_value());
+
+        std::unique_ptr<dcpu> cpu = std::make_unique<dcpu>();
+        cpu->load(binary_opt.value());
+        cpu->run(1000);
+
+        assert(cpu->state == dcpu_state::HALTED);
+        assert(cpu->regs[0] == 0);
+    }
+
+    {
+        ///the one signed division which overflows, alongside ordinary ones
+        std::string_view test = "SET A, 0x8000\nDVI A, 0xffff\nSET B, -7\nDVI B, 2\nSET C, 7\nDVI C, -2\nSET X, 0x8000\nMDI X, 0xffff\nBRK";
+        auto [binary_opt, err] = assemble(test);
+
+        assert(binary_opt.has_value());
+
+        std::unique_ptr<dcpu> cpu = std::make_unique<dcpu>();
+        cpu->load(binary_opt.value());
+        cpu->run(1000);
+
+        assert(cpu->state == dcpu_state::HALTED);
+        assert(cpu->regs[0] == 0x8000);
+        assert(cpu->regs[1] == (uint16_t)-3);
+        assert(cpu->regs[2] == (uint16_t)-3);
+        assert(cpu->ex == 0x8000);
+        assert(cpu->regs[3] == 0);
+    }
+
+    {
+        ///core 0 produces 10..1 then 0 on channel 0, core 1 sums them until it sees the 0
+        std::string_view test = "IFE A, 0\nSET PC, producer\n:consumer\nRCV X, 0\nIFE X, 0\nBRK\nADD Y, X\nSET PC, consumer\n"
+                                ":producer\nSET I, 10\n:send_loop\nSND 0, I\nSUB I, 1\nIFN I, 0\nSET PC, send_loop\nSND 0, 0\nBRK";
+        auto [binary_opt, err] = assemble(test);
+
+        assert(binary_opt.has_value());
+
+        for(bool lockstep : {true, false})
+        {
+            multicore_settings msett;
+            msett.lockstep = lockstep;
+
+            multicore_result res = run_multicore(binary_opt.value(), msett);
+
+            assert(!res.deadlocked);
+            assert(res.cores[0].state == dcpu_state::HALTED);
+            assert(res.cores[1].state == dcpu_state::HALTED);
+            assert(res.channels[0].sends == 11);
+            assert(res.channels[0].receives == 11);
+        }
+    }
+
+    {
+        std::string_view test = "RCV X, 1\nBRK";
+        auto [binary_opt, err] = assemble(test);
+
+        assert(binary_opt.has_value());
+
+        multicore_result res = run_multicore(binary_opt.value(), multicore_settings());
+
+        assert(res.deadlocked);
+    }
+
+    {
+        std::string_view test = "SET I, 100\nIFE I, 0\nSET PC, cold\nSET PC, loop\n:cold\n.repeat 30\nADD B, 1\n.end\nSET PC, done\n"
+                                ":loop\nADD A, I\nSUB I, 1\nIFN I, 0\nSET PC, loop\nSET PC, done\n:done\nBRK";
+
+        auto [profile, bad_line] = parse_profile("loop 100\n# comment\ncold 1\ndone 1\n");
+
+        assert(!bad_line.has_value());
+        assert(profile.size() == 3);
+
+        auto [plain_opt, plain_err] = assemble(test);
+        auto [laid_out_opt, laid_out_err] = assemble_with_profile(test, profile);
+
+        assert(plain_opt.has_value());
+        assert(laid_out_opt.has_value());
+
+        ///the hot loop now sits below address 31, so its backwards jump is a short literal
+        assert(laid_out_opt.value().mem.size() == plain_opt.value().mem.size() - 1);
+        assert(laid_out_opt.value().pc_to_source_line[7] == 10);
+        assert(laid_out_opt.value().source_line_to_pc[10] == 7);
+
+        for(const return_info* rinfo : {&plain_opt.value(), &laid_out_opt.value()})
+        {
+            std::unique_ptr<dcpu> cpu = std::make_unique<dcpu>();
+            cpu->load(*rinfo);
+            cpu->run(100000);
+
+            assert(cpu->state == dcpu_state::HALTED);
+            assert(cpu->regs[0] == 5050);
+            assert(cpu->regs[1] == 0);
+        }
+    }
+
+    {
+        ///the jump at tgt can be skipped by the IFE before it, so tgt falls through into next and the two can't be separated
+        std::string_view test = "SET A, 1\nIFE A, 0\n:tgt\nSET PC, bad\n:next\nSET B, 7\nBRK\n:bad\nSET B, 9\nBRK\n:hot\nSET C, 1\nSET PC, hot";
+
+        auto [profile, bad_line] = parse_profile("hot 1000\nbad 500\nnext 1\n");
+
+        assert(!bad_line.has_value());
+
+        std::vector<basic_block> blocks = split_basic_blocks(test);
+
+        assert(blocks.size() == 5);
+        assert(blocks[1].label == "tgt");
+        assert(blocks[1].falls_through);
+
+        auto [plain_opt, plain_err] = assemble(test);
+        auto [laid_out_opt, laid_out_err] = assemble_with_profile(test, profile);
+
+        assert(plain_opt.has_value());
+        assert(laid_out_opt.has_value());
+
+        for(const return_info* rinfo : {&plain_opt.value(), &laid_out_opt.value()})
+        {
+            std::unique_ptr<dcpu> cpu = std::make_unique<dcpu>();
+            cpu->load(*rinfo);
+            cpu->run(1000);
+
+            assert(cpu->state == dcpu_state::HALTED);
+            assert(cpu->regs[1] == 7);
+        }
+    }
+
+    {
+        std::string_view test = "SET A, later\n.repeat 3\nADD A, 1\n.end\n:later\nBRK";
+
+        assembler_settings sett;
+        sett.collect_stats = true;
+
+        auto [plain_opt, plain_err] = assemble(test);
+        auto [binary_opt, err] = assemble(test, sett);
+
+        assert(plain_opt.has_value());
+        assert(!plain_opt.value().stats.has_value());
+
+        assert(binary_opt.has_value());
+
+        #ifndef DCPU16_ASM_NO_STATS
+        assert(binary_opt.value().stats.has_value());
+
+        const assembly_stats& stats = binary_opt.value().stats.value();
+
+        assert(stats.repeat_iterations == 3);
+        assert(stats.delayed_expressions == 0);
+        assert(stats.backpatched_fixups == 1);
+        assert(stats.tokens > 0);
+        #endif
+    }
+
+    {
+        trace_buffer& buffer = get_thread_trace_buffer();
+        size_t start = buffer.events.size();
+
+        trace_enabled = true;
+        auto [binary_opt, err] = assemble("SET A, later\n.repeat 3\nADD A, 1\n.end\n:later\nBRK");
+        trace_enabled = false;
+
+        assert(binary_opt.has_value());
+
+        int repeats = 0;
+        int phases = 0;
+
+        for(size_t i=start; i < buffer.events.size(); i++)
+        {
+            repeats += buffer.events[i].name == ".repeat";
+            phases += buffer.events[i].category == "phase";
+        }
+
+        assert(repeats == 1);
+        assert(phases == 3);
+        assert(buffer.events.back().name == "assemble");
+
+        buffer.events.resize(start);
+    }
+
+    {
+        constexpr auto firmware = assemble_ct<"SET A, later\n.repeat 3\n:inner\nADD A, 1\nIFE A, 0\nSET PC, inner\n.end\n:later\n.dat \"hi\", later, 5\nBRK">();
+
+        auto [binary_opt, err] = assemble("SET A, later\n.repeat 3\n:inner\nADD A, 1\nIFE A, 0\nSET PC, inner\n.end\n:later\n.dat \"hi\", later, 5\nBRK");
+
+        assert(binary_opt.has_value());
+        assert(binary_opt.value().mem.size() == firmware.size());
+
+        for(size_t i=0; i < firmware.size(); i++)
+        {
+            assert(binary_opt.value().mem[i] == firmware[i]);
+        }
+    }
+
+    {
+        auto [binary_opt, err] = assemble<4>(".dat 1, 2, 3, 4, 5");
+
+        assert(!binary_opt.has_value());
+
+        auto [fits_opt, fits_err] = assemble<4>(".dat 1, 2, 3, 4");
+
+        assert(fits_opt.has_value());
+    }
+
+    {
+        assembler_settings sett;
+        sett.location = 2;
+
+        auto [binary_opt, err] = assemble("SET A, 1\nSET B, 2\nSET C, 3", sett);
+
+        assert(binary_opt.has_value());
+
+        const return_info& rinfo = binary_opt.value();
+
+        ///the words shifted up to make room must not be left behind
+        assert(rinfo.mem.size() == 5);
+        assert(rinfo.mem[0] == 0);
+        assert(rinfo.mem[1] == 0);
+        assert(rinfo.mem[4] == 0x9041);
+        assert(rinfo.source_line_to_pc[2] == 4);
+        assert(rinfo.segments.size() == 1);
+        assert(rinfo.segments[0].address == 2);
+        assert(rinfo.segments[0].size == 3);
+    }
+
+    {
+        auto [binary_opt, err] = assemble("SET A, 1\n.org 0x10\n:there\nSET B, there\n.org 0x20\n.dat 5");
+
+        assert(binary_opt.has_value());
+
+        const return_info& rinfo = binary_opt.value();
+
+        assert(rinfo.mem.size() == 0x21);
+        assert(rinfo.mem[1] == 0);
+        assert(rinfo.mem[0x20] == 5);
+        assert(rinfo.source_line_to_pc[3] == 0x10);
+        assert(rinfo.pc_to_source_line[0x20] == 5);
+
+        assert(rinfo.segments.size() == 3);
+        assert(rinfo.segments[1].address == 0x10);
+        assert(rinfo.segments[1].size == 1);
+        assert(rinfo.segment_words(rinfo.segments[2])[0] == 5);
+
+        ///there is 0x10, so it still fits in a short literal
+        auto [same_opt, same_err] = assemble("SET B, 0x10");
+
+        assert(same_opt.has_value());
+        assert(rinfo.mem[0x10] == same_opt.value().mem[0]);
+
+        auto [backwards_opt, backwards_err] = assemble(".org 0x10\nSET A, 1\n.org 0x5");
+
+        assert(!backwards_opt.has_value());
+
+        auto [wrapped_opt, wrapped_err] = assemble(".org 0x10000\n.dat 1");
+
+        assert(!wrapped_opt.has_value());
+        assert(wrapped_err.msg == ".org address must be between 0 and 0xffff");
+        assert(!assemble(".org -1\n.dat 1").first.has_value());
+        assert(assemble(".org 0xffff\n.dat 1").first.value().mem[0xffff] == 1);
+    }
+
+    {
+        auto [binary_opt, err] = assemble("SET A, 1\n.fill 3, 0xbeef\n.align 8\n:aligned\n.dat aligned\n.reserve 4\n:after\n.dat after\n.align 4, 0x1234\n.dat 9");
+
+        assert(binary_opt.has_value());
+
+        const return_info& rinfo = binary_opt.value();
+
+        assert(rinfo.mem.size() == 17);
+        assert(rinfo.mem[1] == 0xbeef && rinfo.mem[3] == 0xbeef);
+        assert(rinfo.mem[4] == 0 && rinfo.mem[7] == 0);
+        assert(rinfo.mem[8] == 8);
+        assert(rinfo.mem[13] == 13);
+        assert(rinfo.mem[14] == 0x1234 && rinfo.mem[15] == 0x1234);
+        assert(rinfo.mem[16] == 9);
+
+        ///the whole fill maps back to its one statement
+        assert(rinfo.pc_to_source_line[1] == 1 && rinfo.pc_to_source_line[3] == 1);
+        assert(rinfo.translation_map[1] == rinfo.translation_map[3]);
+
+        ///.reserve is a gap, so it isn't in the sparse image
+        assert(rinfo.segments.size() == 2);
+        assert(rinfo.segments[0].size == 9);
+        assert(rinfo.segments[1].address == 13);
+
+        auto [no_value_opt, no_value_err] = assemble(".fill 3");
+        auto [zero_opt, zero_err] = assemble(".align 0");
+        auto [too_big_opt, too_big_err] = assemble(".fill 0x10001, 0");
+        auto [reserve_opt, reserve_err] = assemble("SET A, 1\n.reserve 0x10000");
+
+        assert(!no_value_opt.has_value());
+        assert(!zero_opt.has_value());
+        assert(!too_big_opt.has_value());
+        assert(!reserve_opt.has_value());
+    }
+
+    {
+        auto [binary_opt, err] = assemble(".dat \"a\\tb\", 1\n.asciz \"hi\"\n.pstring \"abc\"\n.packed le \"xy\"\n.packedz \"\\\\n\"");
+
+        assert(binary_opt.has_value());
+
+        const return_info& rinfo = binary_opt.value();
+
+        assert(rinfo.mem.size() == 13);
+        assert(rinfo.mem[0] == 'a' && rinfo.mem[1] == '\t' && rinfo.mem[2] == 'b' && rinfo.mem[3] == 1);
+        assert(rinfo.mem[4] == 'h' && rinfo.mem[6] == 0);
+        ///the length counts characters, and the odd one out is padded with a zero byte
+        assert(rinfo.mem[7] == 3);
+        assert(rinfo.mem[8] == (('a' << 8) | 'b'));
+        assert(rinfo.mem[9] == ('c' << 8));
+        assert(rinfo.mem[10] == (('y' << 8) | 'x'));
+        ///two characters already fill the word, so the terminator takes a whole one
+        assert(rinfo.mem[11] == (('\\' << 8) | 'n'));
+        assert(rinfo.mem[12] == 0);
+
+        auto [bad_escape_opt, bad_escape_err] = assemble(".pstring \"a\\q\"");
+        auto [not_string_opt, not_string_err] = assemble(".asciz 5");
+
+        assert(!bad_escape_opt.has_value());
+        assert(bad_escape_err.name_in_source == "\\q");
+        assert(!not_string_opt.has_value());
+    }
+
+    {
+        auto [binary_opt, err] = assemble(".def DEBUG 1\n.if DEBUG\nSET A, 1\n.else\nSET A, 2\n.endif\n.ifdef MISSING\nSET B, 1\n.endif\n.ifndef MISSING\nSET C, 3\n.endif");
+        auto [expected_opt, expected_err] = assemble("SET A, 1\nSET C, 3");
+
+        assert(binary_opt.has_value() && expected_opt.has_value());
+        assert(binary_opt.value().mem.size() == expected_opt.value().mem.size());
+        assert(binary_opt.value().mem[0] == expected_opt.value().mem[0]);
+        assert(binary_opt.value().mem[1] == expected_opt.value().mem[1]);
+
+        assembler_settings sett;
+        sett.provided_symbol_definitions.push_back({3, "VARIANT"});
+
+        ///inactive branches are skipped without being assembled, so nothing in them has to be valid
+        std::string_view variants = ".if VARIANT == 3\nSET A, 1\n.if VARIANT > 5\nnot an instruction\n.else\n:there\nSET B, 2\n.endif\n.else\n.if 1\n!!!\n.endif\n.endif\nSET PC, there";
+
+        auto [variant_opt, variant_err] = assemble(variants, sett);
+        auto [variant_expected_opt, variant_expected_err] = assemble("SET A, 1\n:there\nSET B, 2\nSET PC, there");
+
+        assert(variant_opt.has_value() && variant_expected_opt.has_value());
+        assert(variant_opt.value().mem.size() == 3);
+
+        for(int i=0; i < 3; i++)
+            assert(variant_opt.value().mem[i] == variant_expected_opt.value().mem[i]);
+
+        auto [macro_opt, macro_err] = assemble(".macro pick x\n.if x\nSET A, 1\n.else\nSET A, 2\n.endif\n.endmacro\npick 0\npick 1");
+        auto [macro_expected_opt, macro_expected_err] = assemble("SET A, 2\nSET A, 1");
+
+        assert(macro_opt.has_value() && macro_expected_opt.has_value());
+        assert(macro_opt.value().mem.size() == 2);
+        assert(macro_opt.value().mem[0] == macro_expected_opt.value().mem[0]);
+        assert(macro_opt.value().mem[1] == macro_expected_opt.value().mem[1]);
+
+        auto [open_opt, open_err] = assemble(".if 1\nSET A, 1");
+        auto [skipped_open_opt, skipped_open_err] = assemble(".if 0\nSET A, 1");
+        auto [stray_opt, stray_err] = assemble("SET A, 1\n.endif");
+        auto [forward_opt, forward_err] = assemble(".if later\n.endif\n:later");
+
+        assert(!open_opt.has_value());
+        assert(!skipped_open_opt.has_value());
+        assert(!stray_opt.has_value());
+        assert(!forward_opt.has_value());
+    }
+
+    {
+        ///whichever branch is being assembled when the second .else turns up, and however deep in a skipped region it is
+        for(std::string_view twice : {".if 1\n.else\n.else\n.endif", ".if 0\n.else\n.else\n.endif", ".if 0\n.if 1\n.else\n.else\n.endif\n.endif",
+                                      ".if 1\n.else\n.if 1\n.else\n.else\n.endif\n.endif", ".macro both\n.if 1\n.else\n.else\n.endif\n.endmacro\nboth"})
+        {
+            auto [twice_opt, twice_err] = assemble(twice);
+
+            assert(!twice_opt.has_value());
+            assert(twice_err.msg == "Duplicate .else");
+        }
+
+        assert(assemble(".if 0\n.if 1\n.else\n.endif\n.else\n.if 0\n.else\nSET A, 1\n.endif\n.endif").first.value().mem.size() == 1);
+    }
+
+    {
+        std::string_view runtime = ":start\nSET PC, main\n:print\nSET A, 1\nSET PC, POP\n.def RUNTIME_VERSION 2\n.macro call_print\nJSR print\n.endmacro\n.export print";
+
+        auto [pre, pre_err] = make_prelude(runtime);
+
+        assert(pre != nullptr);
+
+        std::array<std::string_view, 2> programs{":main\ncall_print\nSET B, RUNTIME_VERSION\nBRK", ":main\nSET C, print\n.repeat 2\n:inner\nSET PC, inner\n.end\nBRK"};
+        std::array<std::optional<return_info>, 2> results;
+
+        ///one snapshot, assembled against from several threads at once
+        {
+            std::array<std::thread, 2> threads;
+
+            for(size_t i=0; i < programs.size(); i++)
+                threads[i] = std::thread([&, i](){results[i] = assemble(programs[i], *pre).first;});
+
+            for(std::thread& thread : threads)
+                thread.join();
+        }
+
+        for(size_t i=0; i < programs.size(); i++)
+        {
+            std::string whole = std::string(runtime) + "\n" + std::string(programs[i]);
+
+            auto [expected_opt, expected_err] = assemble(whole);
+
+            assert(results[i].has_value() && expected_opt.has_value());
+            assert(results[i].value().mem.size() == expected_opt.value().mem.size());
+
+            for(size_t w=0; w < expected_opt.value().mem.size(); w++)
+                assert(results[i].value().mem[w] == expected_opt.value().mem[w]);
+
+            assert(results[i].value().exported_label_names.size() == 1);
+            assert(results[i].value().file_of(0) == 1);
+            assert(results[i].value().file_of(pre->image.mem.size()) == 0);
+        }
+
+        ///the prelude jumps to main, which every program has to define
+        auto [missing_opt, missing_err] = assemble("BRK", *pre);
+
+        assert(!missing_opt.has_value());
+    }
+
+    {
+        std::string source = ".def BIG 0x1234\n.def SMALL 3\nSET A, SMALL\nSET PC, entry\n";
+
+        for(int i=0; i < 200; i++)
+        {
+            std::string n = std::to_string(i);
+
+            if(i == 100)
+                source += ".def MID 7\n";
+
+            source += ":f" + n + "\n";
+            source += i > 0 ? "SET A, f" + std::to_string(i - 1) + "\n" : "";
+            source += "ADD B, BIG\nSET X, SMALL\nSET C, f" + std::to_string(std::min(i + 3, 199)) + "\n";
+            source += i > 100 ? "SET Y, MID\n" : "";
+            source += ".repeat 2\n:inner\nSET PC, inner\n.end\n.dat \"s\", f" + n + "\n";
+        }
+
+        source += ":entry\n.export entry\nBRK\n";
+
+        assembler_settings sett;
+        sett.collect_symbols = true;
+
+        std::vector<source_chunk> chunks = split_source_chunks(source, 4, 256);
+
+        assert(chunks.size() == 4);
+        assert(chunks[0].defines.size() == 2);
+
+        auto chunked_opt = assemble_chunks(source, chunks, sett);
+        auto [serial_opt, serial_err] = assemble(source, sett);
+
+        assert(chunked_opt.has_value() && serial_opt.has_value());
+
+        const return_info& chunked = chunked_opt.value();
+        const return_info& serial = serial_opt.value();
+
+        assert(chunked.mem.size() == serial.mem.size());
+        assert(chunked.segments.size() == 1 && serial.segments.size() == 1);
+        assert(chunked.segments[0].size == serial.segments[0].size);
+
+        for(size_t i=0; i < serial.mem.size(); i++)
+        {
+            assert(chunked.mem[i] == serial.mem[i]);
+            assert(chunked.translation_map[i] == serial.translation_map[i]);
+            assert(chunked.pc_to_source_line[i] == serial.pc_to_source_line[i]);
+        }
+
+        for(size_t i=0; i < serial.source_line_to_pc.size(); i++)
+            assert(chunked.source_line_to_pc[i] == serial.source_line_to_pc[i]);
+
+        assert(chunked.exported_label_names == serial.exported_label_names);
+        assert(chunked.symbols.value().entries.size() == serial.symbols.value().entries.size());
+        assert(chunked.symbols.value().find("f150") == serial.symbols.value().find("f150"));
+
+        ///a macro ties later lines to an earlier one, so this is assembled serially
+        auto [fallback_opt, fallback_err] = assemble_parallel(".macro two\nSET A, 2\n.endmacro\n" + source + "two\n", sett, 4, 256);
+
+        assert(fallback_opt.has_value());
+        assert(split_source_chunks(".macro two\nSET A, 2\n.endmacro\n" + source, 4, 256).size() == 0);
+
+        ///errors always come from the serial assembler
+        ///held onto, as the error points into it
+        std::string broken = source + "SET A, nowhere\n";
+
+        auto [broken_opt, broken_err] = assemble_parallel(broken, assembler_settings(), 4, 256);
+
+        assert(!broken_opt.has_value());
+        assert(broken_err.name_in_source == "nowhere");
+    }
+
+    {
+        std::vector<batch_job> jobs = parse_batch_list("dcpu16_asm_test_batch_0.dasm\r\n\n  dcpu16_asm_test_batch_1.dasm\ndcpu16_asm_test_batch_missing.dasm\ndcpu16_asm_test_batch_2.dasm");
+
+        assert(jobs.size() == 4);
+        assert(jobs[1].source_path == "dcpu16_asm_test_batch_1.dasm");
+        assert(jobs[1].out_path == "dcpu16_asm_test_batch_1.dasm.asm");
+
+        write_all_bin(jobs[0].source_path, "SET A, 1\nBRK");
+        write_all_bin(jobs[1].source_path, ":loop\nADD A, 1\nSET PC, loop");
+        write_all_bin(jobs[3].source_path, "SET A, nowhere");
+
+        batch_settings bsett;
+        bsett.workers = 2;
+        bsett.io_threads = 2;
+        bsett.queue_capacity = 1;
+
+        batch_result res = assemble_batch(jobs, assembler_settings(), bsett);
+
+        ///the missing source, and the one which doesn't assemble
+        assert(res.assembled == 2);
+        assert(res.failures.size() == 2);
+
+        for(size_t i=0; i < 2; i++)
+        {
+            auto [expected_opt, expected_err] = assemble(read_file(jobs[i].source_path));
+            auto written_opt = read_whole_file(jobs[i].out_path);
+
+            assert(expected_opt.has_value() && written_opt.has_value());
+            assert(written_opt.value().size() == expected_opt.value().mem.size() * sizeof(uint16_t));
+            assert(memcmp(written_opt.value().data(), &expected_opt.value().mem.svec[0], written_opt.value().size()) == 0);
+        }
+
+        assert(!read_whole_file(jobs[2].source_path).has_value());
+        assert(!read_whole_file(jobs[3].out_path).has_value());
+        assert(read_file(jobs[2].source_path) == "");
+
+        ///-fsparse applies to every image in the batch
+        bsett.encode_image = sparse_image;
+
+        batch_result sparse_res = assemble_batch({jobs[0]}, assembler_settings(), bsett);
+
+        assert(sparse_res.assembled == 1);
+        assert(read_whole_file(jobs[0].out_path).value() == sparse_image(assemble(read_file(jobs[0].source_path)).first.value()));
+
+        for(const batch_job& job : jobs)
+        {
+            remove(job.source_path.c_str());
+            remove(job.out_path.c_str());
+        }
+    }
+
+    {
+        auto [binary_opt, err] = assemble("SET A, 1\n.section data\n:table\n.dat 7\n.section text\nSET B, table\nBRK");
+
+        assert(binary_opt.has_value());
+
+        const return_info& rinfo = binary_opt.value();
+
+        ///data is placed after all of text, and the forward reference to it isn't packed
+        assert(rinfo.mem.size() == 5);
+        assert(rinfo.mem[2] == 4);
+        assert(rinfo.mem[4] == 7);
+        assert(rinfo.pc_to_source_line[4] == 3);
+
+        ///only a .section statement splits the source, not the word anywhere else
+        assert(section_order("SET A, 1 ; section\n:section_end\n.dat \"section\"").size() == 1);
+        assert(section_order("SET A, 1\n.section data\n.dat 7\n.section text\nBRK").size() == 3);
+    }
+
+    {
+        std::string_view first = "SET A, helper\n.section rodata\n:msg\n.dat 1, 2\n.section text\nSET B, msg\nBRK";
+        std::string_view second = ".export helper\n:helper\nSET PC, POP\n.section rodata\n:msg\n.dat 3";
+
+        std::array<link_unit, 2> units{link_unit{"first", first}, link_unit{"second", second}};
+
+        auto [layout, bad_line] = parse_link_layout("# code first\ntext 0\nrodata 0x100 0x110");
+
+        assert(!bad_line.has_value());
+        assert(layout.size() == 2);
+
+        auto [binary_opt, err] = link(units, layout);
+
+        assert(binary_opt.has_value());
+
+        const return_info& rinfo = binary_opt.value();
+
+        assert(rinfo.sections.size() == 2);
+        assert(rinfo.sections[0].name == "text");
+        assert(rinfo.sections[0].address == 0);
+        assert(rinfo.sections[1].address == 0x100);
+        assert(rinfo.sections[1].size == 3);
+        assert(rinfo.segments.size() == 2);
+
+        assert(rinfo.mem[0x100] == 1);
+        assert(rinfo.mem[0x102] == 3);
+        assert(rinfo.file_of(0x102) == 2);
+
+        ///each unit's msg is its own, and helper comes from the second unit's text
+        size_t helper = rinfo.sections[0].size - 1;
+
+        assert(rinfo.mem[1] == helper);
+        assert(rinfo.mem[3] == 0x100);
+        assert(rinfo.file_of(helper) == 2);
+
+        auto [tight, tight_line] = parse_link_layout("text\nrodata 0x100 0x102");
+        auto [tight_opt, tight_err] = link(units, tight);
+
+        assert(!tight_opt.has_value());
+
+        ///the whole image moves up, and anything placed below it overlaps
+        assembler_settings sett;
+        sett.location = 0x40;
+
+        auto [moved, moved_line] = parse_link_layout("text\nrodata 0x100");
+        auto [moved_opt, moved_err] = link(units, moved, sett);
+
+        assert(moved_opt.has_value());
+        assert(moved_opt.value().sections[0].address == 0x40);
+        assert(moved_opt.value().segments[0].address == 0x40);
+        assert(moved_opt.value().mem[0x41] == 0x40 + helper);
+        assert(moved_opt.value().mem[0x100] == 1);
+
+        assert(!link(units, layout, sett).first.has_value());
+    }
+
+    {
+        ///one segment per placed section, more than return_info can hold
+        std::string source;
+        std::string layout_text;
+
+        for(int i=0; i < 300; i++)
+        {
+            source += ".section s" + std::to_string(i) + "\n.dat " + std::to_string(i) + "\n";
+            layout_text += "s" + std::to_string(i) + " " + std::to_string(i * 2) + "\n";
+        }
+
+        std::array<link_unit, 1> units{link_unit{"many", source}};
+
+        auto [many, many_line] = parse_link_layout(layout_text);
+        auto [many_opt, many_err] = link(units, many);
+
+        assert(!many_opt.has_value());
+        assert(many_err.msg == "Too many segments");
+    }
+
+    {
+        std::string_view first = "JSR used\nJSR shared\nBRK\n:used\nSET A, table\nSET PC, POP\n:unused\nSET B, 1\nSET PC, POP\n.section data\n:unused_table\n.dat 2, 3\n:table\n.dat 1";
+        std::string_view second = ".export shared\n:shared\nSET PC, POP\n:dead\nSET C, 1\nSET PC, POP";
+
+        std::string_view first_by_hand = "JSR used\nJSR shared\nBRK\n:used\nSET A, table\nSET PC, POP\n.section data\n:table\n.dat 1";
+        std::string_view second_by_hand = ".export shared\n:shared\nSET PC, POP";
+
+        std::array<link_unit, 2> units{link_unit{"first", first}, link_unit{"second", second}};
+        std::array<link_unit, 2> units_by_hand{link_unit{"first", first_by_hand}, link_unit{"second", second_by_hand}};
+
+        std::vector<std::string> stripped = strip_unreachable_blocks(units);
+
+        assert(stripped[0].size() == first.size());
+
+        ///the directives' names in a comment, a label or a string don't stop anything being stripped
+        std::string_view mentions = "JSR used\nBRK ; include and org\n:used\nSET PC, POP\n:org_table\n.dat \"align\"\n:unused\nSET A, include";
+        std::array<link_unit, 1> mention_units{link_unit{"mentions", mentions}};
+
+        std::string stripped_mentions = strip_unreachable_blocks(mention_units)[0];
+
+        assert(stripped_mentions.find("org_table") == std::string::npos);
+        assert(stripped_mentions.find("SET A, include") == std::string::npos);
+        assert(stripped_mentions.find("SET PC, POP") != std::string::npos);
+        assert(uses_directive("SET A, 1\n:here .org 0x100", {"org"}));
+        assert(std::count(stripped[0].begin(), stripped[0].end(), '\n') == std::count(first.begin(), first.end(), '\n'));
+
+        auto [gc_opt, gc_err] = link_gc(units, {});
+        auto [hand_opt, hand_err] = link(units_by_hand, {});
+
+        assert(gc_opt.has_value());
+        assert(hand_opt.has_value());
+
+        const return_info& rinfo = gc_opt.value();
+
+        assert(rinfo.mem.size() == hand_opt.value().mem.size());
+
+        for(size_t i=0; i < rinfo.mem.size(); i++)
+        {
+            assert(rinfo.mem[i] == hand_opt.value().mem[i]);
+        }
+
+        assert(rinfo.removed_words.size() == 2);
+        assert(rinfo.removed_words[0] == 4);
+        assert(rinfo.removed_words[1] == 2);
+
+        ///line maps still refer to the original text
+        assert(rinfo.pc_to_source_line[rinfo.sections[1].address] == 13);
+    }
+
+    {
+        assembler_settings symbols_sett;
+        symbols_sett.collect_symbols = true;
+
+        auto [symbols_opt, symbols_err] = assemble("SET A, 1\n:start\nSET B, 2\nSET C, 3\n.repeat 2\n:inner\nSET X, 1\n.end\n:finish\nBRK", symbols_sett);
+
+        assert(symbols_opt.has_value());
+        assert(symbols_opt.value().symbols.has_value());
+        assert(!assemble("SET A, 1\n:start").first.value().symbols.has_value());
+
+        const symbol_index& index = symbols_opt.value().symbols.value();
+
+        assert(index.entries.size() == 4);
+        assert(!index.symbolize(0).has_value());
+        assert(index.symbolize(2) == std::pair(std::string_view("start"), (uint16_t)1));
+        assert(index.symbolize(4) == std::pair(std::string_view("inner"), (uint16_t)0));
+        assert(index.symbolize(0xffff) == std::pair(std::string_view("finish"), (uint16_t)(0xffff - 5)));
+        assert(index.entries[1].scope_depth == 1);
+
+        assert(index.find("finish") == 5);
+        assert(index.find("inner") == 3);
+        assert(!index.find("missing").has_value());
+
+        std::string bytes = index.serialize();
+
+        ///as it would be if mapped, suitably aligned
+        std::vector<uint32_t> storage((bytes.size() + 3) / 4);
+        memcpy(storage.data(), bytes.data(), bytes.size());
+
+        std::string_view mapped((const char*)storage.data(), bytes.size());
+
+        auto view_opt = symbol_index_view::from_bytes(mapped);
+
+        assert(view_opt.has_value());
+        assert(view_opt.value().symbolize(2) == index.symbolize(2));
+        assert(view_opt.value().find("inner") == 3);
+        assert(view_opt.value().find("start") == 1);
+
+        assert(!symbol_index_view::from_bytes(mapped.substr(0, mapped.size() - 1)).has_value());
+    }
+
+    {
+        serve_request req;
+        req.id = 7;
+        req.flags = serve_flags::MAPS | serve_flags::SYMBOLS;
+        req.source = "SET A, offset\n:here\nSET PC, here";
+        req.definitions.push_back({0x1234, "offset"});
+
+        std::string frame = encode_request(req);
+
+        auto decoded_opt = decode_request(std::string_view(frame).substr(sizeof(uint32_t)));
+
+        assert(decoded_opt.has_value());
+        assert(decoded_opt.value().source == req.source);
+        assert(decoded_opt.value().definitions == req.definitions);
+        assert(!decode_request(std::string_view(frame).substr(sizeof(uint32_t), frame.size() - sizeof(uint32_t) - 1)).has_value());
+
+        serve_response resp = handle_request(decoded_opt.value());
+
+        assert(resp.status == serve_status::OK);
+        assert(resp.mem.size() == 3);
+        assert(resp.mem[1] == 0x1234);
+        assert(resp.pc_to_source_line.size() == 3);
+
+        std::string resp_frame = encode_response(resp, req.flags);
+        auto resp_opt = decode_response(std::string_view(resp_frame).substr(sizeof(uint32_t)), req.flags);
+
+        assert(resp_opt.has_value());
+        assert(resp_opt.value().id == 7);
+        assert(resp_opt.value().mem == resp.mem);
+        assert(resp.symbols.size() > 0);
+        assert(resp_opt.value().symbols == resp.symbols);
+    }
+
+    {
+        ///a client chooses every path, so nothing is readable without a root, and nothing outside it with one
+        std::filesystem::create_directories("dcpu16_asm_test_root/inner");
+
+        write_all_bin("dcpu16_asm_test_secret.bin", "ab");
+        write_all_bin("dcpu16_asm_test_root/inner/shared.dasm", "SET A, 1\n.include \"../top.dasm\"");
+        write_all_bin("dcpu16_asm_test_root/top.dasm", "SET B, 2");
+
+        std::string secret = std::filesystem::absolute("dcpu16_asm_test_secret.bin").string();
+
+        auto serve = [&](std::string source, std::string_view root)
+        {
+            serve_request req;
+            req.source = source;
+
+            return handle_request(req, assembly_budgets(), root);
+        };
+
+        for(std::string_view root : {"", "dcpu16_asm_test_root", "dcpu16_asm_test_root/"})
+        {
+            assert(serve(".incbin \"../dcpu16_asm_test_secret.bin\"", root).status == serve_status::ASSEMBLY_ERROR);
+            assert(serve(".incbin \"inner/../../dcpu16_asm_test_secret.bin\"", root).status == serve_status::ASSEMBLY_ERROR);
+            assert(serve(".incbin \"" + secret + "\"", root).status == serve_status::ASSEMBLY_ERROR);
+        }
+
+        assert(serve(".include \"inner/shared.dasm\"", "").status == serve_status::ASSEMBLY_ERROR);
+
+        serve_response inside = serve(".include \"inner/shared.dasm\"", "dcpu16_asm_test_root");
+
+        assert(inside.status == serve_status::OK);
+        assert(inside.mem.size() == 2);
+
+        ///without a root the path is as given, for local use
+        file_loader loader;
+        assembler_settings sett;
+        loader.apply(sett);
+
+        assert(assemble(".incbin \"" + secret + "\"", sett).first.has_value());
+
+        remove("dcpu16_asm_test_secret.bin");
+        std::filesystem::remove_all("dcpu16_asm_test_root");
+    }
+
+    #ifndef _WIN32
+    {
+        ///two requests pipelined before any response is read, plus a malformed one. Responses may arrive in any order
+        int requests[2];
+        int responses[2];
+
+        assert(pipe(requests) == 0);
+        assert(pipe(responses) == 0);
+
+        serve_request good;
+        good.id = 1;
+        good.source = "SET A, 1\nBRK";
+
+        serve_request bad;
+        bad.id = 2;
+        bad.source = "SET A, missing";
+
+        std::string frames = encode_request(good) + encode_request(bad);
+
+        std::string malformed = encode_request(good);
+        malformed[4] = 3;
+        malformed.resize(malformed.size() - 1);
+        malformed[0]--;
+
+        frames += malformed;
+
+        {
+            serve_settings ssett;
+            ssett.workers = 2;
+            ssett.queue_capacity = 1;
+
+            assembler_server server(ssett);
+
+            std::thread reader([&](){server.serve_connection(requests[0], std::make_shared<assembler_server::connection>(responses[1], false));});
+
+            assert(write_all(requests[1], frames));
+            close(requests[1]);
+
+            reader.join();
+        }
+
+        close(requests[0]);
+        close(responses[1]);
+
+        std::vector<serve_response> got;
+
+        while(true)
+        {
+            char length_bytes[4];
+
+            if(!read_exact(responses[0], length_bytes, 4))
+                break;
+
+            frame_reader length_reader{std::string_view(length_bytes, 4)};
+            std::string payload(length_reader.get<uint32_t>(), '\0');
+
+            assert(read_exact(responses[0], payload.data(), payload.size()));
+
+            auto resp_opt = decode_response(payload, 0);
+
+            assert(resp_opt.has_value());
+
+            got.push_back(resp_opt.value());
+        }
+
+        close(responses[0]);
+
+        std::sort(got.begin(), got.end(), [](const serve_response& r1, const serve_response& r2){return r1.id < r2.id;});
+
+        assert(got.size() == 3);
+        assert(got[0].status == serve_status::OK);
+        assert(got[0].mem.size() == 2);
+        assert(got[1].status == serve_status::ASSEMBLY_ERROR);
+        assert(got[1].msg.size() > 0);
+        assert(got[2].id == 3);
+        assert(got[2].status == serve_status::MALFORMED_REQUEST);
+    }
+    #endif
+
+    {
+        ///a jump table ahead of the code it points at, assembled in one pass
+        std::string_view test = "SET I, 1\nSET PC, [table + I]\n:table\n.dat first, second\n:first\nSET A, 1\nBRK\n:second\nSET A, [value]\nSET B, value + 1\nBRK\n:value\n.dat 5";
+
+        assembler_settings table_sett;
+        table_sett.collect_stats = true;
+
+        auto [table_opt, table_err] = assemble(test, table_sett);
+
+        assert(table_opt.has_value());
+
+        const return_info& rinfo = table_opt.value();
+
+        assert(rinfo.mem[3] == 5);
+        assert(rinfo.mem[4] == 7);
+
+        #ifndef DCPU16_ASM_NO_STATS
+        ///table + I and value + 1 are real expressions, the rest are patched as their labels are defined
+        assert(rinfo.stats.value().backpatched_fixups == 3);
+        assert(rinfo.stats.value().delayed_expressions == 2);
+        #endif
+
+        std::unique_ptr<dcpu> cpu = std::make_unique<dcpu>();
+        cpu->load(rinfo);
+        cpu->run(1000);
+
+        assert(cpu->state == dcpu_state::HALTED);
+        assert(cpu->regs[0] == 5);
+        assert(cpu->regs[1] == 0x0d);
+
+        auto [missing_opt, missing_err] = assemble(".dat nowhere");
+
+        assert(!missing_opt.has_value());
+        assert(missing_err.line == 0);
+
+        ///left for link to resolve
+        std::array<link_unit, 2> units{link_unit{"first", "JSR f\nBRK\n:table\n.dat f"}, link_unit{"second", ".export f\n:f\nSET PC, POP"}};
+
+        auto [linked_opt, linked_err] = link(units, {});
+
+        assert(linked_opt.has_value());
+        assert(linked_opt.value().mem[3] == linked_opt.value().mem[1]);
+    }
+
+    {
+        ///everything here goes through the C ABI, as an embedding would
+        assert(dcpu16asm_abi_version() == DCPU16ASM_ABI_VERSION);
+
+        dcpu16asm_context* ctx = dcpu16asm_create();
+
+        std::string_view source = ".export start\n:start\nSET A, base\nSET PC, start";
+
+        dcpu16asm_define(ctx, "base", 4, 5);
+
+        assert(dcpu16asm_assemble(ctx, source.data(), source.size()) == 1);
+
+        assembler_settings expected_sett;
+        expected_sett.provided_symbol_definitions.push_back({5, "base"});
+
+        auto [expected_opt, expected_err] = assemble(source, expected_sett);
+
+        assert(expected_opt.has_value());
+
+        dcpu16asm_words image = dcpu16asm_image(ctx);
+
+        assert(image.size == expected_opt.value().mem.size());
+        assert(memcmp(image.data, expected_opt.value().mem.data(), image.size * sizeof(uint16_t)) == 0);
+        assert(dcpu16asm_pc_to_source_line(ctx).size == expected_opt.value().pc_to_source_line.size());
+
+        assert(dcpu16asm_export_count(ctx) == 1);
+        assert(dcpu16asm_export_at(ctx, 0).address == 0);
+        assert(std::string_view(dcpu16asm_export_at(ctx, 0).name.data, dcpu16asm_export_at(ctx, 0).name.size) == "start");
+        assert(dcpu16asm_export_at(ctx, 1).name.size == 0);
+
+        ///the source is copied out of, so it can go away as soon as the call returns
+        std::string broken = "SET A, 1\nSET B, nowhere";
+
+        assert(dcpu16asm_assemble(ctx, broken.data(), broken.size()) == 0);
+
+        broken.assign(broken.size(), ' ');
+
+        dcpu16asm_error err = dcpu16asm_last_error(ctx);
+
+        assert(!err.cancelled);
+        assert(std::string_view(err.name_in_source.data, err.name_in_source.size) == "nowhere");
+        assert(err.msg.size > 0);
+        assert(dcpu16asm_image(ctx).size == 0);
+        assert(dcpu16asm_export_count(ctx) == 0);
+
+        std::string_view first = "JSR helper\nBRK";
+        std::string_view second = ".export helper\n:helper\nSET PC, POP";
+
+        std::array<dcpu16asm_unit, 2> units{dcpu16asm_unit{{"first", 5}, {first.data(), first.size()}},
+                                            dcpu16asm_unit{{"second", 6}, {second.data(), second.size()}}};
+
+        assert(dcpu16asm_link(ctx, units.data(), units.size()) == 1);
+
+        std::array<link_unit, 2> expected_units{link_unit{"first", first}, link_unit{"second", second}};
+        auto [linked_opt, linked_err] = link(expected_units, {});
+
+        assert(linked_opt.has_value());
+        assert(dcpu16asm_image(ctx).size == linked_opt.value().mem.size());
+        assert(memcmp(dcpu16asm_image(ctx).data, linked_opt.value().mem.data(), linked_opt.value().mem.size() * sizeof(uint16_t)) == 0);
+
+        dcpu16asm_set_budgets(ctx, 4, 0, 0, 0);
+
+        std::string_view wordy = "SET A, 1\n.repeat 10\nSET B, 2\n.end";
+
+        assert(dcpu16asm_assemble(ctx, wordy.data(), wordy.size()) == 0);
+        assert(dcpu16asm_last_error(ctx).line == 2);
+        assert(!dcpu16asm_last_error(ctx).cancelled);
+
+        dcpu16asm_set_budgets(ctx, 0, 0, 0, 0);
+
+        assert(dcpu16asm_assemble(ctx, wordy.data(), wordy.size()) == 1);
+
+        ///a cancel from before an assembly starts is forgotten
+        dcpu16asm_cancel(ctx);
+
+        assert(dcpu16asm_assemble(ctx, wordy.data(), wordy.size()) == 1);
+
+        std::string_view endless = ".repeat 65535\n.repeat 65535\n.end\n.end";
+        int cancelled_ret = -1;
+        std::atomic<bool> finished{false};
+
+        std::thread worker([&]()
+        {
+            cancelled_ret = dcpu16asm_assemble(ctx, endless.data(), endless.size());
+            finished = true;
+        });
+
+        ///repeated, as a cancel which lands before the worker's assembly starts is forgotten
+        while(!finished)
+        {
+            dcpu16asm_cancel(ctx);
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        worker.join();
+
+        assert(cancelled_ret == 0);
+        assert(dcpu16asm_last_error(ctx).cancelled);
+
+        dcpu16asm_destroy(ctx);
+    }
+
+    {
+        assembler_settings budget_sett;
+        budget_sett.budgets.max_expansion_steps = 1000;
+
+        ///about 4 billion passes without a budget
+        auto [nested_opt, nested_err] = assemble(".repeat 65535\n.repeat 65535\n.end\n.end", budget_sett);
+
+        assert(!nested_opt.has_value());
+        assert(nested_err.msg.find("max_expansion_steps") != std::string_view::npos);
+
+        budget_sett = assembler_settings();
+        budget_sett.budgets.max_repeat_depth = 1;
+
+        assert(assemble(".repeat 2\nSET A, 1\n.end", budget_sett).first.has_value());
+        assert(!assemble(".repeat 2\n.repeat 2\nSET A, 1\n.end\n.end", budget_sett).first.has_value());
+
+        budget_sett = assembler_settings();
+        budget_sett.budgets.max_words = 4;
+
+        auto [words_opt, words_err] = assemble("SET A, 1\n.repeat 10\nSET B, 2\n.end", budget_sett);
+
+        assert(!words_opt.has_value());
+        assert(words_err.line == 2);
+
+        budget_sett = assembler_settings();
+        budget_sett.budgets.max_fixups = 1;
+
+        assert(assemble("SET A, later\n:later", budget_sett).first.has_value());
+        assert(!assemble("SET A, later\nSET B, later\n:later", budget_sett).first.has_value());
+
+        ///unbudgeted, but still stops as soon as the image runs past the address space
+        auto [huge_opt, huge_err] = assemble(".repeat 30000\n.repeat 30000\nSET [0x1000], 0x1234\n.end\n.end");
+
+        assert(!huge_opt.has_value());
+        assert(huge_err.msg == "Program does not fit in memory");
+
+        ///bulk emission past the end is caught the same way
+        auto [filled_opt, filled_err] = assemble("SET A, 1\n.fill 0xffff, 7\n.dat \"overflow\"");
+
+        assert(!filled_opt.has_value());
+        assert(filled_err.msg == "Program does not fit in memory");
+
+        auto [unterminated_opt, unterminated_err] = assemble(".repeat 2\nSET A, 1");
+
+        assert(!unterminated_opt.has_value());
+    }
+
+    {
+        std::atomic<bool> cancel{true};
+
+        assembler_settings cancel_sett;
+        cancel_sett.cancel = &cancel;
+
+        auto [cancelled_opt, cancelled_err] = assemble("SET A, 1", cancel_sett);
+
+        assert(!cancelled_opt.has_value());
+        assert(cancelled_err.cancelled);
+
+        cancel = false;
+
+        ///from another thread, part way through about 4 billion .repeat passes
+        std::pair<std::optional<return_info>, error_info>* long_result = nullptr;
+
+        std::thread worker([&]()
+        {
+            long_result = new std::pair<std::optional<return_info>, error_info>(assemble(".repeat 65535\n.repeat 65535\n.end\n.end", cancel_sett));
+        });
 
-    fseek(f, 0, SEEK_END);
-    long fsize = ftell(f);
-    fseek(f, 0, SEEK_SET);
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        cancel = true;
+        worker.join();
 
-    if(fsize == 0)
-    {
-        fclose(f);
-        return "";
-    }
+        assert(!long_result->first.has_value());
+        assert(long_result->second.cancelled);
 
-    std::string ret;
-    ret.resize(fsize);
+        delete long_result;
 
-    fread(&ret[0], 1, fsize, f);
+        ///the same again, with the cancel landing inside a macro's expansion
+        cancel = false;
+        long_result = nullptr;
 
-    return ret;
-}
+        std::thread macro_worker([&]()
+        {
+            long_result = new std::pair<std::optional<return_info>, error_info>(assemble(".macro spin\n.repeat 65535\n.repeat 65535\n.end\n.end\n.endmacro\nspin", cancel_sett));
+        });
 
-inline
-void write_all_bin(const std::string& fname, std::string_view str)
-{
-    FILE* f = fopen(fname.c_str(), "wb");
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        cancel = true;
+        macro_worker.join();
 
-    if(str.size() > 0)
-    {
-        fwrite(&str[0], str.size(), 1, f);
-    }
+        assert(!long_result->first.has_value());
+        assert(long_result->second.cancelled);
+        assert(long_result->second.msg == "Assembly cancelled");
 
-    fclose(f);
-}
+        delete long_result;
 
-void print_sv(std::string_view in)
-{
-    for(auto i : in)
-    {
-        putchar(i);
-    }
+        ///the same settings are good for the next job
+        cancel = false;
 
-    printf("\n");
-}
+        auto [again_opt, again_err] = assemble("SET A, 1", cancel_sett);
 
-void tests()
-{
-    {
-        std::string_view view = "SET X, 10\nSET Y, 1\nADD X, Y";
+        assert(again_opt.has_value());
+        assert(!again_err.cancelled);
 
-        while(view.size() > 0)
+        struct progress_log
         {
-            auto found = consume_next(view, true);
+            int calls = 0;
+            uint64_t bytes = 0;
+            uint64_t words = 0;
+        } log;
 
-            printf("TOK ");
+        assembler_settings progress_sett;
+        progress_sett.progress_user = &log;
+        progress_sett.progress = [](void* user, uint64_t bytes_consumed, uint64_t words_emitted)
+        {
+            progress_log& l = *(progress_log*)user;
 
-            for(auto& i : found)
-                printf("%c", i);
+            assert(bytes_consumed >= l.bytes);
 
-            printf("\n");
+            l.calls++;
+            l.bytes = bytes_consumed;
+            l.words = words_emitted;
+        };
+
+        std::string_view progress_test = ".repeat 3000\nSET A, 1\n.end\nSET B, 2";
+
+        auto [progress_opt, progress_err] = assemble(progress_test, progress_sett);
+
+        assert(progress_opt.has_value());
+        assert(log.calls > 1);
+        assert(log.bytes == progress_test.size());
+        assert(log.words == progress_opt.value().mem.size());
+    }
+
+    {
+        std::string_view with_macros =
+R"(.macro load dst, val
+SET dst, val
+ADD [dst + 1], val
+SET C, val + 1
+:skip
+IFE dst, 0
+SET PC, skip
+.endmacro
+SET I, 0x10
+load A, 3
+load B, later
+:later
+BRK)";
+
+        std::string_view expanded_by_hand =
+R"(SET I, 0x10
+SET A, 3
+ADD [A + 1], 3
+SET C, 3 + 1
+:skip0
+IFE A, 0
+SET PC, skip0
+SET B, later
+ADD [B + 1], later
+SET C, later + 1
+:skip1
+IFE B, 0
+SET PC, skip1
+:later
+BRK)";
+
+        assembler_settings sett;
+        sett.collect_stats = true;
+
+        auto [macro_opt, macro_err] = assemble(with_macros, sett);
+        auto [hand_opt, hand_err] = assemble(expanded_by_hand);
+
+        assert(macro_opt.has_value());
+        assert(hand_opt.has_value());
+
+        const return_info& rinfo = macro_opt.value();
+
+        assert(rinfo.mem.size() == hand_opt.value().mem.size());
+
+        for(size_t i=0; i < rinfo.mem.size(); i++)
+        {
+            assert(rinfo.mem[i] == hand_opt.value().mem[i]);
         }
 
-        constexpr std::string_view test(" hi");
+        ///everything an expansion emits belongs to the line that invoked it
+        assert(rinfo.pc_to_source_line[1] == 9);
+        assert(rinfo.pc_to_source_line[rinfo.mem.size() - 2] == 10);
 
-        static_assert(trim_start(test, [](char c){return c == ' ';}) == "hi");
+        #ifndef DCPU16_ASM_NO_STATS
+        assert(rinfo.stats.value().macro_expansions == 2);
+        #endif
     }
 
     {
-        std::string_view test = "SET X, 65539";
-        auto [binary_opt, err] = assemble(test);
+        auto [bad_opt, bad_err] = assemble(".macro bad x\nFOO x\n.endmacro\nSET A, 1\nbad 2");
 
-        assert(!binary_opt.has_value());
+        assert(!bad_opt.has_value());
+        assert(bad_err.line == 4);
+        assert(bad_err.name_in_source == "bad");
+
+        auto [fixup_opt, fixup_err] = assemble(".macro load x\nSET A, x + 1\n.endmacro\nSET A, 1\nload nowhere");
+
+        assert(!fixup_opt.has_value());
+        assert(fixup_err.line == 4);
+
+        auto [twice_opt, twice_err] = assemble(".macro m\n.endmacro\n.macro m\n.endmacro");
+
+        assert(!twice_opt.has_value());
     }
 
     {
-        std::string_view test = "SET X, [hello]\n:hello\nSET Y, 53\nSET Z hello";
-        auto [binary_opt, err] = assemble(test);
+        std::string source_name = "dcpu16_asm_test_include.dasm";
+        std::string binary_name = "dcpu16_asm_test_include.bin";
+        std::string broken_name = "dcpu16_asm_test_broken.dasm";
+
+        uint16_t words[3] = {0x1111, 0x2222, 0x3333};
+
+        write_all_bin(source_name, "SET X, 3\n:inside\nSET Y, inside\nSET Z, outside");
+        write_all_bin(binary_name, std::string_view((const char*)words, sizeof(words)));
+        write_all_bin(broken_name, "SET X, 3\nFOO");
+
+        assembler_settings sett;
+        file_loader loader;
+        loader.apply(sett);
+
+        auto [binary_opt, err] = assemble("SET A, 1\n.include \"dcpu16_asm_test_include.dasm\"\n:outside\nSET B, 2\n.incbin \"dcpu16_asm_test_include.bin\", 1, 2\nBRK", sett);
+        auto [hand_opt, hand_err] = assemble("SET A, 1\nSET X, 3\n:inside\nSET Y, inside\nSET Z, outside\n:outside\nSET B, 2\n.dat 0x2222, 0x3333\nBRK");
 
         assert(binary_opt.has_value());
+        assert(hand_opt.has_value());
+
+        const return_info& rinfo = binary_opt.value();
+
+        assert(rinfo.mem.size() == hand_opt.value().mem.size());
+
+        for(size_t i=0; i < rinfo.mem.size(); i++)
+        {
+            assert(rinfo.mem[i] == hand_opt.value().mem[i]);
+        }
+
+        assert(rinfo.files.size() == 2);
+        assert(rinfo.files[1] == source_name);
+
+        ///included words map to lines of the included file, and the main source's lines skip over them
+        assert(rinfo.file_of(0) == 0);
+        assert(rinfo.file_of(1) == 1);
+        assert(rinfo.pc_to_source_line[1] == 0);
+        assert(rinfo.source_line_to_pc[1] == 1);
+
+        size_t set_b = rinfo.source_line_to_pc[3];
+
+        assert(rinfo.file_of(set_b) == 0);
+        assert(rinfo.pc_to_source_line[set_b] == 3);
+        assert(rinfo.file_of(set_b - 1) == 1);
+        assert(rinfo.pc_to_source_line[set_b - 1] == 3);
+
+        auto [broken_opt, broken_err] = assemble("SET A, 1\n.include \"dcpu16_asm_test_broken.dasm\"", sett);
+
+        assert(!broken_opt.has_value());
+        assert(broken_err.file == broken_name);
+        assert(broken_err.line == 1);
+
+        auto [unloaded_opt, unloaded_err] = assemble(".include \"dcpu16_asm_test_include.dasm\"");
+
+        assert(!unloaded_opt.has_value());
+
+        ///mapped once, and shared from then on
+        assert(get_shared_file_cache().get(source_name)->text.data() == get_shared_file_cache().get(source_name)->text.data());
+
+        remove(source_name.c_str());
+        remove(binary_name.c_str());
+        remove(broken_name.c_str());
+    }
+
+    {
+        ///a file's includes are relative to it, rather than to the current directory
+        std::filesystem::create_directories("dcpu16_asm_test_dir/inner");
+
+        write_all_bin("dcpu16_asm_test_dir/outer.dasm", "SET A, 1\n.include \"inner/middle.dasm\"");
+        write_all_bin("dcpu16_asm_test_dir/inner/middle.dasm", "SET B, 2\n.include \"last.dasm\"");
+        write_all_bin("dcpu16_asm_test_dir/inner/last.dasm", "SET C, 3");
+
+        assembler_settings sett;
+        file_loader loader;
+        loader.base_directory = "dcpu16_asm_test_dir/";
+        loader.apply(sett);
+
+        auto [nested_opt, nested_err] = assemble(".include \"outer.dasm\"\nBRK", sett);
+
+        assert(nested_opt.has_value());
+        assert(nested_opt.value().mem.size() == 4);
+        assert(nested_opt.value().files.size() == 4);
+        assert(nested_opt.value().files[3] == "dcpu16_asm_test_dir/inner/last.dasm");
+
+        ///too small to hold more than one file, but an assembly's files stay mapped until its loader goes
+        file_cache small;
+        small.max_bytes = 16;
+
+        file_loader pinning;
+        pinning.cache = &small;
+        pinning.base_directory = "dcpu16_asm_test_dir/";
+        pinning.apply(sett);
+
+        auto [pinned_opt, pinned_err] = assemble(".include \"outer.dasm\"\nBRK", sett);
+
+        assert(pinned_opt.has_value());
+        assert(small.mappings == 3);
+        assert(small.files.size() == 1);
+        assert(small.files.count("dcpu16_asm_test_dir/inner/last.dasm") == 1);
+        assert(pinning.pinned.size() == 3);
+        assert(pinning.pinned[0]->text.starts_with("SET A, 1"));
+
+        std::filesystem::remove_all("dcpu16_asm_test_dir");
     }
 }
 
@@ -115,6 +1544,22 @@ constexpr void constexpr_tests()
 
     static_assert(result.first.has_value());
 
+    constexpr auto small = assemble<16>("SET X, 10\nADD X, 1");
+
+    static_assert(small.first.has_value());
+    static_assert(small.first.value().mem.size() == 2);
+    static_assert(small.first.value().mem[1] == 0b1000100001100010);
+
+    constexpr auto firmware = assemble_ct<"SET X, 10\nADD X, 1">();
+
+    static_assert(firmware.size() == 2);
+    static_assert(firmware[0] == 0b1010110001100001);
+    static_assert(firmware[1] == 0b1000100001100010);
+
+    constexpr auto expanded = assemble_ct<".macro bump r, n\nADD r, n\n.endmacro\nSET X, 10\nbump X, 1">();
+
+    static_assert(expanded == firmware);
+
     //std::optional<uint32_t> out;
     //constexpr auto val = decode_value("x", arg_pos::B, out);
 
@@ -146,20 +1591,319 @@ int main(int argc, char* argv[])
 
     if(argc <= 1)
     {
-        printf("Usage: dcpu16-asm.exe ./source [./out] [-fselftest]");
+        printf("Usage: dcpu16-asm.exe ./source [./out] [-fselftest] [-frun] [-fcycles=N] [-fcores=N] [-ffree] [-fprofile=path] [-fprofile-out=path] [-fstats] [-ftrace=path] [-fsparse] [-flayout=path] [-fgc] [-fsymbols=path] [-fserve[=socket]] [-fserve-root=dir] [-fworkers=N] [-fjobs=N] [-fbatch=list]");
         return 0;
     }
 
-    if(iequal(argv[1], "-fselftest"))
+    trace_file_writer trace_writer;
+
+    std::vector<std::string> positional;
+    bool run = false;
+    bool sparse = false;
+    bool gc = false;
+    uint64_t max_cycles = 1000000000;
+    multicore_settings msett;
+    msett.cores = 1;
+    std::string profile_in;
+    std::string profile_out;
+    std::string layout_in;
+    std::string symbols_out;
+    bool serve = false;
+    std::string serve_socket;
+    serve_settings ssett;
+    int jobs = 1;
+    std::string batch_list;
+    assembler_settings sett;
+    file_loader loader;
+    loader.apply(sett);
+
+    for(int i=1; i < argc; i++)
     {
-        tests();
-        printf("Self tests passed");
-        return 0;
+        std::string_view view(argv[i]);
+
+        if(iequal(view, "-fselftest"))
+        {
+            tests();
+            printf("Self tests passed");
+            return 0;
+        }
+        else if(iequal(view, "-frun"))
+        {
+            run = true;
+        }
+        else if(view.starts_with("-fcycles="))
+        {
+            view.remove_prefix(strlen("-fcycles="));
+
+            if(!is_constant(view))
+            {
+                printf("-fcycles= must be a constant\n");
+                return 1;
+            }
+
+            max_cycles = get_constant_of<uint64_t>(view);
+        }
+        else if(view.starts_with("-fcores="))
+        {
+            view.remove_prefix(strlen("-fcores="));
+
+            if(!is_constant(view) || get_constant_of<int>(view) <= 0)
+            {
+                printf("-fcores= must be a positive constant\n");
+                return 1;
+            }
+
+            run = true;
+            msett.cores = get_constant_of<int>(view);
+        }
+        else if(iequal(view, "-ffree"))
+        {
+            msett.lockstep = false;
+        }
+        else if(view.starts_with("-fprofile="))
+        {
+            view.remove_prefix(strlen("-fprofile="));
+
+            profile_in = std::string(view);
+        }
+        else if(view.starts_with("-fprofile-out="))
+        {
+            view.remove_prefix(strlen("-fprofile-out="));
+
+            profile_out = std::string(view);
+        }
+        else if(iequal(view, "-fstats"))
+        {
+            sett.collect_stats = true;
+            allocation_counter = &allocation_count;
+            peak_memory_query = process_peak_memory_bytes;
+        }
+        else if(view.starts_with("-flayout="))
+        {
+            view.remove_prefix(strlen("-flayout="));
+
+            layout_in = std::string(view);
+        }
+        else if(iequal(view, "-fgc"))
+        {
+            gc = true;
+        }
+        else if(view.starts_with("-fsymbols="))
+        {
+            view.remove_prefix(strlen("-fsymbols="));
+
+            symbols_out = std::string(view);
+            sett.collect_symbols = true;
+        }
+        else if(iequal(view, "-fserve"))
+        {
+            serve = true;
+        }
+        else if(view.starts_with("-fserve="))
+        {
+            view.remove_prefix(strlen("-fserve="));
+
+            serve = true;
+            serve_socket = std::string(view);
+        }
+        else if(view.starts_with("-fserve-root="))
+        {
+            view.remove_prefix(strlen("-fserve-root="));
+
+            ssett.include_root = std::string(view);
+        }
+        else if(view.starts_with("-fworkers="))
+        {
+            view.remove_prefix(strlen("-fworkers="));
+
+            if(!is_constant(view) || get_constant_of<int>(view) <= 0)
+            {
+                printf("-fworkers= must be a positive constant\n");
+                return 1;
+            }
+
+            ssett.workers = get_constant_of<int>(view);
+        }
+        else if(view.starts_with("-fjobs="))
+        {
+            view.remove_prefix(strlen("-fjobs="));
+
+            if(!is_constant(view) || get_constant_of<int>(view) <= 0)
+            {
+                printf("-fjobs= must be a positive constant\n");
+                return 1;
+            }
+
+            jobs = get_constant_of<int>(view);
+        }
+        else if(view.starts_with("-fbatch="))
+        {
+            view.remove_prefix(strlen("-fbatch="));
+
+            batch_list = std::string(view);
+        }
+        else if(iequal(view, "-fsparse"))
+        {
+            sparse = true;
+        }
+        else if(view.starts_with("-ftrace="))
+        {
+            view.remove_prefix(strlen("-ftrace="));
+
+            trace_writer.path = std::string(view);
+            trace_enabled = true;
+        }
+        else if(view.starts_with("-f"))
+        {
+            printf("Argument not recognised ");
+            print_sv(view);
+        }
+        else
+        {
+            positional.push_back(std::string(view));
+        }
+    }
+
+    if(serve && serve_socket.size() == 0)
+        return !serve_stdio(ssett);
+
+    if(serve)
+    {
+        #ifdef _WIN32
+        printf("-fserve=socket is not supported on windows, use -fserve\n");
+        return 1;
+        #else
+        serve_unix_socket(serve_socket, ssett);
+
+        printf("Could not listen on ");
+        print_sv(serve_socket);
+        return 1;
+        #endif
+    }
+
+    if(batch_list.size() > 0)
+    {
+        ///these all describe a single image, so there's nothing sensible to do with them for a whole list of sources
+        const char* single_image_flag = nullptr;
+
+        if(run)
+            single_image_flag = "-frun";
+        else if(profile_in.size() > 0)
+            single_image_flag = "-fprofile";
+        else if(profile_out.size() > 0)
+            single_image_flag = "-fprofile-out";
+        else if(sett.collect_stats)
+            single_image_flag = "-fstats";
+        else if(layout_in.size() > 0)
+            single_image_flag = "-flayout";
+        else if(gc)
+            single_image_flag = "-fgc";
+        else if(symbols_out.size() > 0)
+            single_image_flag = "-fsymbols";
+        else if(jobs > 1)
+            single_image_flag = "-fjobs";
+        else if(positional.size() > 0)
+            single_image_flag = "a source file";
+
+        if(single_image_flag != nullptr)
+        {
+            printf("-fbatch can't be combined with %s, use -fworkers to parallelise a batch\n", single_image_flag);
+            return 1;
+        }
+
+        auto list_opt = read_whole_file(batch_list);
+
+        if(!list_opt.has_value())
+        {
+            printf("Could not read %s\n", batch_list.c_str());
+            return 1;
+        }
+
+        batch_settings bsett;
+        bsett.workers = ssett.workers;
+
+        if(sparse)
+            bsett.encode_image = sparse_image;
+
+        batch_result res = assemble_batch(parse_batch_list(list_opt.value()), sett, bsett);
+
+        print_batch_report(stdout, res);
+
+        return res.failures.size() > 0;
+    }
+
+    if(positional.size() == 0)
+    {
+        printf("No source file provided\n");
+        return 1;
+    }
+
+    ///to name where the program stopped
+    if(run)
+        sett.collect_symbols = true;
+
+    trace_scope file_trace("file", "file", positional[0]);
+
+    loader.base_directory = std::string(directory_of(positional[0]));
+
+    std::string file;
+
+    {
+        trace_scope trace("read", "io");
+
+        auto file_opt = read_whole_file(positional[0]);
+
+        if(!file_opt.has_value())
+        {
+            printf("Could not read %s\n", positional[0].c_str());
+            return 1;
+        }
+
+        file = std::move(file_opt.value());
+    }
+
+    std::vector<profile_entry> profile;
+    std::string profile_text;
+
+    if(profile_in.size() > 0)
+    {
+        profile_text = read_file(profile_in);
+
+        auto [entries, bad_line] = parse_profile(profile_text);
+
+        if(bad_line.has_value())
+        {
+            printf("Malformed profile on line %i\n", bad_line.value());
+            return 1;
+        }
+
+        profile = std::move(entries);
+    }
+
+    std::vector<section_placement> layout;
+    std::string layout_text;
+
+    if(layout_in.size() > 0)
+    {
+        layout_text = read_file(layout_in);
+
+        auto [placements, bad_line] = parse_link_layout(layout_text);
+
+        if(bad_line.has_value())
+        {
+            printf("Malformed layout on line %i\n", bad_line.value());
+            return 1;
+        }
+
+        layout = std::move(placements);
     }
 
-    std::string file = read_file(argv[1]);
+    std::array<link_unit, 1> units{link_unit{positional[0], file}};
 
-    auto [data_opt, err] = assemble(file);
+    auto [data_opt, err] = gc ? link_gc(units, layout, sett) :
+                           layout_in.size() > 0 ? link(units, layout, sett) :
+                           profile_in.size() > 0 ? assemble_with_profile(file, profile, sett) :
+                           jobs > 1 ? assemble_parallel(file, sett, jobs) : assemble(file, sett);
 
     if(!data_opt.has_value())
     {
@@ -170,45 +1914,111 @@ int main(int argc, char* argv[])
         printf("Character: %i", err.character);
         printf("Line %i\n", err.line);
 
+        if(err.file.size() > 0)
+        {
+            printf("In file: ");
+            print_sv(err.file);
+        }
+
         return 1;
     }
 
-    std::string_view write((char*)&data_opt.value().mem.svec[0], data_opt.value().mem.idx * sizeof(uint16_t) / sizeof(char));
-
-    if(argc == 2)
-    {
-        std::string out_name = std::string(argv[1]) + ".asm";
+    if(data_opt.value().stats.has_value())
+        print_assembly_stats(stdout, data_opt.value().stats.value());
 
-        write_all_bin(out_name, write);
+    if(data_opt.value().sections.size() > 0)
+        print_section_map(stdout, data_opt.value());
 
-        return 0;
+    for(size_t i=0; i < data_opt.value().removed_words.size(); i++)
+    {
+        printf("Stripped %u unreachable words from %s\n", data_opt.value().removed_words[i], units[i].name.data());
     }
 
-    if(argc == 3)
+    if(symbols_out.size() > 0)
+        write_all_bin(symbols_out, data_opt.value().symbols.value().serialize());
+
+    if(run && msett.cores > 1)
     {
-        std::string out_name = std::string(argv[2]);
+        trace_scope trace("run", "emulator");
 
-        write_all_bin(out_name, write);
+        msett.max_cycles = max_cycles;
 
-        return 0;
+        multicore_result res = run_multicore(data_opt.value(), msett);
+
+        print_multicore_report(stdout, res);
+
+        return res.deadlocked;
     }
 
-    /*for(int i=1; i < argc - 1; i++)
+    if(run)
     {
-        std::string_view view(argv[i]);
-        std::string_view next(argv[i + 1]);
+        trace_scope trace("run", "emulator");
 
-        if(view.starts_with("-f"))
-        {
-            std::cout << "Argument not recognised " << view << std::endl;
-            continue;
-        }
+        std::unique_ptr<dcpu> cpu = std::make_unique<dcpu>();
+        std::unique_ptr<execution_profile> prof = std::make_unique<execution_profile>();
+
+        cpu->profile = prof.get();
+        cpu->load(data_opt.value());
+        cpu->run(max_cycles);
+
+        print_source_heatmap(stdout, file, data_opt.value(), *prof);
 
-        if(view.starts_with("-o"))
+        if(profile_out.size() > 0)
         {
+            FILE* pfile = fopen(profile_out.c_str(), "w");
 
+            if(pfile)
+            {
+                write_pc_profile(pfile, *prof);
+                fclose(pfile);
+            }
         }
-    }*/
+
+        printf("Executed %llu instructions in %llu cycles, ", (unsigned long long)cpu->instructions, (unsigned long long)cpu->cycles);
+
+        if(cpu->state == dcpu_state::HALTED)
+            printf("halted at 0x%04x", cpu->pc);
+        else if(cpu->state == dcpu_state::FAULTED)
+            printf("faulted at 0x%04x", cpu->pc);
+        else
+            printf("cycle limit reached at 0x%04x", cpu->pc);
+
+        auto symbol_opt = data_opt.value().symbols.value().symbolize(cpu->pc);
+
+        if(symbol_opt.has_value())
+            printf(" (%.*s+%u)", (int)symbol_opt.value().first.size(), symbol_opt.value().first.data(), symbol_opt.value().second);
+
+        printf("\n");
+
+        printf("A %04x B %04x C %04x X %04x Y %04x Z %04x I %04x J %04x SP %04x EX %04x\n",
+               cpu->regs[0], cpu->regs[1], cpu->regs[2], cpu->regs[3], cpu->regs[4], cpu->regs[5], cpu->regs[6], cpu->regs[7], cpu->sp, cpu->ex);
+
+        return cpu->state == dcpu_state::FAULTED;
+    }
+
+    std::string_view write((char*)&data_opt.value().mem.svec[0], data_opt.value().mem.idx * sizeof(uint16_t) / sizeof(char));
+    std::string sparse_write;
+
+    if(sparse)
+    {
+        sparse_write = sparse_image(data_opt.value());
+        write = sparse_write;
+    }
+
+    trace_scope write_trace("write", "io");
+
+    if(positional.size() == 1)
+    {
+        std::string out_name = positional[0] + ".asm";
+
+        write_all_bin(out_name, write);
+
+        return 0;
+    }
+
+    std::string out_name = positional[1];
+
+    write_all_bin(out_name, write);
 
     return 0;
 }
@@ -0,0 +1,268 @@
+#ifndef MULTICORE_HPP_INCLUDED
+#define MULTICORE_HPP_INCLUDED
+
+#include <stdio.h>
+#include <thread>
+#include <vector>
+#include <memory>
+#include "base_asm_fwd.hpp"
+#include "channel.hpp"
+#include "emulator.hpp"
+
+struct multicore_settings
+{
+    int cores = 2;
+    int channels = 16;
+    int channel_capacity = 2;
+    ///deterministic: the core with the fewest elapsed cycles always steps next, on a single host thread
+    ///otherwise every core free runs on its own host thread
+    bool lockstep = true;
+    ///per core
+    uint64_t max_cycles = 1000000000;
+};
+
+struct core_stats
+{
+    uint64_t instructions = 0;
+    uint64_t cycles = 0;
+    uint64_t stalled_cycles = 0;
+    dcpu_state::type state = dcpu_state::RUNNING;
+    uint16_t pc = 0;
+
+    double utilisation() const
+    {
+        if(cycles == 0)
+            return 0;
+
+        return (double)(cycles - stalled_cycles) / (double)cycles;
+    }
+};
+
+struct channel_stats
+{
+    uint64_t sends = 0;
+    uint64_t receives = 0;
+    uint64_t send_stalls = 0;
+    uint64_t receive_stalls = 0;
+};
+
+struct multicore_result
+{
+    std::vector<core_stats> cores;
+    std::vector<channel_stats> channels;
+    ///every core still running was blocked on a channel, with nothing left that could unblock it
+    bool deadlocked = false;
+};
+
+namespace multicore_detail
+{
+    inline
+    bool is_live(const dcpu& cpu, uint64_t max_cycles)
+    {
+        return (cpu.state == dcpu_state::RUNNING || cpu.state == dcpu_state::BLOCKED) && cpu.cycles < max_cycles;
+    }
+
+    inline
+    bool run_lockstep(std::vector<std::unique_ptr<dcpu>>& cpus, channel_network& network, const multicore_settings& sett)
+    {
+        ///number of steps in a row which stalled without any channel making progress
+        size_t stalled_steps = 0;
+        uint64_t last_progress = network.progress.load();
+
+        while(true)
+        {
+            dcpu* next = nullptr;
+            size_t live = 0;
+
+            for(auto& cpu : cpus)
+            {
+                if(!is_live(*cpu, sett.max_cycles))
+                    continue;
+
+                live++;
+
+                if(next == nullptr || cpu->cycles < next->cycles)
+                    next = cpu.get();
+            }
+
+            if(next == nullptr)
+                return false;
+
+            next->step();
+
+            uint64_t progress = network.progress.load();
+
+            if(next->state == dcpu_state::BLOCKED && progress == last_progress)
+                stalled_steps++;
+            else
+                stalled_steps = 0;
+
+            last_progress = progress;
+
+            ///every live core has had at least one chance to make progress since the last transfer
+            if(stalled_steps > live * 2)
+                return true;
+        }
+    }
+
+    inline
+    bool run_free(std::vector<std::unique_ptr<dcpu>>& cpus, channel_network& network, const multicore_settings& sett)
+    {
+        std::vector<std::atomic<int>> blocked(cpus.size());
+        std::atomic<bool> deadlocked{false};
+
+        auto all_stuck = [&]()
+        {
+            for(auto& b : blocked)
+            {
+                if(b.load(std::memory_order_relaxed) == 0)
+                    return false;
+            }
+
+            return true;
+        };
+
+        std::vector<std::thread> threads;
+
+        for(size_t i=0; i < cpus.size(); i++)
+        {
+            threads.emplace_back([&, i]()
+            {
+                dcpu& cpu = *cpus[i];
+
+                uint64_t blocked_since = 0;
+                int stuck_checks = 0;
+
+                while(is_live(cpu, sett.max_cycles) && !deadlocked.load(std::memory_order_relaxed))
+                {
+                    cpu.step();
+
+                    if(cpu.state != dcpu_state::BLOCKED)
+                    {
+                        blocked[i].store(0, std::memory_order_relaxed);
+                        stuck_checks = 0;
+                        continue;
+                    }
+
+                    uint64_t progress = network.progress.load();
+
+                    if(blocked[i].load(std::memory_order_relaxed) == 0 || progress != blocked_since)
+                    {
+                        blocked[i].store(1, std::memory_order_relaxed);
+                        blocked_since = progress;
+                        stuck_checks = 0;
+                    }
+                    else if(all_stuck() && ++stuck_checks > 10000)
+                    {
+                        deadlocked.store(true);
+                    }
+
+                    std::this_thread::yield();
+                }
+
+                ///a finished core can never unblock anyone else
+                blocked[i].store(1, std::memory_order_relaxed);
+            });
+        }
+
+        for(auto& t : threads)
+        {
+            t.join();
+        }
+
+        return deadlocked.load();
+    }
+}
+
+///runs the same image on every core. Each core starts with its index in register A
+inline
+multicore_result run_multicore(const return_info& rinfo, const multicore_settings& sett)
+{
+    channel_network network(sett.channels, sett.channel_capacity);
+
+    std::vector<std::unique_ptr<dcpu>> cpus;
+
+    for(int i=0; i < sett.cores; i++)
+    {
+        std::unique_ptr<dcpu> cpu = std::make_unique<dcpu>();
+
+        cpu->load(rinfo);
+        cpu->network = &network;
+        cpu->regs[0] = i;
+
+        cpus.push_back(std::move(cpu));
+    }
+
+    multicore_result result;
+
+    if(sett.lockstep)
+        result.deadlocked = multicore_detail::run_lockstep(cpus, network, sett);
+    else
+        result.deadlocked = multicore_detail::run_free(cpus, network, sett);
+
+    for(auto& cpu : cpus)
+    {
+        core_stats cs;
+        cs.instructions = cpu->instructions;
+        cs.cycles = cpu->cycles;
+        cs.stalled_cycles = cpu->stalled_cycles;
+        cs.state = cpu->state;
+        cs.pc = cpu->pc;
+
+        result.cores.push_back(cs);
+    }
+
+    for(size_t i=0; i < network.count; i++)
+    {
+        channel_stats cs;
+        cs.sends = network.channels[i].sends.load();
+        cs.receives = network.channels[i].receives.load();
+        cs.send_stalls = network.channels[i].send_stalls.load();
+        cs.receive_stalls = network.channels[i].receive_stalls.load();
+
+        result.channels.push_back(cs);
+    }
+
+    return result;
+}
+
+inline
+void print_multicore_report(FILE* out, const multicore_result& result)
+{
+    fprintf(out, "%5s %12s %12s %12s %7s %s\n", "core", "instructions", "cycles", "stalled", "util%", "state");
+
+    for(size_t i=0; i < result.cores.size(); i++)
+    {
+        const core_stats& cs = result.cores[i];
+
+        const char* state = "cycle limit";
+
+        if(cs.state == dcpu_state::HALTED)
+            state = "halted";
+        else if(cs.state == dcpu_state::FAULTED)
+            state = "faulted";
+        else if(cs.state == dcpu_state::BLOCKED)
+            state = "blocked";
+
+        fprintf(out, "%5zu %12llu %12llu %12llu %6.2f%% %s at 0x%04x\n", i, (unsigned long long)cs.instructions, (unsigned long long)cs.cycles,
+                (unsigned long long)cs.stalled_cycles, cs.utilisation() * 100., state, cs.pc);
+    }
+
+    fprintf(out, "%7s %12s %12s %12s %12s\n", "channel", "sends", "receives", "send stalls", "recv stalls");
+
+    for(size_t i=0; i < result.channels.size(); i++)
+    {
+        const channel_stats& cs = result.channels[i];
+
+        if(cs.sends == 0 && cs.receives == 0 && cs.send_stalls == 0 && cs.receive_stalls == 0)
+            continue;
+
+        fprintf(out, "%7zu %12llu %12llu %12llu %12llu\n", i, (unsigned long long)cs.sends, (unsigned long long)cs.receives,
+                (unsigned long long)cs.send_stalls, (unsigned long long)cs.receive_stalls);
+    }
+
+    if(result.deadlocked)
+        fprintf(out, "Deadlocked\n");
+}
+
+#endif // MULTICORE_HPP_INCLUDED
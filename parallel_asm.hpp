@@ -0,0 +1,428 @@
+#ifndef PARALLEL_ASM_HPP_INCLUDED
+#define PARALLEL_ASM_HPP_INCLUDED
+
+#include <optional>
+#include <span>
+#include <string_view>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#include "base_asm.hpp"
+
+///a run of whole top level lines of a source, and the .defs within it
+struct source_chunk
+{
+    std::string_view text;
+    std::vector<define> defines;
+};
+
+///splits text at top level line boundaries into at most max_chunks chunks, each at least min_bytes long except the last
+///only the first word of most lines is looked at. Empty when text uses anything whose effect on later lines isn't captured by
+///their labels and .defs, as then the chunks can't be assembled apart
+inline
+std::vector<source_chunk> split_source_chunks(std::string_view text, int max_chunks, size_t min_bytes)
+{
+    std::vector<source_chunk> ret;
+
+    size_t target = std::max(min_bytes, text.size() / std::max(max_chunks, 1));
+
+    source_chunk current;
+    current.text = text.substr(0, 0);
+
+    int repeat_depth = 0;
+
+    std::string_view remaining = text;
+
+    while(remaining.size() > 0)
+    {
+        size_t end = remaining.find('\n');
+        size_t line_length = end == std::string_view::npos ? remaining.size() : end + 1;
+        std::string_view line_text = remaining.substr(0, line_length);
+
+        std::string_view tokens = line_text;
+        auto first = consume_next(tokens, true);
+
+        while(is_label_definition(first))
+            first = consume_next(tokens, true);
+
+        std::string_view directive = first.starts_with('.') ? first.substr(1) : first;
+
+        for(std::string_view name : {"macro", "include", "incbin", "org", "section", "align", "reserve"})
+        {
+            if(iequal(directive, name))
+                return {};
+        }
+
+        if(get_conditional_directive(first) != conditional_directive::NONE)
+            return {};
+
+        if(iequal(directive, "repeat"))
+            repeat_depth++;
+
+        if(iequal(directive, "end"))
+            repeat_depth--;
+
+        if(iequal(directive, "def"))
+        {
+            define d;
+            d.name = consume_next(tokens, true);
+
+            if(peek_next(tokens, true) == ",")
+                consume_next(tokens, true);
+
+            std::string_view value = consume_next(tokens, true);
+
+            ///anything else fails to assemble either way
+            if(is_constant(value))
+            {
+                d.value = get_constant_of<uint16_t>(value);
+                current.defines.push_back(d);
+            }
+        }
+
+        current.text = std::string_view(current.text.data(), line_text.data() + line_text.size() - current.text.data());
+
+        remaining.remove_prefix(line_length);
+
+        if(repeat_depth == 0 && current.text.size() >= target && (int)ret.size() + 1 < max_chunks)
+        {
+            ret.push_back(std::move(current));
+
+            current = source_chunk();
+            current.text = remaining.substr(0, 0);
+        }
+    }
+
+    if(current.text.size() > 0)
+        ret.push_back(std::move(current));
+
+    return ret;
+}
+
+///assembles every chunk on its own thread, in two passes. The first finds how large each chunk is, with it placed clear of the
+///addresses that short literals can hold. The second assembles each at its real address, with every earlier chunk's labels and .defs
+///already known, exactly as they are part way through assembling the whole text. Forward references are left for a final serial pass
+///nullopt if the result could differ from assembling the whole text at once, such as when a chunk's size changed between the passes,
+///or anything failed. The caller then assembles the whole text, which also produces the same error as it normally would
+inline
+std::optional<return_info> assemble_chunks(std::string_view text, std::span<const source_chunk> chunks, const assembler_settings& sett)
+{
+    ///far enough in that no label in a chunk fits in a short literal, as none do once it's placed after an earlier chunk
+    constexpr uint16_t detached_location = 32;
+
+    assembler_settings chunk_sett = sett;
+    chunk_sett.allow_unresolved_symbols = true;
+    chunk_sett.label_values_to_extract.clear();
+    chunk_sett.progress = nullptr;
+    chunk_sett.collect_stats = false;
+
+    struct chunk_result
+    {
+        std::optional<return_info> rinfo;
+        prelude_snapshot state;
+        size_t location = 0;
+        size_t size = 0;
+        ///the number of provided_symbol_definitions it was assembled with, which come before its own .defs
+        size_t provided = 0;
+    };
+
+    std::vector<std::unique_ptr<chunk_result>> first(chunks.size());
+    std::vector<std::unique_ptr<chunk_result>> second(chunks.size());
+
+    ///assembles chunks from onwards into results, one thread each
+    auto run = [&](std::vector<std::unique_ptr<chunk_result>>& results, size_t from, auto&& settings_for)
+    {
+        std::vector<std::thread> threads;
+
+        for(size_t i=from; i < chunks.size(); i++)
+        {
+            results[i] = std::make_unique<chunk_result>();
+
+            threads.emplace_back([&, i]()
+            {
+                chunk_result& res = *results[i];
+
+                assembler_settings csett = settings_for(i);
+                std::array<std::string_view, 1> views{chunks[i].text};
+
+                res.location = csett.location;
+                res.provided = csett.provided_symbol_definitions.size();
+                ///built in place, as a return_info is too large for this thread's stack
+                res.rinfo.emplace();
+
+                if(assemble_blocks(res.rinfo.value(), text, views, csett, &res.state).has_value())
+                    res.rinfo.reset();
+
+                if(res.rinfo.has_value())
+                    res.size = res.rinfo.value().mem.size() - res.location;
+            });
+        }
+
+        for(std::thread& thread : threads)
+            thread.join();
+
+        for(size_t i=from; i < chunks.size(); i++)
+        {
+            if(!results[i]->rinfo.has_value())
+                return false;
+        }
+
+        return true;
+    };
+
+    auto top_level_labels = [](const chunk_result& res)
+    {
+        std::vector<const label*> ret;
+
+        for(const label& l : res.state.sym.definitions)
+        {
+            if(l.scope.size() == 0)
+                ret.push_back(&l);
+        }
+
+        return ret;
+    };
+
+    bool sized = run(first, 0, [&](size_t i)
+    {
+        assembler_settings csett = chunk_sett;
+
+        if(i > 0)
+            csett.location = detached_location;
+
+        for(size_t j=0; j < i; j++)
+        {
+            for(const define& d : chunks[j].defines)
+                csett.provided_symbol_definitions.push_back({d.value, d.name});
+        }
+
+        return csett;
+    });
+
+    if(!sized)
+        return std::nullopt;
+
+    std::vector<size_t> locations{sett.location};
+
+    for(size_t i=0; i < chunks.size(); i++)
+    {
+        locations.push_back(locations.back() + first[i]->size);
+    }
+
+    if(locations.back() > MEM_SIZE)
+        return std::nullopt;
+
+    ///with one name defined in two chunks, a later chunk would find its own first rather than the earlier one as a whole text would
+    std::unordered_set<std::string_view> seen;
+
+    for(const auto& res : first)
+    {
+        for(const label* l : top_level_labels(*res))
+        {
+            if(!seen.insert(l->name).second)
+                return std::nullopt;
+        }
+    }
+
+    ///what chunk i is told about the chunks before it
+    auto known_before = [&](size_t i)
+    {
+        std::vector<std::pair<uint16_t, std::string_view>> ret;
+
+        ///labels are found before defines, so they go first
+        for(size_t j=0; j < i; j++)
+        {
+            for(const label* l : top_level_labels(*first[j]))
+                ret.push_back({(uint16_t)(l->offset - first[j]->location + locations[j]), l->name});
+        }
+
+        for(auto provided : sett.provided_symbol_definitions)
+            ret.push_back(provided);
+
+        for(size_t j=0; j < i; j++)
+        {
+            for(const define& d : chunks[j].defines)
+                ret.push_back({d.value, d.name});
+        }
+
+        return ret;
+    };
+
+    std::vector<std::vector<std::pair<uint16_t, std::string_view>>> known(chunks.size());
+
+    for(size_t i=1; i < chunks.size(); i++)
+        known[i] = known_before(i);
+
+    ///the first chunk already knew everything it could, at its real location
+    second[0] = std::move(first[0]);
+
+    bool placed = run(second, 1, [&](size_t i)
+    {
+        assembler_settings csett = chunk_sett;
+        csett.location = locations[i];
+        csett.provided_symbol_definitions = known[i];
+
+        return csett;
+    });
+
+    if(!placed)
+        return std::nullopt;
+
+    for(size_t i=1; i < chunks.size(); i++)
+    {
+        std::vector<const label*> placed_labels = top_level_labels(*second[i]);
+        std::vector<const label*> sized_labels = top_level_labels(*first[i]);
+
+        if(second[i]->size != first[i]->size || placed_labels.size() != sized_labels.size())
+            return std::nullopt;
+
+        for(size_t l=0; l < placed_labels.size(); l++)
+        {
+            if(placed_labels[l]->offset - locations[i] != sized_labels[l]->offset - first[i]->location)
+                return std::nullopt;
+        }
+    }
+
+    ///the last chunk to emit anything already has the right tail on its maps, everything before it is copied over
+    size_t last = 0;
+
+    for(size_t i=0; i < chunks.size(); i++)
+    {
+        if(second[i]->size > 0)
+            last = i;
+    }
+
+    ///forward references from every chunk, gathered before the last chunk's result is taken over
+    std::vector<delayed_expression> pending;
+
+    for(const auto& res : second)
+    {
+        const std::vector<delayed_expression>& delayed = res->rinfo.value().unresolved_expressions;
+
+        pending.insert(pending.end(), delayed.begin(), delayed.end());
+    }
+
+    return_info ret = std::move(second[last]->rinfo.value());
+
+    size_t last_line = 0;
+
+    for(size_t i=0; i <= last; i++)
+    {
+        const chunk_result& res = *second[i];
+
+        if(res.size == 0)
+            continue;
+
+        const return_info& part = res.rinfo.value();
+
+        std::copy_n(part.mem.begin() + res.location, res.size, ret.mem.begin() + res.location);
+        std::copy_n(part.translation_map.begin() + res.location, res.size, ret.translation_map.begin() + res.location);
+        std::copy_n(part.pc_to_source_line.begin() + res.location, res.size, ret.pc_to_source_line.begin() + res.location);
+
+        ///each chunk maps the lines from the end of the one before it, up to its own last word's
+        size_t end_line = part.pc_to_source_line[res.location + res.size - 1];
+        size_t start_line = i == 0 ? 0 : last_line + 1;
+
+        for(size_t line = start_line; line <= end_line && line < ret.source_line_to_pc.size(); line++)
+            ret.source_line_to_pc[line] = part.source_line_to_pc[line];
+
+        last_line = end_line;
+    }
+
+    ret.segments.clear();
+
+    if(locations.back() > sett.location)
+        ret.segments.push_back({sett.location, (uint32_t)(locations.back() - sett.location)});
+
+    symbol_table all;
+
+    for(const auto& res : second)
+    {
+        for(const label* l : top_level_labels(*res))
+            all.definitions.push_back(*l);
+    }
+
+    for(auto [value, name] : sett.provided_symbol_definitions)
+        all.defines.push_back({value, name});
+
+    for(const auto& res : second)
+    {
+        for(size_t d = res->provided; d < res->state.sym.defines.size(); d++)
+            all.defines.push_back(res->state.sym.defines[d]);
+    }
+
+    std::vector<delayed_expression> unresolved;
+
+    for(const delayed_expression& delayed : pending)
+    {
+        if(resolve_delayed_expression(ret.mem, all, delayed, sett.allow_unresolved_symbols, unresolved).has_value())
+            return std::nullopt;
+    }
+
+    ret.unresolved_expressions = unresolved;
+    ret.exported_label_names.clear();
+
+    for(std::string_view l : sett.label_values_to_extract)
+    {
+        if(auto val_opt = all.get_symbol_definition(l, {}); val_opt.has_value())
+            ret.exported_label_names.push_back({val_opt.value(), std::string(l)});
+    }
+
+    for(const auto& res : second)
+    {
+        for(std::string_view l : res->state.sym.exports)
+        {
+            if(auto val_opt = all.get_symbol_definition(l, {}); val_opt.has_value())
+                ret.exported_label_names.push_back({val_opt.value(), std::string(l)});
+        }
+    }
+
+    if(sett.collect_symbols)
+    {
+        symbol_index symbols;
+
+        for(const auto& res : second)
+        {
+            for(const label& l : res->state.sym.definitions)
+                symbols.add(l.name, l.offset, l.scope.size());
+        }
+
+        symbols.build();
+
+        ret.symbols = std::move(symbols);
+    }
+
+    if(sett.progress != nullptr)
+        sett.progress(sett.progress_user, text.size(), ret.mem.size());
+
+    return ret;
+}
+
+///for very large single sources. Splits text into up to jobs chunks, and assembles them in parallel with assemble_chunks
+///the result is always the same as assemble's: whenever that can't be guaranteed, or when there's an error, the whole text is assembled serially
+inline
+std::pair<std::optional<return_info>, error_info> assemble_parallel(std::string_view text, assembler_settings sett, int jobs, size_t min_chunk_bytes = 1 << 16)
+{
+    trace_scope trace("assemble_parallel", "assembler");
+
+    ///budgets and stats describe assembling the whole text in one go
+    const assembly_budgets& budgets = sett.budgets;
+    bool budgeted = budgets.max_words != 0 || budgets.max_expansion_steps != 0 || budgets.max_repeat_depth != 0 || budgets.max_fixups != 0;
+
+    if(jobs > 1 && !budgeted && !sett.collect_stats && sett.prelude == nullptr)
+    {
+        std::vector<source_chunk> chunks = split_source_chunks(text, jobs, min_chunk_bytes);
+
+        if(chunks.size() > 1)
+        {
+            auto rinfo_opt = assemble_chunks(text, chunks, sett);
+
+            if(rinfo_opt.has_value())
+                return {std::move(rinfo_opt), error_info()};
+        }
+    }
+
+    return assemble(text, sett);
+}
+
+#endif // PARALLEL_ASM_HPP_INCLUDED
@@ -0,0 +1,142 @@
+#include "platform.hpp"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+uint64_t process_peak_memory_bytes()
+{
+    #ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+
+    if(K32GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return counters.PeakWorkingSetSize;
+
+    return 0;
+    #else
+    rusage usage;
+
+    if(getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+
+    #ifdef __APPLE__
+    return usage.ru_maxrss;
+    #else
+    return (uint64_t)usage.ru_maxrss * 1024;
+    #endif
+    #endif
+}
+
+std::optional<int64_t> file_modification_time(const std::string& path)
+{
+    #ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+
+    if(!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &attributes))
+        return std::nullopt;
+
+    return (((int64_t)attributes.ftLastWriteTime.dwHighDateTime << 32) | attributes.ftLastWriteTime.dwLowDateTime) * 100;
+    #else
+    struct stat st;
+
+    if(stat(path.c_str(), &st) != 0)
+        return std::nullopt;
+
+    #ifdef __APPLE__
+    return (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+    #else
+    return (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    #endif
+    #endif
+}
+
+std::optional<std::string_view> map_file(const std::string& path)
+{
+    #ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+    if(file == INVALID_HANDLE_VALUE)
+        return std::nullopt;
+
+    LARGE_INTEGER size;
+
+    if(!GetFileSizeEx(file, &size))
+    {
+        CloseHandle(file);
+        return std::nullopt;
+    }
+
+    ///empty files can't be mapped
+    if(size.QuadPart == 0)
+    {
+        CloseHandle(file);
+        return std::string_view();
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+
+    CloseHandle(file);
+
+    if(mapping == nullptr)
+        return std::nullopt;
+
+    void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+
+    CloseHandle(mapping);
+
+    if(data == nullptr)
+        return std::nullopt;
+
+    return std::string_view((const char*)data, size.QuadPart);
+    #else
+    int fd = open(path.c_str(), O_RDONLY);
+
+    if(fd < 0)
+        return std::nullopt;
+
+    struct stat st;
+
+    if(fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return std::nullopt;
+    }
+
+    ///empty files can't be mapped
+    if(st.st_size == 0)
+    {
+        close(fd);
+        return std::string_view();
+    }
+
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    close(fd);
+
+    if(data == MAP_FAILED)
+        return std::nullopt;
+
+    return std::string_view((const char*)data, st.st_size);
+    #endif
+}
+
+void unmap_file(std::string_view mapped)
+{
+    if(mapped.size() == 0)
+        return;
+
+    #ifdef _WIN32
+    UnmapViewOfFile(mapped.data());
+    #else
+    munmap((void*)mapped.data(), mapped.size());
+    #endif
+}
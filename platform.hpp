@@ -0,0 +1,20 @@
+#ifndef PLATFORM_HPP_INCLUDED
+#define PLATFORM_HPP_INCLUDED
+
+#include <optional>
+#include <string>
+#include <string_view>
+#include <stdint.h>
+
+///operating system calls, implemented in platform.cpp so that windows.h and its macros stay out of every other translation unit
+
+uint64_t process_peak_memory_bytes();
+
+///nanoseconds, nullopt if the file doesn't exist
+std::optional<int64_t> file_modification_time(const std::string& path);
+
+///read only. Empty files give an empty view, which isn't a mapping and doesn't need unmapping
+std::optional<std::string_view> map_file(const std::string& path);
+void unmap_file(std::string_view mapped);
+
+#endif // PLATFORM_HPP_INCLUDED
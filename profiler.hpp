@@ -0,0 +1,115 @@
+#ifndef PROFILER_HPP_INCLUDED
+#define PROFILER_HPP_INCLUDED
+
+#include <stdio.h>
+#include <string_view>
+#include <vector>
+#include "base_asm_fwd.hpp"
+#include "emulator.hpp"
+
+struct source_line_profile
+{
+    uint64_t hits = 0;
+    uint64_t cycles = 0;
+    ///first source character of the hottest instruction on this line
+    uint16_t character = 0;
+    uint64_t hottest = 0;
+};
+
+///folds a per pc profile back onto the source it was assembled from. Words from included files aren't part of it
+inline
+std::vector<source_line_profile> profile_source_lines(std::string_view source, const return_info& rinfo, const execution_profile& prof)
+{
+    size_t line_count = 1;
+
+    for(char c : source)
+    {
+        if(c == '\n')
+            line_count++;
+    }
+
+    std::vector<source_line_profile> lines(line_count);
+
+    for(size_t pc=0; pc < rinfo.mem.size(); pc++)
+    {
+        if(prof.hits[pc] == 0 || rinfo.file_of(pc) != 0)
+            continue;
+
+        size_t line = rinfo.pc_to_source_line[pc];
+
+        if(line >= lines.size())
+            continue;
+
+        source_line_profile& lp = lines[line];
+
+        lp.hits += prof.hits[pc];
+        lp.cycles += prof.cycles[pc];
+
+        if(prof.cycles[pc] > lp.hottest)
+        {
+            lp.hottest = prof.cycles[pc];
+            lp.character = rinfo.translation_map[pc];
+        }
+    }
+
+    return lines;
+}
+
+///prints every source line annotated with its share of the executed cycles
+inline
+void print_source_heatmap(FILE* out, std::string_view source, const return_info& rinfo, const execution_profile& prof)
+{
+    std::vector<source_line_profile> lines = profile_source_lines(source, rinfo, prof);
+
+    uint64_t total_cycles = 0;
+
+    for(const source_line_profile& lp : lines)
+    {
+        total_cycles += lp.cycles;
+    }
+
+    fprintf(out, "%7s %12s %12s  %s\n", "cycles%", "hits", "cycles", "source");
+
+    size_t line = 0;
+
+    while(true)
+    {
+        size_t end = source.find('\n');
+        std::string_view text = source.substr(0, end);
+
+        if(line < lines.size() && lines[line].hits > 0)
+        {
+            double fraction = total_cycles > 0 ? (double)lines[line].cycles * 100. / (double)total_cycles : 0.;
+
+            fprintf(out, "%6.2f%% %12llu %12llu  %.*s\n", fraction, (unsigned long long)lines[line].hits, (unsigned long long)lines[line].cycles, (int)text.size(), text.data());
+        }
+        else
+        {
+            fprintf(out, "%7s %12s %12s  %.*s\n", "", "", "", (int)text.size(), text.data());
+        }
+
+        line++;
+
+        if(end == std::string_view::npos)
+            break;
+
+        source.remove_prefix(end + 1);
+    }
+
+    fprintf(out, "Total cycles %llu\n", (unsigned long long)total_cycles);
+}
+
+///writes a profile which can be fed back into assemble_with_profile, one "0xpc count" line per executed instruction
+inline
+void write_pc_profile(FILE* out, const execution_profile& prof)
+{
+    for(size_t pc=0; pc < prof.hits.size(); pc++)
+    {
+        if(prof.hits[pc] == 0)
+            continue;
+
+        fprintf(out, "0x%04zx %llu\n", pc, (unsigned long long)prof.hits[pc]);
+    }
+}
+
+#endif // PROFILER_HPP_INCLUDED
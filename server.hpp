@@ -0,0 +1,649 @@
+#ifndef SERVER_HPP_INCLUDED
+#define SERVER_HPP_INCLUDED
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include <string.h>
+#include "base_asm.hpp"
+#include "file_cache.hpp"
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+///the -fserve protocol. Every message in either direction is a frame: a uint32_t length, then that many bytes of payload
+///all integers are little endian. Strings and word arrays are a uint32_t count followed by their contents
+///
+///request payload: uint32_t id, uint32_t serve_flags, uint16_t location, string source,
+///                 uint32_t definition count, then for each a uint16_t value and a string name
+///response payload: uint32_t id, uint8_t serve_status, uint64_t nanoseconds spent queued, uint64_t nanoseconds spent assembling, then
+///                  OK: words image, and with MAPS words translation_map and words pc_to_source_line, and with SYMBOLS string serialized symbol_index
+///                  ASSEMBLY_ERROR: int32_t line, int32_t character, string msg, string name_in_source, string file
+///                  MALFORMED_REQUEST: nothing more
+///responses are sent as soon as each request finishes, so pipelined requests can complete out of order. Match them up by id
+namespace serve_flags
+{
+    enum type : uint32_t
+    {
+        NO_PACKED_CONSTANTS = 1,
+        ALLOW_UNRESOLVED_SYMBOLS = 2,
+        MAPS = 4,
+        SYMBOLS = 8,
+    };
+}
+
+namespace serve_status
+{
+    enum type : uint8_t
+    {
+        OK,
+        ASSEMBLY_ERROR,
+        MALFORMED_REQUEST,
+    };
+}
+
+///anything larger is taken as a corrupt stream, which can't be resynchronised
+#define MAX_SERVE_FRAME (64 * 1024 * 1024)
+
+struct serve_request
+{
+    uint32_t id = 0;
+    uint32_t flags = 0;
+    uint16_t location = 0;
+    std::string source;
+    std::vector<std::pair<uint16_t, std::string>> definitions;
+};
+
+struct serve_response
+{
+    uint32_t id = 0;
+    serve_status::type status = serve_status::OK;
+    uint64_t queue_ns = 0;
+    uint64_t assemble_ns = 0;
+
+    std::vector<uint16_t> mem;
+    std::vector<uint16_t> translation_map;
+    std::vector<uint16_t> pc_to_source_line;
+    std::string symbols;
+
+    int32_t line = 0;
+    int32_t character = 0;
+    std::string msg;
+    std::string name_in_source;
+    std::string file;
+};
+
+struct frame_writer
+{
+    std::string data = std::string(sizeof(uint32_t), '\0');
+
+    template<typename T>
+    void put(T val)
+    {
+        for(size_t i=0; i < sizeof(T); i++)
+        {
+            data.push_back((char)(((uint64_t)val >> (i * 8)) & 0xff));
+        }
+    }
+
+    void put_string(std::string_view str)
+    {
+        put<uint32_t>(str.size());
+        data += str;
+    }
+
+    void put_words(std::span<const uint16_t> words)
+    {
+        put<uint32_t>(words.size());
+
+        for(uint16_t w : words)
+        {
+            put(w);
+        }
+    }
+
+    ///fills in the length prefix
+    std::string finish()
+    {
+        uint32_t length = data.size() - sizeof(uint32_t);
+
+        for(size_t i=0; i < sizeof(uint32_t); i++)
+        {
+            data[i] = (char)((length >> (i * 8)) & 0xff);
+        }
+
+        return std::move(data);
+    }
+};
+
+///reads past the end leave ok false and return zeroes, so a payload can be decoded in one go and checked once at the end
+struct frame_reader
+{
+    std::string_view data;
+    bool ok = true;
+
+    template<typename T>
+    T get()
+    {
+        if(data.size() < sizeof(T))
+        {
+            ok = false;
+            data = {};
+            return T();
+        }
+
+        uint64_t val = 0;
+
+        for(size_t i=0; i < sizeof(T); i++)
+        {
+            val |= (uint64_t)(uint8_t)data[i] << (i * 8);
+        }
+
+        data.remove_prefix(sizeof(T));
+
+        return (T)val;
+    }
+
+    std::string_view get_string()
+    {
+        uint32_t size = get<uint32_t>();
+
+        if(data.size() < size)
+        {
+            ok = false;
+            data = {};
+            return {};
+        }
+
+        std::string_view ret = data.substr(0, size);
+        data.remove_prefix(size);
+        return ret;
+    }
+
+    std::vector<uint16_t> get_words()
+    {
+        uint32_t count = get<uint32_t>();
+
+        if(data.size() / sizeof(uint16_t) < count)
+        {
+            ok = false;
+            data = {};
+            return {};
+        }
+
+        std::vector<uint16_t> ret;
+        ret.reserve(count);
+
+        for(uint32_t i=0; i < count; i++)
+        {
+            ret.push_back(get<uint16_t>());
+        }
+
+        return ret;
+    }
+};
+
+inline
+std::string encode_request(const serve_request& req)
+{
+    frame_writer out;
+    out.put(req.id);
+    out.put(req.flags);
+    out.put(req.location);
+    out.put_string(req.source);
+    out.put<uint32_t>(req.definitions.size());
+
+    for(const auto& [value, name] : req.definitions)
+    {
+        out.put(value);
+        out.put_string(name);
+    }
+
+    return out.finish();
+}
+
+inline
+std::optional<serve_request> decode_request(std::string_view payload)
+{
+    frame_reader in{payload};
+
+    serve_request req;
+    req.id = in.get<uint32_t>();
+    req.flags = in.get<uint32_t>();
+    req.location = in.get<uint16_t>();
+    req.source = std::string(in.get_string());
+
+    uint32_t definitions = in.get<uint32_t>();
+
+    for(uint32_t i=0; i < definitions && in.ok; i++)
+    {
+        uint16_t value = in.get<uint16_t>();
+        req.definitions.push_back({value, std::string(in.get_string())});
+    }
+
+    if(!in.ok || in.data.size() != 0)
+        return std::nullopt;
+
+    return req;
+}
+
+///flags are those of the request, which decide what an OK response carries
+inline
+std::string encode_response(const serve_response& resp, uint32_t flags)
+{
+    frame_writer out;
+    out.put(resp.id);
+    out.put<uint8_t>(resp.status);
+    out.put(resp.queue_ns);
+    out.put(resp.assemble_ns);
+
+    if(resp.status == serve_status::OK)
+    {
+        out.put_words(resp.mem);
+
+        if(flags & serve_flags::MAPS)
+        {
+            out.put_words(resp.translation_map);
+            out.put_words(resp.pc_to_source_line);
+        }
+
+        if(flags & serve_flags::SYMBOLS)
+            out.put_string(resp.symbols);
+    }
+
+    if(resp.status == serve_status::ASSEMBLY_ERROR)
+    {
+        out.put(resp.line);
+        out.put(resp.character);
+        out.put_string(resp.msg);
+        out.put_string(resp.name_in_source);
+        out.put_string(resp.file);
+    }
+
+    return out.finish();
+}
+
+inline
+std::optional<serve_response> decode_response(std::string_view payload, uint32_t flags)
+{
+    frame_reader in{payload};
+
+    serve_response resp;
+    resp.id = in.get<uint32_t>();
+    resp.status = (serve_status::type)in.get<uint8_t>();
+    resp.queue_ns = in.get<uint64_t>();
+    resp.assemble_ns = in.get<uint64_t>();
+
+    if(resp.status == serve_status::OK)
+    {
+        resp.mem = in.get_words();
+
+        if(flags & serve_flags::MAPS)
+        {
+            resp.translation_map = in.get_words();
+            resp.pc_to_source_line = in.get_words();
+        }
+
+        if(flags & serve_flags::SYMBOLS)
+            resp.symbols = std::string(in.get_string());
+    }
+
+    if(resp.status == serve_status::ASSEMBLY_ERROR)
+    {
+        resp.line = in.get<int32_t>();
+        resp.character = in.get<int32_t>();
+        resp.msg = std::string(in.get_string());
+        resp.name_in_source = std::string(in.get_string());
+        resp.file = std::string(in.get_string());
+    }
+
+    if(!in.ok || in.data.size() != 0)
+        return std::nullopt;
+
+    return resp;
+}
+
+///include_root is the only directory .include and .incbin may read from. Empty disables them, as the paths come from the client
+inline
+serve_response handle_request(const serve_request& req, const assembly_budgets& budgets = assembly_budgets(), std::string_view include_root = {})
+{
+    auto start = std::chrono::steady_clock::now();
+
+    assembler_settings sett;
+    sett.no_packed_constants = (req.flags & serve_flags::NO_PACKED_CONSTANTS) != 0;
+    sett.allow_unresolved_symbols = (req.flags & serve_flags::ALLOW_UNRESOLVED_SYMBOLS) != 0;
+    sett.collect_symbols = (req.flags & serve_flags::SYMBOLS) != 0;
+    sett.location = req.location;
+    file_loader loader;
+    loader.root = std::string(include_root);
+
+    if(include_root.size() > 0)
+        loader.apply(sett);
+    sett.budgets = budgets;
+
+    for(const auto& [value, name] : req.definitions)
+    {
+        sett.provided_symbol_definitions.push_back({value, name});
+    }
+
+    serve_response resp;
+    resp.id = req.id;
+
+    ///return_info is too large for a worker's stack, so it's assembled straight into the heap
+    auto assembled = std::make_unique<return_info>();
+    auto err_opt = assemble(*assembled, req.source, sett);
+
+    if(!err_opt.has_value())
+    {
+        const return_info& rinfo = *assembled;
+
+        resp.mem.assign(rinfo.mem.begin(), rinfo.mem.end());
+
+        if(req.flags & serve_flags::MAPS)
+        {
+            resp.translation_map.assign(rinfo.translation_map.begin(), rinfo.translation_map.end());
+            resp.pc_to_source_line.assign(rinfo.pc_to_source_line.begin(), rinfo.pc_to_source_line.end());
+        }
+
+        if(rinfo.symbols.has_value())
+            resp.symbols = rinfo.symbols.value().serialize();
+    }
+    else
+    {
+        const error_info& err = err_opt.value();
+
+        resp.status = serve_status::ASSEMBLY_ERROR;
+        resp.line = err.line;
+        resp.character = err.character;
+        resp.msg = std::string(err.msg);
+        resp.name_in_source = std::string(err.name_in_source);
+        resp.file = std::string(err.file);
+    }
+
+    resp.assemble_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+    return resp;
+}
+
+inline
+bool read_exact(int fd, char* out, size_t size)
+{
+    while(size > 0)
+    {
+        #ifdef _WIN32
+        int got = _read(fd, out, size);
+        #else
+        ssize_t got = read(fd, out, size);
+        #endif
+
+        if(got <= 0)
+            return false;
+
+        out += got;
+        size -= got;
+    }
+
+    return true;
+}
+
+inline
+bool write_all(int fd, std::string_view data)
+{
+    while(data.size() > 0)
+    {
+        #ifdef _WIN32
+        int wrote = _write(fd, data.data(), data.size());
+        #else
+        ssize_t wrote = write(fd, data.data(), data.size());
+        #endif
+
+        if(wrote <= 0)
+            return false;
+
+        data.remove_prefix(wrote);
+    }
+
+    return true;
+}
+
+struct serve_settings
+{
+    ///0 picks one per hardware thread
+    int workers = 0;
+    ///requests read but not yet picked up by a worker. When full, reading stops until one is, which pushes back on the client
+    size_t queue_capacity = 64;
+    ///applied to every request, as nothing arriving over the wire can be trusted
+    assembly_budgets budgets = {0, 1 << 24, 16, 1 << 16};
+    ///the directory requests may .include and .incbin from. Empty, the default, refuses both
+    std::string include_root;
+};
+
+///a pool of worker threads which stay up between requests, so the file cache and allocator stay warm
+struct assembler_server
+{
+    ///where one client's responses go. Closed once the client has disconnected and its last response is written
+    struct connection
+    {
+        int out_fd = -1;
+        bool owns_fd = false;
+        std::mutex write_mut;
+
+        connection(int fd, bool owns) : out_fd(fd), owns_fd(owns){}
+
+        ~connection()
+        {
+            #ifndef _WIN32
+            if(owns_fd)
+                close(out_fd);
+            #endif
+        }
+    };
+
+    struct job
+    {
+        std::string payload;
+        std::shared_ptr<connection> conn;
+        std::chrono::steady_clock::time_point queued;
+    };
+
+    std::mutex mut;
+    std::condition_variable has_job;
+    std::condition_variable has_space;
+    std::deque<job> jobs;
+    bool stopping = false;
+    size_t capacity = 64;
+    assembly_budgets budgets;
+    std::string include_root;
+
+    std::vector<std::thread> workers;
+
+    assembler_server(serve_settings sett) : capacity(std::max(sett.queue_capacity, (size_t)1)), budgets(sett.budgets), include_root(sett.include_root)
+    {
+        int count = sett.workers > 0 ? sett.workers : std::max((int)std::thread::hardware_concurrency(), 1);
+
+        for(int i=0; i < count; i++)
+        {
+            workers.emplace_back([this](){work();});
+        }
+    }
+
+    ~assembler_server()
+    {
+        {
+            std::lock_guard guard(mut);
+            stopping = true;
+        }
+
+        has_job.notify_all();
+
+        for(auto& t : workers)
+        {
+            t.join();
+        }
+    }
+
+    void submit(job j)
+    {
+        std::unique_lock lock(mut);
+
+        has_space.wait(lock, [&](){return jobs.size() < capacity;});
+
+        jobs.push_back(std::move(j));
+
+        lock.unlock();
+
+        has_job.notify_one();
+    }
+
+    ///finishes every queued job before returning once stopping
+    void work()
+    {
+        while(true)
+        {
+            std::unique_lock lock(mut);
+
+            has_job.wait(lock, [&](){return stopping || jobs.size() > 0;});
+
+            if(jobs.size() == 0)
+                return;
+
+            job j = std::move(jobs.front());
+            jobs.pop_front();
+
+            lock.unlock();
+
+            has_space.notify_one();
+
+            auto picked_up = std::chrono::steady_clock::now();
+
+            serve_response resp;
+            uint32_t flags = 0;
+
+            if(auto req_opt = decode_request(j.payload); req_opt.has_value())
+            {
+                resp = handle_request(req_opt.value(), budgets, include_root);
+                flags = req_opt.value().flags;
+            }
+            else
+            {
+                frame_reader in{j.payload};
+                resp.id = in.get<uint32_t>();
+                resp.status = serve_status::MALFORMED_REQUEST;
+            }
+
+            resp.queue_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(picked_up - j.queued).count();
+
+            std::string frame = encode_response(resp, flags);
+
+            std::lock_guard write_guard(j.conn->write_mut);
+            write_all(j.conn->out_fd, frame);
+        }
+    }
+
+    ///reads requests until in_fd is closed. Returns false if the stream was corrupt, in which case it's abandoned
+    bool serve_connection(int in_fd, std::shared_ptr<connection> conn)
+    {
+        while(true)
+        {
+            char length_bytes[sizeof(uint32_t)] = {};
+
+            if(!read_exact(in_fd, length_bytes, sizeof(length_bytes)))
+                return true;
+
+            frame_reader length_reader{std::string_view(length_bytes, sizeof(length_bytes))};
+            uint32_t length = length_reader.get<uint32_t>();
+
+            if(length > MAX_SERVE_FRAME)
+                return false;
+
+            job j;
+            j.payload.resize(length);
+            j.conn = conn;
+
+            if(!read_exact(in_fd, j.payload.data(), length))
+                return false;
+
+            j.queued = std::chrono::steady_clock::now();
+
+            submit(std::move(j));
+        }
+    }
+};
+
+///serves requests from stdin, responding on stdout, until stdin is closed
+inline
+bool serve_stdio(serve_settings sett)
+{
+    #ifdef _WIN32
+    _setmode(0, _O_BINARY);
+    _setmode(1, _O_BINARY);
+    #else
+    signal(SIGPIPE, SIG_IGN);
+    #endif
+
+    assembler_server server(sett);
+
+    return server.serve_connection(0, std::make_shared<assembler_server::connection>(1, false));
+}
+
+#ifndef _WIN32
+///listens on a unix domain socket at path, serving every client which connects with the same pool. Only returns on failure
+inline
+bool serve_unix_socket(const std::string& path, serve_settings sett)
+{
+    ///a client which disconnects early shouldn't take the server with it
+    signal(SIGPIPE, SIG_IGN);
+
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+
+    if(path.size() >= sizeof(addr.sun_path))
+        return false;
+
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if(listener < 0)
+        return false;
+
+    unlink(path.c_str());
+
+    if(bind(listener, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, 16) != 0)
+    {
+        close(listener);
+        return false;
+    }
+
+    assembler_server server(sett);
+
+    while(true)
+    {
+        int client = accept(listener, nullptr, nullptr);
+
+        if(client < 0)
+            continue;
+
+        auto conn = std::make_shared<assembler_server::connection>(client, true);
+
+        std::thread([&server, client, conn](){server.serve_connection(client, conn);}).detach();
+    }
+}
+#endif
+
+#endif // SERVER_HPP_INCLUDED
@@ -3,43 +3,103 @@
 
 #include <array>
 #include <span>
+#include <string_view>
+#include <algorithm>
+#include <type_traits>
+#include <string.h>
 
+///at runtime the storage is left uninitialized, so that constructing one only costs what is actually used
+///constant evaluation can't read uninitialized memory, so there it is zeroed
+///pushing past the end is not an error, but the element is dropped and overflowed() is set. size() never goes past max_size,
+///so begin() to end(), data() and as_span() only ever cover elements which are actually stored
 template<typename T, int N>
 struct stack_vector
 {
     std::array<T, N> svec;
     size_t idx = 0;
+    bool overflow = false;
     static constexpr int max_size = N;
 
     constexpr
-    stack_vector() : svec{}, idx(0)
+    stack_vector() : idx(0)
     {
-
+        if(std::is_constant_evaluated())
+            svec = {};
     }
 
     constexpr
     void push_back(const T& in)
     {
-        svec[idx] = in;
-        idx++;
+        if(idx < (size_t)N)
+            svec[idx++] = in;
+        else
+            overflow = true;
+    }
+
+    ///new elements are value initialised. Clamped to max_size
+    constexpr
+    void resize(size_t new_size)
+    {
+        if(new_size > (size_t)N)
+            overflow = true;
+
+        new_size = std::min(new_size, (size_t)N);
+
+        for(size_t i=idx; i < new_size; i++)
+            svec[i] = T();
+
+        idx = new_size;
     }
 
     constexpr
     void pop_back()
     {
-        idx--;
+        if(idx > 0)
+            idx--;
     }
 
+    ///count copies of val in one go. Like push_back, whatever doesn't fit is dropped
     constexpr
-    T& emplace_back()
+    void append_fill(size_t count, const T& val)
     {
-        svec[idx] = T();
+        size_t fits = std::min(count, N - idx);
 
-        T& val = svec[idx];
+        std::fill_n(svec.begin() + idx, fits, val);
 
-        idx++;
+        idx += fits;
+        overflow = overflow || fits < count;
+    }
+
+    ///widens each character into its own element
+    constexpr
+    void append_chars(std::string_view chars)
+    {
+        size_t fits = std::min(chars.size(), N - idx);
+
+        for(size_t i=0; i < fits; i++)
+            svec[idx + i] = (uint8_t)chars[i];
+
+        idx += fits;
+        overflow = overflow || fits < chars.size();
+    }
+
+    ///copies raw elements in bulk. Like push_back, whatever doesn't fit is dropped
+    void append_raw(const void* data, size_t count)
+    {
+        size_t fits = std::min(count, N - idx);
+
+        if(fits > 0)
+            memcpy(&svec[idx], data, fits * sizeof(T));
 
-        return val;
+        idx += fits;
+        overflow = overflow || fits < count;
+    }
+
+    ///whether anything has been dropped since construction or the last clear()
+    constexpr
+    bool overflowed() const
+    {
+        return overflow;
     }
 
     constexpr
@@ -72,6 +132,18 @@ struct stack_vector
         return svec.begin() + idx;
     }
 
+    constexpr
+    auto begin() const
+    {
+        return svec.begin();
+    }
+
+    constexpr
+    auto end() const
+    {
+        return svec.begin() + idx;
+    }
+
     constexpr
     auto& back()
     {
@@ -106,6 +178,7 @@ struct stack_vector
     void clear()
     {
         idx = 0;
+        overflow = false;
     }
 
     constexpr
@@ -114,16 +187,84 @@ struct stack_vector
         return std::span<T>{begin(), end()};
     }
 
+    ///the gap left at the start is zeroed. Does nothing if the result would not fit
     constexpr
     void shift_contents_right(size_t amount)
     {
-        if(idx + amount >= max_size)
+        if(idx + amount > max_size)
             return;
 
         std::copy_backward(begin(), end(), begin() + idx + amount);
+        std::fill(begin(), begin() + amount, T());
 
         idx += amount;
     }
 };
 
+///stores nothing and only counts, for passes which need to know how large their output will be
+///reads and writes through operator[] and back() all go to a single scratch element. N is the capacity of the stack_vector it
+///stands in for, which overflowed() compares against. Unlike there, size() keeps counting past it
+template<typename T, int N = 0x10000>
+struct size_only_vector
+{
+    T scratch = T();
+    size_t idx = 0;
+    static constexpr int max_size = N;
+
+    constexpr
+    void push_back(const T&)
+    {
+        idx++;
+    }
+
+    constexpr
+    T& operator[](std::size_t)
+    {
+        scratch = T();
+        return scratch;
+    }
+
+    constexpr
+    size_t size() const
+    {
+        return idx;
+    }
+
+    constexpr
+    bool overflowed() const
+    {
+        return idx > (size_t)N;
+    }
+
+    void append_raw(const void*, size_t count)
+    {
+        idx += count;
+    }
+
+    constexpr
+    void append_fill(size_t count, const T&)
+    {
+        idx += count;
+    }
+
+    constexpr
+    void append_chars(std::string_view chars)
+    {
+        idx += chars.size();
+    }
+
+    constexpr
+    void resize(size_t new_size)
+    {
+        idx = new_size;
+    }
+
+    constexpr
+    T& back()
+    {
+        scratch = T();
+        return scratch;
+    }
+};
+
 #endif // STACK_VECTOR_HPP_INCLUDED
@@ -0,0 +1,117 @@
+#ifndef STATS_HPP_INCLUDED
+#define STATS_HPP_INCLUDED
+
+#include <atomic>
+#include <chrono>
+#include <type_traits>
+#include <stdint.h>
+#include <stdio.h>
+
+///define DCPU16_ASM_NO_STATS to compile every counter and timer out of the assembler entirely
+///otherwise they cost one null check each, unless assembler_settings::collect_stats is set
+struct assembly_stats
+{
+    ///wall time per phase
+    uint64_t encode_ns = 0;
+    uint64_t fixup_ns = 0;
+    uint64_t export_ns = 0;
+
+    uint64_t tokens = 0;
+    uint64_t symbol_lookups = 0;
+    uint64_t scope_comparisons = 0;
+    uint64_t delayed_expressions = 0;
+    ///forward references patched the moment their label was defined, which never become delayed expressions
+    uint64_t backpatched_fixups = 0;
+    uint64_t repeat_iterations = 0;
+    uint64_t macro_expansions = 0;
+    ///only counted when the process has set allocation_counter
+    uint64_t allocations = 0;
+    ///of the whole process, when the assembly finished
+    uint64_t peak_memory_bytes = 0;
+
+    constexpr
+    assembly_stats& operator+=(const assembly_stats& other)
+    {
+        encode_ns += other.encode_ns;
+        fixup_ns += other.fixup_ns;
+        export_ns += other.export_ns;
+        tokens += other.tokens;
+        symbol_lookups += other.symbol_lookups;
+        scope_comparisons += other.scope_comparisons;
+        delayed_expressions += other.delayed_expressions;
+        backpatched_fixups += other.backpatched_fixups;
+        repeat_iterations += other.repeat_iterations;
+        macro_expansions += other.macro_expansions;
+        allocations += other.allocations;
+        peak_memory_bytes = peak_memory_bytes > other.peak_memory_bytes ? peak_memory_bytes : other.peak_memory_bytes;
+
+        return *this;
+    }
+};
+
+///processes which count their allocations, eg by replacing operator new, can point this at their counter
+inline std::atomic<uint64_t>* allocation_counter = nullptr;
+
+///likewise for peak memory, eg process_peak_memory_bytes from platform.cpp. Left null, the assembler stays header only
+inline uint64_t(*peak_memory_query)() = nullptr;
+
+#ifndef DCPU16_ASM_NO_STATS
+#define DCPU16_ASM_STAT(stats_ptr, counter, amount) do { if((stats_ptr) != nullptr) (stats_ptr)->counter += (amount); } while(0)
+#else
+#define DCPU16_ASM_STAT(stats_ptr, counter, amount) do {} while(0)
+#endif
+
+inline
+uint64_t current_allocation_count()
+{
+    if(allocation_counter == nullptr)
+        return 0;
+
+    return allocation_counter->load(std::memory_order_relaxed);
+}
+
+///adds the time from construction to destruction onto a phase of stats. Does nothing during constant evaluation, or when stats is null
+struct stats_timer
+{
+    #ifndef DCPU16_ASM_NO_STATS
+    assembly_stats* stats = nullptr;
+    uint64_t assembly_stats::* phase = nullptr;
+    std::chrono::steady_clock::time_point start;
+
+    constexpr
+    stats_timer(assembly_stats* _stats, uint64_t assembly_stats::* _phase) : stats(_stats), phase(_phase)
+    {
+        if(!std::is_constant_evaluated() && stats != nullptr)
+            start = std::chrono::steady_clock::now();
+    }
+
+    constexpr
+    ~stats_timer()
+    {
+        if(!std::is_constant_evaluated() && stats != nullptr)
+            stats->*phase += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+    #else
+    constexpr
+    stats_timer(assembly_stats*, uint64_t assembly_stats::*){}
+    #endif
+};
+
+inline
+void print_assembly_stats(FILE* out, const assembly_stats& stats)
+{
+    fprintf(out, "Encoding:            %10.3f ms\n", stats.encode_ns / 1e6);
+    fprintf(out, "Fixups:              %10.3f ms\n", stats.fixup_ns / 1e6);
+    fprintf(out, "Exports:             %10.3f ms\n", stats.export_ns / 1e6);
+    fprintf(out, "Tokens:              %10llu\n", (unsigned long long)stats.tokens);
+    fprintf(out, "Symbol lookups:      %10llu\n", (unsigned long long)stats.symbol_lookups);
+    fprintf(out, "Scope comparisons:   %10llu\n", (unsigned long long)stats.scope_comparisons);
+    fprintf(out, "Delayed expressions: %10llu\n", (unsigned long long)stats.delayed_expressions);
+    fprintf(out, "Backpatched fixups:  %10llu\n", (unsigned long long)stats.backpatched_fixups);
+    fprintf(out, "Repeat iterations:   %10llu\n", (unsigned long long)stats.repeat_iterations);
+    fprintf(out, "Macro expansions:    %10llu\n", (unsigned long long)stats.macro_expansions);
+    fprintf(out, "Allocations:         %10llu\n", (unsigned long long)stats.allocations);
+    fprintf(out, "Peak memory:         %10.2f MiB\n", stats.peak_memory_bytes / (1024. * 1024.));
+}
+
+#endif // STATS_HPP_INCLUDED
@@ -0,0 +1,264 @@
+#ifndef SYMBOL_INDEX_HPP_INCLUDED
+#define SYMBOL_INDEX_HPP_INCLUDED
+
+#include <algorithm>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <stdint.h>
+#include <string.h>
+
+///one label. Names live in the index's string pool
+struct symbol_entry
+{
+    uint32_t name_offset = 0;
+    uint16_t name_size = 0;
+    uint16_t address = 0;
+    ///0 for labels at the top level, one more for every .repeat or macro expansion they're inside
+    uint32_t scope_depth = 0;
+};
+
+constexpr
+uint32_t symbol_hash(std::string_view name)
+{
+    uint32_t hash = 2166136261u;
+
+    for(char c : name)
+    {
+        hash ^= (uint8_t)c;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+///lookups over an index which may be owned by a symbol_index, or mapped straight from a file written by symbol_index::serialize
+struct symbol_index_view
+{
+    ///sorted by address, then by scope depth
+    std::span<const symbol_entry> entries;
+    ///open addressing, a power of two in size. Each holds an index into entries + 1, or 0 when empty
+    std::span<const uint32_t> buckets;
+    std::string_view names;
+
+    constexpr
+    std::string_view name(const symbol_entry& entry) const
+    {
+        return names.substr(entry.name_offset, entry.name_size);
+    }
+
+    ///the closest label at or before pc, and how far past it pc is. Of several labels at the same address, the shallowest wins
+    constexpr
+    std::optional<std::pair<std::string_view, uint16_t>> symbolize(uint16_t pc) const
+    {
+        auto it = std::upper_bound(entries.begin(), entries.end(), pc, [](uint16_t val, const symbol_entry& entry){return val < entry.address;});
+
+        if(it == entries.begin())
+            return std::nullopt;
+
+        uint16_t address = std::prev(it)->address;
+
+        auto first = std::lower_bound(entries.begin(), it, address, [](const symbol_entry& entry, uint16_t val){return entry.address < val;});
+
+        return std::pair{name(*first), (uint16_t)(pc - address)};
+    }
+
+    ///where a label with this name is. A name defined in several scopes finds the shallowest
+    constexpr
+    std::optional<uint16_t> find(std::string_view label) const
+    {
+        if(buckets.size() == 0)
+            return std::nullopt;
+
+        size_t mask = buckets.size() - 1;
+
+        size_t i = symbol_hash(label) & mask;
+
+        ///bounded, so that a corrupt mapped file with no empty bucket can't loop forever
+        for(size_t probes=0; probes < buckets.size(); probes++, i = (i + 1) & mask)
+        {
+            if(buckets[i] == 0)
+                return std::nullopt;
+
+            const symbol_entry& entry = entries[buckets[i] - 1];
+
+            if(name(entry) == label)
+                return entry.address;
+        }
+
+        return std::nullopt;
+    }
+
+    ///validates a serialized index and points into it without copying. data must outlive the view, and be 4 byte aligned, which a mapped file always is
+    static
+    std::optional<symbol_index_view> from_bytes(std::string_view data);
+};
+
+///the serialized form is this header, then the entries, buckets and names one after another, in native byte order
+struct symbol_index_header
+{
+    char magic[4] = {'D', 'S', 'Y', 'M'};
+    uint32_t version = 1;
+    uint32_t entry_count = 0;
+    uint32_t bucket_count = 0;
+    uint32_t names_size = 0;
+};
+
+inline
+std::optional<symbol_index_view> symbol_index_view::from_bytes(std::string_view data)
+{
+    symbol_index_header header;
+
+    if(data.size() < sizeof(header) || ((uintptr_t)data.data() % alignof(symbol_entry)) != 0)
+        return std::nullopt;
+
+    symbol_index_header expected;
+    memcpy(&header, data.data(), sizeof(header));
+
+    if(memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 || header.version != expected.version)
+        return std::nullopt;
+
+    ///probing masks with the bucket count, so it must be a power of two
+    if(header.bucket_count < header.entry_count || (header.bucket_count & (header.bucket_count - 1)) != 0)
+        return std::nullopt;
+
+    uint64_t entries_bytes = (uint64_t)header.entry_count * sizeof(symbol_entry);
+    uint64_t buckets_bytes = (uint64_t)header.bucket_count * sizeof(uint32_t);
+
+    if(sizeof(header) + entries_bytes + buckets_bytes + header.names_size != data.size())
+        return std::nullopt;
+
+    symbol_index_view ret;
+    ret.entries = std::span<const symbol_entry>((const symbol_entry*)(data.data() + sizeof(header)), header.entry_count);
+    ret.buckets = std::span<const uint32_t>((const uint32_t*)(data.data() + sizeof(header) + entries_bytes), header.bucket_count);
+    ret.names = data.substr(sizeof(header) + entries_bytes + buckets_bytes);
+
+    for(const symbol_entry& entry : ret.entries)
+    {
+        if((uint64_t)entry.name_offset + entry.name_size > ret.names.size())
+            return std::nullopt;
+    }
+
+    for(uint32_t bucket : ret.buckets)
+    {
+        if(bucket > header.entry_count)
+            return std::nullopt;
+    }
+
+    return ret;
+}
+
+///every label of an assembly, kept when assembler_settings::collect_symbols is set
+///add labels in any order, then build before looking anything up
+struct symbol_index
+{
+    std::vector<symbol_entry> entries;
+    std::vector<uint32_t> buckets;
+    std::string names;
+
+    constexpr
+    void add(std::string_view name, uint16_t address, uint32_t scope_depth)
+    {
+        symbol_entry entry;
+        entry.name_offset = names.size();
+        entry.name_size = name.size();
+        entry.address = address;
+        entry.scope_depth = scope_depth;
+
+        names += name;
+        entries.push_back(entry);
+    }
+
+    constexpr
+    void build()
+    {
+        ///names are pooled in the order labels were added, so the offset keeps ties in definition order
+        std::sort(entries.begin(), entries.end(), [](const symbol_entry& e1, const symbol_entry& e2)
+        {
+            if(e1.address != e2.address)
+                return e1.address < e2.address;
+
+            if(e1.scope_depth != e2.scope_depth)
+                return e1.scope_depth < e2.scope_depth;
+
+            return e1.name_offset < e2.name_offset;
+        });
+
+        size_t bucket_count = 1;
+
+        while(bucket_count < entries.size() * 2)
+            bucket_count *= 2;
+
+        buckets.assign(entries.size() > 0 ? bucket_count : 0, 0);
+
+        size_t mask = buckets.size() - 1;
+
+        for(uint32_t idx=0; idx < (uint32_t)entries.size(); idx++)
+        {
+            std::string_view name = names_of(entries[idx]);
+
+            for(size_t i = symbol_hash(name) & mask;; i = (i + 1) & mask)
+            {
+                if(buckets[i] == 0)
+                {
+                    buckets[i] = idx + 1;
+                    break;
+                }
+
+                const symbol_entry& existing = entries[buckets[i] - 1];
+
+                if(names_of(existing) == name)
+                {
+                    if(entries[idx].scope_depth < existing.scope_depth)
+                        buckets[i] = idx + 1;
+
+                    break;
+                }
+            }
+        }
+    }
+
+    constexpr
+    symbol_index_view view() const
+    {
+        return {entries, buckets, names};
+    }
+
+    constexpr
+    std::optional<std::pair<std::string_view, uint16_t>> symbolize(uint16_t pc) const
+    {
+        return view().symbolize(pc);
+    }
+
+    constexpr
+    std::optional<uint16_t> find(std::string_view name) const
+    {
+        return view().find(name);
+    }
+
+    std::string serialize() const
+    {
+        symbol_index_header header;
+        header.entry_count = entries.size();
+        header.bucket_count = buckets.size();
+        header.names_size = names.size();
+
+        std::string ret;
+        ret.append((const char*)&header, sizeof(header));
+        ret.append((const char*)entries.data(), entries.size() * sizeof(symbol_entry));
+        ret.append((const char*)buckets.data(), buckets.size() * sizeof(uint32_t));
+        ret.append(names);
+
+        return ret;
+    }
+
+    constexpr
+    std::string_view names_of(const symbol_entry& entry) const
+    {
+        return std::string_view(names).substr(entry.name_offset, entry.name_size);
+    }
+};
+
+#endif // SYMBOL_INDEX_HPP_INCLUDED
@@ -0,0 +1,179 @@
+#ifndef TRACE_HPP_INCLUDED
+#define TRACE_HPP_INCLUDED
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+#include <stdint.h>
+#include <stdio.h>
+
+///timeline of assembler phases, written out in the chrome trace event format
+///load the output into chrome://tracing or https://ui.perfetto.dev
+struct trace_event
+{
+    std::string_view name;
+    std::string_view category;
+    std::string detail;
+    uint64_t start_ns = 0;
+    uint64_t duration_ns = 0;
+};
+
+///owned by a single thread, which is the only one that ever appends to it
+struct trace_buffer
+{
+    std::vector<trace_event> events;
+    uint32_t thread_id = 0;
+    trace_buffer* next = nullptr;
+};
+
+///every buffer ever created, pushed lock free. Buffers are never freed, so the events of exited threads are kept
+inline std::atomic<trace_buffer*> trace_buffers{nullptr};
+inline std::atomic<uint32_t> trace_next_thread_id{0};
+inline std::atomic<bool> trace_enabled{false};
+
+inline
+uint64_t trace_now_ns()
+{
+    static const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+inline
+trace_buffer& get_thread_trace_buffer()
+{
+    thread_local trace_buffer* buffer = nullptr;
+
+    if(buffer != nullptr)
+        return *buffer;
+
+    buffer = new trace_buffer;
+    buffer->thread_id = trace_next_thread_id.fetch_add(1);
+    buffer->next = trace_buffers.load(std::memory_order_relaxed);
+
+    while(!trace_buffers.compare_exchange_weak(buffer->next, buffer, std::memory_order_release, std::memory_order_relaxed)){}
+
+    return *buffer;
+}
+
+///records a span from construction to destruction. When tracing is disabled this is one relaxed load
+///name and category must outlive the trace, detail is copied
+struct trace_scope
+{
+    std::string_view name;
+    std::string_view category;
+    std::string_view detail;
+    uint64_t start_ns = 0;
+    bool active = false;
+
+    constexpr
+    trace_scope(std::string_view _name, std::string_view _category, std::string_view _detail = "") : name(_name), category(_category), detail(_detail)
+    {
+        if(std::is_constant_evaluated())
+            return;
+
+        if(!trace_enabled.load(std::memory_order_relaxed))
+            return;
+
+        active = true;
+        start_ns = trace_now_ns();
+    }
+
+    constexpr
+    ~trace_scope()
+    {
+        if(std::is_constant_evaluated() || !active)
+            return;
+
+        trace_event event;
+        event.name = name;
+        event.category = category;
+        event.detail = std::string(detail);
+        event.start_ns = start_ns;
+        event.duration_ns = trace_now_ns() - start_ns;
+
+        get_thread_trace_buffer().events.push_back(std::move(event));
+    }
+};
+
+inline
+void write_json_string(FILE* out, std::string_view in)
+{
+    fputc('"', out);
+
+    for(char c : in)
+    {
+        if(c == '"' || c == '\\')
+            fprintf(out, "\\%c", c);
+        else if((unsigned char)c < 0x20)
+            fprintf(out, "\\u%04x", (unsigned char)c);
+        else
+            fputc(c, out);
+    }
+
+    fputc('"', out);
+}
+
+///call once every traced thread has finished
+inline
+void write_chrome_trace(FILE* out)
+{
+    fprintf(out, "{\"traceEvents\":[\n");
+
+    bool first = true;
+
+    for(trace_buffer* buffer = trace_buffers.load(std::memory_order_acquire); buffer != nullptr; buffer = buffer->next)
+    {
+        for(const trace_event& event : buffer->events)
+        {
+            if(!first)
+                fprintf(out, ",\n");
+
+            first = false;
+
+            fprintf(out, "{\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"name\":", buffer->thread_id, event.start_ns / 1000., event.duration_ns / 1000.);
+            write_json_string(out, event.name);
+            fprintf(out, ",\"cat\":");
+            write_json_string(out, event.category);
+
+            if(event.detail.size() > 0)
+            {
+                fprintf(out, ",\"args\":{\"detail\":");
+                write_json_string(out, event.detail);
+                fprintf(out, "}");
+            }
+
+            fprintf(out, "}");
+        }
+    }
+
+    fprintf(out, "\n],\"displayTimeUnit\":\"ms\"}\n");
+}
+
+///writes the trace to path when it goes out of scope, so declare it before any traced scope it should capture
+struct trace_file_writer
+{
+    std::string path;
+
+    ~trace_file_writer()
+    {
+        if(path.size() == 0)
+            return;
+
+        FILE* out = fopen(path.c_str(), "w");
+
+        if(out == nullptr)
+        {
+            printf("Could not write trace to %s\n", path.c_str());
+            return;
+        }
+
+        write_chrome_trace(out);
+        fclose(out);
+    }
+};
+
+#endif // TRACE_HPP_INCLUDED
@@ -414,6 +414,22 @@ constexpr T get_constant_of(std::string_view in)
         return n;
 }
 
+///whether a constant fits in a word, either as itself or as a negative number in two's complement
+constexpr bool constant_fits_word(std::string_view in)
+{
+    if(is_string(in))
+        return true;
+
+    bool is_neg = in.starts_with('-');
+
+    if(is_neg)
+        in.remove_prefix(1);
+
+    std::uint64_t n = get_constant_of<std::uint64_t>(in);
+
+    return is_neg ? n <= 0x8000 : n <= 0xffff;
+}
+
 constexpr bool isalnum_c(char in)
 {
     if(in >= 'a' && in <= 'z')